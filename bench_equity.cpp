@@ -0,0 +1,424 @@
+// Benchmarks for EquityCalculator. Runs a fixed catalog of scenarios with both enumeration and monte carlo and
+// writes the results as JSON, so that they can be compared between builds. With --scaling runs some of the scenarios
+// instead with 1 to N threads and different update intervals and batch sizes. With --latency n fires n small
+// enumeration queries back to back and reports latency percentiles, split into setup, thread start and compute.
+// With --trace file.json the calculations are also recorded to a Chrome trace. With --placement 1 compares unpinned
+// threads to threads pinned to CPUs 0..N-1, with and without per NUMA node copies of the hand ranges.
+//
+// Usage: bench_equity [--out file.json] [--hands n] [--threads n] [--scaling 1] [--latency n] [--trace file.json]
+//                     [--placement 1]
+
+#include "omp/EquityCalculator.h"
+#include "omp/Random.h"
+#include <iostream>
+#include <fstream>
+#include <cstdlib>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+using namespace omp;
+
+struct Scenario
+{
+    string name;
+    vector<string> ranges;
+    string board;
+    // Some scenarios are far too big to enumerate.
+    bool enumerate;
+};
+
+static const vector<Scenario> SCENARIOS = {
+    {"hu_preflop", {"AK", "22+"}, "", true},
+    {"3way_wide", {"22+,A2s+,K9s+,QTs+,JTs,ATo+,KJo+", "random", "JJ+,AQs+,AKo"}, "", false},
+    {"6way_random", {"random", "random", "random", "random", "random", "random"}, "", false},
+    {"flop", {"AhKh", "QQ+,AK,T9s", "random"}, "Qh7h2c", true},
+    {"turn", {"random", "AA,KK", "T9s", "22-55"}, "Td9c2h3s", true},
+    {"ak_vs_ak_vs_ak", {"AK", "AK", "AK"}, "", true},
+};
+
+static const Scenario& findScenario(const string& name)
+{
+    return *find_if(SCENARIOS.begin(), SCENARIOS.end(), [&](const Scenario& s){ return s.name == name; });
+}
+
+// Shared by all calculations if tracing is enabled.
+static Tracer* tracer = nullptr;
+
+struct Settings
+{
+    uint64_t handLimit;
+    unsigned threads;
+    double updateInterval;
+    uint64_t batchSize;
+    // Thread placement, see setThreadAffinity().
+    enum Placement { DEFAULT, PINNED, REPLICATED } placement;
+};
+
+static const char* const PLACEMENT_NAMES[] = {"default", "pinned", "replicated"};
+
+struct Measurement
+{
+    string scenario;
+    bool enumerate;
+    Settings settings;
+    double wallTime;
+    EquityCalculator::Results results;
+    EquityCalculator::Profile profile;
+};
+
+static Measurement run(const Scenario& scenario, bool enumerate, const Settings& settings)
+{
+    vector<CardRange> ranges;
+    {
+        Tracer::Scope scope(tracer, "parse ranges");
+        ranges.assign(scenario.ranges.begin(), scenario.ranges.end());
+    }
+    EquityCalculator eq;
+    eq.setTracer(tracer);
+    eq.setHandLimit(enumerate ? 0 : settings.handLimit);
+    eq.setBatchSize(settings.batchSize);
+    if (settings.placement != Settings::DEFAULT) {
+        vector<unsigned> cpus(settings.threads);
+        for (unsigned i = 0; i < settings.threads; ++i)
+            cpus[i] = i;
+        eq.setThreadAffinity(cpus, settings.placement == Settings::REPLICATED);
+    }
+    auto t1 = chrono::high_resolution_clock::now();
+    if (!eq.start(ranges, CardRange::getCardMask(scenario.board), 0, enumerate, 0, nullptr, settings.updateInterval,
+                  settings.threads)) {
+        cerr << "Invalid scenario: " << scenario.name << endl;
+        exit(1);
+    }
+    eq.wait();
+    auto t2 = chrono::high_resolution_clock::now();
+    Measurement m = {scenario.name, enumerate, settings,
+                     1e-9 * chrono::duration_cast<chrono::nanoseconds>(t2 - t1).count(), eq.getResults(),
+                     eq.getProfile()};
+    cout << scenario.name << (enumerate ? " enumeration: " : " monte carlo: ") << m.results.hands << " hands  "
+         << (1e-6 * m.results.hands / m.wallTime) << "M/s  " << m.wallTime << "s  " << m.results.evaluations
+         << " evals  " << m.results.lookupHits << " lookup hits  " << m.results.lockWaitTime << "s lock wait"
+         << endl;
+    return m;
+}
+
+// Wall time with a single thread for the same scenario and mode, if it was measured.
+static double singleThreadTime(const vector<Measurement>& measurements, const Measurement& m)
+{
+    for (auto& m1 : measurements) {
+        if (m1.scenario == m.scenario && m1.enumerate == m.enumerate && m1.settings.threads == 1
+                && m1.settings.updateInterval == m.settings.updateInterval
+                && m1.settings.batchSize == m.settings.batchSize && m1.settings.placement == m.settings.placement)
+            return m1.wallTime;
+    }
+    return 0;
+}
+
+static void writeJson(ostream& os, const vector<Measurement>& measurements, uint64_t handLimit)
+{
+    os << "{\n  \"handLimit\": " << handLimit << ",\n  \"results\": [\n";
+    for (size_t i = 0; i < measurements.size(); ++i) {
+        const Measurement& m = measurements[i];
+        os << "    {\"scenario\": \"" << m.scenario << "\", \"mode\": \""
+           << (m.enumerate ? "enumeration" : "montecarlo") << "\", \"players\": " << m.results.players
+           << ", \"threads\": " << m.settings.threads << ", \"updateInterval\": " << m.settings.updateInterval
+           << ", \"batchSize\": " << m.settings.batchSize << ", \"placement\": \""
+           << PLACEMENT_NAMES[m.settings.placement] << "\""
+           << ", \"hands\": " << m.results.hands << ", \"evaluations\": " << m.results.evaluations
+           << ", \"lookupHits\": " << m.results.lookupHits << ", \"wallTime\": " << m.wallTime
+           << ", \"handsPerSecond\": " << m.results.hands / m.wallTime
+           << ", \"lockWaitTime\": " << m.results.lockWaitTime;
+        double t1 = singleThreadTime(measurements, m);
+        if (t1 > 0) {
+            double speedup = t1 / m.wallTime;
+            os << ", \"speedup\": " << speedup << ", \"efficiency\": " << speedup / m.settings.threads;
+        }
+        #if OMP_PROFILE
+        const EquityCalculator::Profile& p = m.profile;
+        os << ", \"profile\": {\"holeCardAttempts\": " << p.holeCardAttempts << ", \"holeCardRejections\": "
+           << p.holeCardRejections << ", \"boardRejections\": " << p.boardRejections << ", \"randomWalkSkips\": "
+           << p.randomWalkSkips << ", \"boardNodes\": [";
+        for (unsigned j = 0; j <= BOARD_CARDS; ++j)
+            os << (j ? ", " : "") << p.boardNodes[j];
+        os << "], \"foldedSubtrees\": " << p.foldedSubtrees << ", \"lookupHits\": " << p.lookupHits
+           << ", \"lookupMisses\": " << p.lookupMisses << ", \"updates\": " << p.updates << ", \"reservations\": "
+           << p.reservations << ", \"steals\": " << p.steals << ", \"threadTime\": " << p.threadTime << "}";
+        #endif
+        os << ", \"equity0\": " << m.results.equity[0] << "}" << (i + 1 < measurements.size() ? "," : "") << "\n";
+    }
+    os << "  ]\n}\n";
+}
+
+// Runs every scenario once with the given settings.
+static void runCatalog(const Settings& settings, vector<Measurement>& measurements)
+{
+    for (const Scenario& scenario : SCENARIOS) {
+        for (bool enumerate : {true, false}) {
+            if (enumerate && !scenario.enumerate)
+                continue;
+            measurements.push_back(run(scenario, enumerate, settings));
+        }
+    }
+}
+
+// Thread scalability of one enumeration and one monte carlo scenario, followed by the effect of update interval and
+// batch size with all threads.
+static void runScaling(const Settings& settings, vector<Measurement>& measurements)
+{
+    const Scenario& enumScenario = findScenario("hu_preflop");
+    const Scenario& mcScenario = findScenario("6way_random");
+
+    vector<unsigned> threadCounts;
+    for (unsigned n = 1; n < settings.threads; n *= 2)
+        threadCounts.push_back(n);
+    threadCounts.push_back(settings.threads);
+    for (unsigned threads : threadCounts) {
+        Settings s = settings;
+        s.threads = threads;
+        cout << threads << " threads:" << endl;
+        measurements.push_back(run(enumScenario, true, s));
+        measurements.push_back(run(mcScenario, false, s));
+    }
+
+    for (double updateInterval : {0.001, 0.01, 1.0}) {
+        Settings s = settings;
+        s.updateInterval = updateInterval;
+        cout << "Update interval " << updateInterval << "s:" << endl;
+        measurements.push_back(run(enumScenario, true, s));
+        measurements.push_back(run(mcScenario, false, s));
+    }
+
+    // Defaults are 2 million for enumeration and 4096 for monte carlo. Monte carlo only checks the hand limit between
+    // batches, so the batches have to stay well below it.
+    for (uint64_t batchSize : {200000, 20000000}) {
+        Settings s = settings;
+        s.batchSize = batchSize;
+        cout << "Batch size " << batchSize << ":" << endl;
+        measurements.push_back(run(enumScenario, true, s));
+    }
+    for (uint64_t batchSize : {256, 65536}) {
+        Settings s = settings;
+        s.batchSize = batchSize;
+        cout << "Batch size " << batchSize << ":" << endl;
+        measurements.push_back(run(mcScenario, false, s));
+    }
+}
+
+// Enumeration and monte carlo with all threads, first unpinned, then pinned to CPUs, and then pinned with the hand
+// ranges copied to each NUMA node. The difference shows mostly on multi-socket machines.
+static void runPlacement(const Settings& settings, vector<Measurement>& measurements)
+{
+    for (Settings::Placement placement : {Settings::DEFAULT, Settings::PINNED, Settings::REPLICATED}) {
+        Settings s = settings;
+        s.placement = placement;
+        cout << "Placement " << PLACEMENT_NAMES[placement] << ":" << endl;
+        measurements.push_back(run(findScenario("flop"), true, s));
+        measurements.push_back(run(findScenario("turn"), true, s));
+        measurements.push_back(run(findScenario("6way_random"), false, s));
+    }
+}
+
+// Small query of the kind that an online service gets.
+struct Query
+{
+    string type;
+    vector<CardRange> ranges;
+    uint64_t board;
+};
+
+// Latencies of one query type in seconds.
+struct Latencies
+{
+    string type;
+    vector<double> total, setup, threadStart, compute;
+};
+
+// Generates a deterministic mix of hand vs hand on flop and turn, and hand vs range on turn.
+static vector<Query> generateQueries(unsigned count)
+{
+    XoroShiro128Plus rng(0);
+    FastUniformIntDistribution<unsigned> cardDist(0, CARD_COUNT - 1);
+    uint64_t usedCards = 0;
+    auto dealCard = [&]{
+        unsigned card;
+        do {
+            card = cardDist(rng);
+        } while (usedCards & (1ull << card));
+        usedCards |= 1ull << card;
+        return (uint8_t)card;
+    };
+    auto dealBoard = [&](unsigned n){
+        uint64_t board = 0;
+        for (unsigned i = 0; i < n; ++i)
+            board |= 1ull << dealCard();
+        return board;
+    };
+
+    vector<Query> queries;
+    for (unsigned i = 0; i < count; ++i) {
+        usedCards = 0;
+        Query q;
+        CardRange hand(vector<array<uint8_t,2>>{{dealCard(), dealCard()}});
+        switch (i % 3) {
+        case 0:
+            q.type = "hand_vs_hand_flop";
+            q.ranges = {hand, CardRange(vector<array<uint8_t,2>>{{dealCard(), dealCard()}})};
+            q.board = dealBoard(3);
+            break;
+        case 1:
+            q.type = "hand_vs_hand_turn";
+            q.ranges = {hand, CardRange(vector<array<uint8_t,2>>{{dealCard(), dealCard()}})};
+            q.board = dealBoard(4);
+            break;
+        default:
+            q.type = "hand_vs_range_turn";
+            q.ranges = {hand, CardRange("22+,A2s+,K9s+,Q9s+,J9s+,T9s,ATo+,KTo+,QTo+,JTo")};
+            q.board = dealBoard(4);
+            break;
+        }
+        queries.push_back(q);
+    }
+    return queries;
+}
+
+static double percentile(vector<double> v, double p)
+{
+    sort(v.begin(), v.end());
+    return v[min(v.size() - 1, (size_t)(p * v.size()))];
+}
+
+static void writePercentiles(ostream& os, const char* name, const vector<double>& v)
+{
+    os << "\"" << name << "\": {\"p50\": " << percentile(v, 0.5) << ", \"p90\": " << percentile(v, 0.9)
+       << ", \"p99\": " << percentile(v, 0.99) << ", \"p999\": " << percentile(v, 0.999) << "}";
+}
+
+// Histogram of total latencies with power of two buckets in microseconds. Returns (upper bound, count) pairs.
+static vector<pair<double,unsigned>> latencyHistogram(const vector<double>& latencies)
+{
+    vector<pair<double,unsigned>> histogram;
+    for (double t : latencies) {
+        size_t bucket = 0;
+        while ((1u << bucket) < t * 1e6)
+            ++bucket;
+        for (size_t i = histogram.size(); i <= bucket; ++i)
+            histogram.emplace_back(1u << i, 0);
+        ++histogram[bucket].second;
+    }
+    return histogram;
+}
+
+static void runLatency(unsigned count, unsigned threads, ostream& os)
+{
+    vector<Query> queries = generateQueries(count);
+    vector<Latencies> latencies = {{"all", {}, {}, {}, {}}};
+    for (const Query& q : queries) {
+        EquityCalculator eq;
+        eq.setTracer(tracer);
+        auto t1 = chrono::high_resolution_clock::now();
+        eq.start(q.ranges, q.board, 0, true, 0, nullptr, 1.0, threads);
+        eq.wait();
+        auto t2 = chrono::high_resolution_clock::now();
+        auto r = eq.getResults();
+        double total = 1e-9 * chrono::duration_cast<chrono::nanoseconds>(t2 - t1).count();
+
+        auto it = find_if(latencies.begin(), latencies.end(), [&](const Latencies& l){ return l.type == q.type; });
+        if (it == latencies.end())
+            it = latencies.insert(latencies.end(), {q.type, {}, {}, {}, {}});
+        for (Latencies* l : {&latencies[0], &*it}) {
+            l->total.push_back(total);
+            l->setup.push_back(r.setupTime);
+            l->threadStart.push_back(r.threadStartTime);
+            l->compute.push_back(max(total - r.setupTime - r.threadStartTime, 0.0));
+        }
+    }
+
+    os << "{\n  \"queries\": " << count << ",\n  \"threads\": " << threads << ",\n  \"latency\": [\n";
+    for (size_t i = 0; i < latencies.size(); ++i) {
+        const Latencies& l = latencies[i];
+        cout << l.type << ": p50 " << 1e6 * percentile(l.total, 0.5) << "us  p90 " << 1e6 * percentile(l.total, 0.9)
+             << "us  p99 " << 1e6 * percentile(l.total, 0.99) << "us  p999 " << 1e6 * percentile(l.total, 0.999)
+             << "us  (median setup " << 1e6 * percentile(l.setup, 0.5) << "us, thread start "
+             << 1e6 * percentile(l.threadStart, 0.5) << "us, compute " << 1e6 * percentile(l.compute, 0.5) << "us)"
+             << endl;
+        os << "    {\"type\": \"" << l.type << "\", \"count\": " << l.total.size() << ", ";
+        writePercentiles(os, "total", l.total);
+        os << ", ";
+        writePercentiles(os, "setup", l.setup);
+        os << ", ";
+        writePercentiles(os, "threadStart", l.threadStart);
+        os << ", ";
+        writePercentiles(os, "compute", l.compute);
+        os << ", \"histogramMicroseconds\": [";
+        auto histogram = latencyHistogram(l.total);
+        for (size_t j = 0; j < histogram.size(); ++j)
+            os << (j ? ", " : "") << "[" << histogram[j].first << ", " << histogram[j].second << "]";
+        os << "]}" << (i + 1 < latencies.size() ? "," : "") << "\n";
+    }
+    os << "  ]\n}\n";
+}
+
+static void writeTrace(const string& traceFile)
+{
+    if (!tracer)
+        return;
+    ofstream os(traceFile);
+    tracer->write(os);
+    cout << "Wrote " << traceFile << " (" << tracer->droppedEvents() << " events dropped)" << endl;
+}
+
+int main(int argc, char** argv)
+{
+    string outFile = "bench_equity.json";
+    Settings settings = {10000000, 0, 0.2, 0, Settings::DEFAULT};
+    bool scaling = false, placement = false;
+    unsigned latencyQueries = 0;
+    string traceFile;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        string arg = argv[i];
+        if (arg == "--out")
+            outFile = argv[i + 1];
+        else if (arg == "--hands")
+            settings.handLimit = stoull(argv[i + 1]);
+        else if (arg == "--threads")
+            settings.threads = stoul(argv[i + 1]);
+        else if (arg == "--scaling")
+            scaling = stoul(argv[i + 1]) != 0;
+        else if (arg == "--latency")
+            latencyQueries = stoul(argv[i + 1]);
+        else if (arg == "--trace")
+            traceFile = argv[i + 1];
+        else if (arg == "--placement")
+            placement = stoul(argv[i + 1]) != 0;
+    }
+    Tracer traceRecorder;
+    if (!traceFile.empty())
+        tracer = &traceRecorder;
+
+    // Small queries are run with a single thread unless requested otherwise.
+    if (latencyQueries > 0) {
+        ofstream os(outFile);
+        runLatency(latencyQueries, max(settings.threads, 1u), os);
+        cout << "Wrote " << outFile << endl;
+        writeTrace(traceFile);
+        return 0;
+    }
+
+    if (settings.threads == 0)
+        settings.threads = max(thread::hardware_concurrency(), 1u);
+
+    vector<Measurement> measurements;
+    if (scaling)
+        runScaling(settings, measurements);
+    else if (placement)
+        runPlacement(settings, measurements);
+    else
+        runCatalog(settings, measurements);
+
+    ofstream os(outFile);
+    writeJson(os, measurements, settings.handLimit);
+    cout << "Wrote " << outFile << endl;
+    writeTrace(traceFile);
+}
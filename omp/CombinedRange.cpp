@@ -101,4 +101,21 @@ void CombinedRange::shuffle()
     std::shuffle(mCombos.begin(), mCombos.end(), rng);
 }
 
+void CombinedRange::addBoard(uint64_t boardCards)
+{
+    // Hand::empty() is already in the sample's board, so the board is added card by card.
+    Hand cards[BOARD_CARDS];
+    unsigned n = 0;
+    for (unsigned card = 0; card < CARD_COUNT; ++card) {
+        if (boardCards & (1ull << card))
+            cards[n++] = Hand(card);
+    }
+    for (Combo& c : mCombos) {
+        for (unsigned i = 0; i < mPlayerCount; ++i) {
+            for (unsigned j = 0; j < n; ++j)
+                c.evalHands[i] += cards[j];
+        }
+    }
+}
+
 }
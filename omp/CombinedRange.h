@@ -42,6 +42,10 @@ public:
     // Randomize order of combos (good for random walk simulation).
     void shuffle();
 
+    // Add the fixed board cards (bitmask) to the evaluation hands of every combo, so that monte carlo only has to add
+    // the random board cards to each sample. The board must not conflict with the combos.
+    void addBoard(uint64_t boardCards);
+
     unsigned playerCount() const
     {
         return mPlayerCount;
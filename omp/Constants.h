@@ -3,7 +3,7 @@
 
 namespace omp {
 
-static const unsigned MAX_PLAYERS = 6;
+static const unsigned MAX_PLAYERS = 10;
 
 static const unsigned CARD_COUNT = 52;
 static const unsigned RANK_COUNT = 13;
@@ -25,6 +25,7 @@ static const unsigned FLUSH = 6 * HAND_CATEGORY_OFFSET;
 static const unsigned FULL_HOUSE = 7 * HAND_CATEGORY_OFFSET;
 static const unsigned FOUR_OF_A_KIND = 8 * HAND_CATEGORY_OFFSET;
 static const unsigned STRAIGHT_FLUSH = 9 * HAND_CATEGORY_OFFSET;
+static const unsigned HAND_CATEGORY_COUNT = 10; // Including the unused category 0.
 
 }
 
@@ -0,0 +1,220 @@
+#include "EquityCache.h"
+
+#include <algorithm>
+#include <numeric>
+#include <cmath>
+
+namespace omp {
+
+EquityCache::EquityCache(size_t maxMemory)
+    : mMaxMemory(maxMemory)
+{
+}
+
+bool EquityCache::calculate(EquityCalculator& calculator, const std::vector<CardRange>& handRanges,
+                            uint64_t boardCards, uint64_t deadCards, bool enumerateAll, double stdevTarget,
+                            EquityCalculator::Results& results, unsigned threadCount)
+{
+    if (handRanges.size() == 0 || handRanges.size() > MAX_PLAYERS)
+        return false;
+
+    // Infinite simulation can only end by stopping it.
+    if (!enumerateAll && stdevTarget <= 0) {
+        if (!calculator.start(handRanges, boardCards, deadCards, false, 0, nullptr, 0.2, threadCount))
+            return false;
+        calculator.wait();
+        results = calculator.getResults();
+        return true;
+    }
+
+    Situation situation = canonicalize(handRanges, boardCards, deadCards, calculator.handCategories());
+    EquityCalculator::Results cached;
+    bool found = false;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto it = mIndex.find(situation.key);
+        if (it != mIndex.end()) {
+            mEntries.splice(mEntries.begin(), mEntries, it->second);
+            cached = it->second->results;
+            found = true;
+            if (cached.enumerateAll || (!enumerateAll && cached.stdev <= stdevTarget)) {
+                ++mStats.hits;
+                results = reorderPlayers(cached, situation, false);
+                return true;
+            }
+        }
+    }
+
+    // Monte carlo samples are independent, so the cached results only need to be combined with a simulation that
+    // gets the missing accuracy (variances are inversely additive).
+    bool refine = found && !enumerateAll && !cached.enumerateAll && cached.stdev > 0;
+    double target = stdevTarget;
+    if (refine)
+        target = 1 / std::sqrt(1 / (stdevTarget * stdevTarget) - 1 / (cached.stdev * cached.stdev));
+
+    if (!calculator.start(handRanges, boardCards, deadCards, enumerateAll, target, nullptr, 0.2, threadCount))
+        return false;
+    calculator.wait();
+    EquityCalculator::Results fresh = reorderPlayers(calculator.getResults(), situation, true);
+    if (refine) {
+        cached.merge(fresh);
+        fresh = cached;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (refine)
+            ++mStats.refinements;
+        else
+            ++mStats.misses;
+        // Partial results would answer later queries as if they were complete.
+        if (!fresh.interrupted)
+            store(situation.key, fresh);
+    }
+    results = reorderPlayers(fresh, situation, false);
+    return true;
+}
+
+EquityCache::Stats EquityCache::stats()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    Stats stats = mStats;
+    stats.entries = mEntries.size();
+    return stats;
+}
+
+void EquityCache::clear()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mEntries.clear();
+    mIndex.clear();
+    mStats.memory = 0;
+}
+
+// Encodes the situation with every suit permutation and picks the smallest key. Within each permutation the players
+// are ordered by their encoded ranges, so the key doesn't depend on player order either. Combos that conflict with
+// board or dead cards are removed first, since they don't affect the results. Results with and without hand
+// categories have different keys.
+EquityCache::Situation EquityCache::canonicalize(const std::vector<CardRange>& handRanges, uint64_t boardCards,
+                                                 uint64_t deadCards, bool handCategories)
+{
+    unsigned nplayers = (unsigned)handRanges.size();
+    uint64_t usedCards = boardCards | deadCards;
+    Situation best;
+    best.players = nplayers;
+    unsigned suitPerm[SUIT_COUNT] = {0, 1, 2, 3};
+    do {
+        auto transformCard = [&](unsigned card){ return (card & ~3u) | suitPerm[card & 3]; };
+        auto transformMask = [&](uint64_t cards){
+            uint64_t transformed = 0;
+            for (unsigned card = 0; card < CARD_COUNT; ++card) {
+                if (cards & (1ull << card))
+                    transformed |= 1ull << transformCard(card);
+            }
+            return transformed;
+        };
+
+        std::vector<std::string> encodedRanges(nplayers);
+        for (unsigned i = 0; i < nplayers; ++i) {
+            std::vector<uint16_t> combos;
+            for (auto& c : handRanges[i].combinations()) {
+                if (usedCards & ((1ull << c[0]) | (1ull << c[1])))
+                    continue;
+                unsigned c0 = transformCard(c[0]), c1 = transformCard(c[1]);
+                combos.push_back((uint16_t)(std::max(c0, c1) << 8 | std::min(c0, c1)));
+            }
+            std::sort(combos.begin(), combos.end());
+            // Length prefix keeps the concatenated key unambiguous.
+            uint16_t size = (uint16_t)combos.size();
+            encodedRanges[i].append((const char*)&size, sizeof(size));
+            encodedRanges[i].append((const char*)combos.data(), combos.size() * sizeof(uint16_t));
+        }
+
+        unsigned order[MAX_PLAYERS];
+        std::iota(order, order + nplayers, 0);
+        std::stable_sort(order, order + nplayers, [&](unsigned a, unsigned b){
+            return encodedRanges[a] < encodedRanges[b];
+        });
+
+        uint64_t masks[2] = {transformMask(boardCards), transformMask(deadCards)};
+        std::string key((const char*)masks, sizeof(masks));
+        key += handCategories ? '\1' : '\0';
+        for (unsigned i = 0; i < nplayers; ++i)
+            key += encodedRanges[order[i]];
+        if (best.key.empty() || key < best.key) {
+            best.key = std::move(key);
+            std::copy(order, order + nplayers, best.playerOrder);
+        }
+    } while (std::next_permutation(suitPerm, suitPerm + SUIT_COUNT));
+    return best;
+}
+
+// Maps the per-player results between the original and the canonical player order.
+EquityCalculator::Results EquityCache::reorderPlayers(const EquityCalculator::Results& results,
+                                                      const Situation& situation, bool toCanonical)
+{
+    EquityCalculator::Results reordered = results;
+    unsigned dstIdx[MAX_PLAYERS];
+    for (unsigned j = 0; j < situation.players; ++j) {
+        unsigned src = toCanonical ? situation.playerOrder[j] : j;
+        unsigned dst = toCanonical ? j : situation.playerOrder[j];
+        dstIdx[src] = dst;
+        reordered.equity[dst] = results.equity[src];
+        reordered.wins[dst] = results.wins[src];
+        reordered.ties[dst] = results.ties[src];
+        reordered.handCategories[dst] = results.handCategories[src];
+    }
+    for (unsigned mask = 0; mask < results.winsByPlayerMask.size(); ++mask) {
+        unsigned dstMask = 0;
+        for (unsigned i = 0; i < situation.players; ++i) {
+            if (mask & (1u << i))
+                dstMask |= 1u << dstIdx[i];
+        }
+        reordered.winsByPlayerMask[dstMask] = results.winsByPlayerMask[mask];
+    }
+
+    // These depend on the suits or aren't worth storing.
+    for (unsigned i = 0; i < MAX_PLAYERS; ++i) {
+        reordered.comboEquityHistogram[i].clear();
+        reordered.flopEquityHistogram[i].clear();
+        reordered.comboHistogramUnreliable[i] = 0;
+        reordered.runoutEquity[i].clear();
+    }
+    reordered.flopHistogramUnreliable = 0;
+    reordered.runoutHands.clear();
+    return reordered;
+}
+
+size_t EquityCache::entryMemory(const Entry& entry)
+{
+    // The key is stored both in the entry and in the index, plus some overhead for the list and hash table nodes.
+    size_t memory = sizeof(Entry) + 2 * entry.key.size() + 64;
+    memory += entry.results.winsByPlayerMask.size() * sizeof(uint64_t);
+    memory += entry.results.winningHandCategories.size() * sizeof(uint64_t);
+    for (unsigned i = 0; i < entry.results.players; ++i)
+        memory += entry.results.handCategories[i].size() * sizeof(uint64_t);
+    return memory;
+}
+
+// Must hold mMutex. The newest entry is kept even if it alone exceeds the memory bound.
+void EquityCache::store(const std::string& key, const EquityCalculator::Results& results)
+{
+    auto it = mIndex.find(key);
+    if (it != mIndex.end()) {
+        mStats.memory -= entryMemory(*it->second);
+        mEntries.erase(it->second);
+        mIndex.erase(it);
+    }
+    mEntries.push_front(Entry{key, results});
+    mIndex[key] = mEntries.begin();
+    mStats.memory += entryMemory(mEntries.front());
+
+    while (mStats.memory > mMaxMemory && mEntries.size() > 1) {
+        mStats.memory -= entryMemory(mEntries.back());
+        mIndex.erase(mEntries.back().key);
+        mEntries.pop_back();
+        ++mStats.evictions;
+    }
+}
+
+}
@@ -0,0 +1,88 @@
+#ifndef OMP_EQUITYCACHE_H
+#define OMP_EQUITYCACHE_H
+
+#include "EquityCalculator.h"
+#include "CardRange.h"
+#include <unordered_map>
+#include <list>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+namespace omp {
+
+// Caches the results of equity calculations by a canonical form of the situation, so that a query that is the same
+// as an earlier one up to suit isomorphism and player order is answered without calculating it again. Exact
+// enumeration results answer any later query. Monte carlo results answer queries with an equal or looser stdev
+// target, and for stricter targets they are refined by simulating only the missing accuracy and combining the
+// samples. Least recently used entries are evicted when the memory bound is reached.
+//
+// Only the per-player totals (equity, wins, ties, hand categories), winsByPlayerMask and the scalar fields are
+// cached. Histograms and runout breakdown are left empty for cached results.
+//
+// Can be shared between threads.
+class EquityCache
+{
+public:
+    struct Stats
+    {
+        uint64_t hits = 0, misses = 0;
+        // Cached monte carlo results that were refined to a stricter stdev target. Not included in hits or misses.
+        uint64_t refinements = 0;
+        uint64_t evictions = 0;
+        size_t entries = 0;
+        // Approximate memory use in bytes.
+        size_t memory = 0;
+    };
+
+    // maxMemory: approximate bound for the memory used by the entries in bytes
+    EquityCache(size_t maxMemory = 64 << 20);
+
+    // Calculate equities using the cache. Arguments are the same as in EquityCalculator::start() and the calculator
+    // is used for the calculations that are needed. Results of calculations that were interrupted (see
+    // Results::interrupted) by stopping, a deadline, or a time or hand limit are returned but not cached. Monte carlo
+    // with stdev target 0 is never cached. Hand categories are cached separately depending on whether the calculator
+    // has them enabled. Returns false if calculation is impossible for given hand ranges and board/dead cards.
+    bool calculate(EquityCalculator& calculator, const std::vector<CardRange>& handRanges, uint64_t boardCards,
+                   uint64_t deadCards, bool enumerateAll, double stdevTarget, EquityCalculator::Results& results,
+                   unsigned threadCount = 0);
+
+    Stats stats();
+
+    // Remove all entries. Doesn't reset the hit/miss counters.
+    void clear();
+
+private:
+    // Canonical form of a situation.
+    struct Situation
+    {
+        std::string key;
+        unsigned players;
+        // Original player index of each player in the canonical order.
+        unsigned playerOrder[MAX_PLAYERS];
+    };
+
+    struct Entry
+    {
+        std::string key;
+        EquityCalculator::Results results; // In canonical player order.
+    };
+
+    static Situation canonicalize(const std::vector<CardRange>& handRanges, uint64_t boardCards, uint64_t deadCards,
+                                  bool handCategories);
+    static EquityCalculator::Results reorderPlayers(const EquityCalculator::Results& results,
+                                                    const Situation& situation, bool toCanonical);
+    static size_t entryMemory(const Entry& entry);
+    void store(const std::string& key, const EquityCalculator::Results& results);
+
+    std::mutex mMutex;
+    std::list<Entry> mEntries; // Most recently used first.
+    std::unordered_map<std::string, std::list<Entry>::iterator> mIndex;
+    size_t mMaxMemory;
+    Stats mStats;
+};
+
+}
+
+#endif // OMP_EQUITYCACHE_H
@@ -4,15 +4,152 @@
 #include "../libdivide/libdivide.h"
 #include <random>
 #include <iostream>
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cctype>
 #include <algorithm>
 #include <cmath>
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <dirent.h>
+#elif defined(_WIN32)
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#endif
 
 namespace omp {
 
-// Start new calculation and spawn threads.
+#if OMP_PROFILE
+// Each thread gathers its own counters, which are merged to the shared ones when the thread finishes.
+static thread_local EquityCalculator::Profile tProfile;
+static thread_local std::chrono::high_resolution_clock::time_point tThreadStart;
+#define OMP_PROFILE_COUNT(counter, n) (tProfile.counter += (n))
+#else
+#define OMP_PROFILE_COUNT(counter, n)
+#endif
+
+// Approximate duration of an enumeration batch in seconds.
+static const double TARGET_BATCH_TIME = 0.005;
+
+// Sorting networks (Batcher's odd-even merge sort) for up to MAX_PLAYERS elements as pairs of indexes to compare and
+// swap. The network for n elements is from pair SORTING_NETWORK_OFFSETS[n] to SORTING_NETWORK_OFFSETS[n + 1].
+static const uint8_t SORTING_NETWORKS[][2] = {
+    {0,1},
+    {0,1}, {0,2}, {1,2},
+    {0,1}, {2,3}, {0,2}, {1,3}, {1,2},
+    {0,1}, {2,3}, {0,2}, {1,3}, {1,2}, {0,4}, {2,4}, {1,2}, {3,4},
+    {0,1}, {2,3}, {4,5}, {0,2}, {1,3}, {1,2}, {0,4}, {1,5}, {2,4}, {3,5}, {1,2}, {3,4},
+    {0,1}, {2,3}, {4,5}, {0,2}, {1,3}, {4,6}, {1,2}, {5,6}, {0,4}, {1,5}, {2,6}, {2,4}, {3,5}, {1,2}, {3,4}, {5,6},
+    {0,1}, {2,3}, {4,5}, {6,7}, {0,2}, {1,3}, {4,6}, {5,7}, {1,2}, {5,6}, {0,4}, {1,5}, {2,6}, {3,7}, {2,4}, {3,5},
+    {1,2}, {3,4}, {5,6},
+    {0,1}, {2,3}, {4,5}, {6,7}, {0,2}, {1,3}, {4,6}, {5,7}, {1,2}, {5,6}, {0,4}, {1,5}, {2,6}, {3,7}, {2,4}, {3,5},
+    {1,2}, {3,4}, {5,6}, {0,8}, {4,8}, {2,4}, {3,5}, {6,8}, {1,2}, {3,4}, {5,6}, {7,8},
+    {0,1}, {2,3}, {4,5}, {6,7}, {8,9}, {0,2}, {1,3}, {4,6}, {5,7}, {1,2}, {5,6}, {0,4}, {1,5}, {2,6}, {3,7}, {2,4},
+    {3,5}, {1,2}, {3,4}, {5,6}, {0,8}, {1,9}, {4,8}, {5,9}, {2,4}, {3,5}, {6,8}, {7,9}, {1,2}, {3,4}, {5,6}, {7,8}
+};
+static const unsigned SORTING_NETWORK_OFFSETS[MAX_PLAYERS + 2] = {0, 0, 0, 1, 4, 9, 18, 30, 46, 65, 93, 125};
+
+// Suit transformation of transformSuits() as a state machine, so that transforming a card is a table lookup. A state
+// is the mapping of the suits encountered so far, and state 0 has none of them. For each suit the state has the
+// virtual suit and the next state, and also the full mapping where the unused suits are mapped to the remaining
+// virtual suits.
+struct SuitTransformState
+{
+    uint8_t suits[SUIT_COUNT], next[SUIT_COUNT], full[SUIT_COUNT];
+};
+
+// Builds all the states reachable from state 0 (65 states, one for each ordered selection of 0 to 4 suits).
+static std::vector<SuitTransformState> buildSuitTransformStates()
+{
+    std::vector<std::array<unsigned,SUIT_COUNT>> mappings{{{~0u, ~0u, ~0u, ~0u}}};
+    std::vector<SuitTransformState> states;
+    for (size_t i = 0; i < mappings.size(); ++i) {
+        std::array<unsigned,SUIT_COUNT> mapping = mappings[i];
+        unsigned suitCount = SUIT_COUNT - (unsigned)std::count(mapping.begin(), mapping.end(), ~0u);
+        SuitTransformState state;
+        for (unsigned suit = 0, n = suitCount; suit < SUIT_COUNT; ++suit) {
+            std::array<unsigned,SUIT_COUNT> nextMapping = mapping;
+            if (nextMapping[suit] == ~0u)
+                nextMapping[suit] = suitCount;
+            size_t next = std::find(mappings.begin(), mappings.end(), nextMapping) - mappings.begin();
+            if (next == mappings.size())
+                mappings.push_back(nextMapping);
+            state.suits[suit] = (uint8_t)nextMapping[suit];
+            state.next[suit] = (uint8_t)next;
+            state.full[suit] = (uint8_t)(mapping[suit] == ~0u ? n++ : mapping[suit]);
+        }
+        states.push_back(state);
+    }
+    return states;
+}
+
+static const std::vector<SuitTransformState> SUIT_TRANSFORM_STATES = buildSuitTransformStates();
+
+// Pins the calling thread to a CPU. Does nothing on unsupported platforms.
+static void pinThread(unsigned cpu)
+{
+    #if defined(__linux__)
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    #elif defined(_WIN32)
+    if (cpu < 64)
+        SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu);
+    #else
+    (void)cpu;
+    #endif
+}
+
+// NUMA node of a CPU, or 0 if unknown.
+static unsigned numaNode(unsigned cpu)
+{
+    unsigned node = 0;
+    #if defined(__linux__)
+    // The CPU directory has a nodeN link to its node.
+    std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+    if (DIR* dir = opendir(path.c_str())) {
+        while (dirent* entry = readdir(dir)) {
+            if (std::strncmp(entry->d_name, "node", 4) == 0 && std::isdigit((unsigned char)entry->d_name[4]))
+                node = (unsigned)std::atoi(entry->d_name + 4);
+        }
+        closedir(dir);
+    }
+    #elif defined(_WIN32)
+    UCHAR winNode;
+    if (cpu < 64 && GetNumaProcessorNode((UCHAR)cpu, &winNode))
+        node = winNode;
+    #endif
+    return node;
+}
+
 bool EquityCalculator::start(const std::vector<CardRange>& handRanges, uint64_t boardCards, uint64_t deadCards,
                              bool enumerateAll, double stdevTarget, std::function<void(const Results&)> callback,
                              double updateInterval, unsigned threadCount)
+{
+    return startCalculation(handRanges, boardCards, deadCards, enumerateAll, stdevTarget, callback, updateInterval,
+                            threadCount, nullptr);
+}
+
+bool EquityCalculator::resume(const std::string& checkpointFile, std::function<void(const Results&)> callback,
+                              double updateInterval, unsigned threadCount)
+{
+    Checkpoint checkpoint;
+    if (!readCheckpoint(checkpointFile, checkpoint))
+        return false;
+    return startCalculation(checkpoint.handRanges, checkpoint.boardCards, checkpoint.deadCards, true, 0, callback,
+                            updateInterval, threadCount, &checkpoint);
+}
+
+// Start new calculation and spawn threads. Enumeration continues from the checkpoint if one is given.
+bool EquityCalculator::startCalculation(const std::vector<CardRange>& handRanges, uint64_t boardCards,
+                                        uint64_t deadCards, bool enumerateAll, double stdevTarget,
+                                        std::function<void(const Results&)> callback, double updateInterval,
+                                        unsigned threadCount, const Checkpoint* checkpoint)
 {
     if (handRanges.size() == 0 || handRanges.size() > MAX_PLAYERS)
         return false;
@@ -20,48 +157,162 @@ bool EquityCalculator::start(const std::vector<CardRange>& handRanges, uint64_t
         return false;
     if (2 * handRanges.size() + bitCount(deadCards) + BOARD_CARDS > CARD_COUNT)
         return false;
+    auto setupStart = std::chrono::high_resolution_clock::now();
+    Tracer::Scope setupScope(mTracer, "setup");
 
     // Set up card ranges.
     mDeadCards = deadCards;
     mBoardCards = boardCards;
     mOriginalHandRanges = handRanges;
-    mHandRanges = removeInvalidCombos(handRanges, mDeadCards | mBoardCards);
-    std::vector<CombinedRange> combinedRanges = CombinedRange::joinRanges(mHandRanges, MAX_COMBINED_RANGE_SIZE);
-    for (unsigned i = 0; i < combinedRanges.size(); ++i) {
-        if (combinedRanges[i].combos().size() == 0)
-            return false;
-        if (!enumerateAll)
-            combinedRanges[i].shuffle();
-        mCombinedRanges[i] = combinedRanges[i];
+    {
+        Tracer::Scope scope(mTracer, "removeInvalidCombos");
+        mHandRanges = removeInvalidCombos(handRanges, mDeadCards | mBoardCards);
+    }
+    // Enumeration joins the ranges deterministically, so the combined ranges (and their precomputed ranks) are kept
+    // for the next enumeration of the same ranges, e.g. the next slice (see setEnumerationRange()).
+    if (!enumerateAll || mHandRanges != mJoinedHandRanges) {
+        mJoinedHandRanges.clear();
+        mRanksValid = false;
+        std::vector<CombinedRange> combinedRanges;
+        {
+            Tracer::Scope scope(mTracer, "joinRanges");
+            combinedRanges = CombinedRange::joinRanges(mHandRanges, MAX_COMBINED_RANGE_SIZE);
+        }
+        for (unsigned i = 0; i < combinedRanges.size(); ++i) {
+            if (combinedRanges[i].combos().size() == 0)
+                return false;
+            if (!enumerateAll) {
+                Tracer::Scope scope(mTracer, "shuffle");
+                combinedRanges[i].shuffle();
+            }
+            mCombinedRanges[i] = combinedRanges[i];
+        }
+        mCombinedRangeCount = (unsigned)combinedRanges.size();
+        if (enumerateAll)
+            mJoinedHandRanges = mHandRanges;
     }
-    mCombinedRangeCount = (unsigned)combinedRanges.size();
 
     // Set up simulation settings.
-    mEnumPosition = 0;
+    uint64_t preflopCombos = getPreflopCombinationCount();
+    mEnumSlice.first = std::min(mEnumBegin, preflopCombos);
+    mEnumSlice.second = std::max(mEnumSlice.first, std::min(mEnumEnd, preflopCombos));
     mBatchSum = mBatchSumSqr = mBatchCount = 0;
-    mResults = Results();
-    mResults.players = (unsigned)handRanges.size();
-    mResults.enumerateAll = enumerateAll;
+    // Lookup keys only identify the holecards, so the results can't be shared between calculations.
+    mLookup.clear();
+    mFlopLookup.clear();
+    mFlopLookupSize = 0;
+    mProfile = Profile();
+    initResults(mResults, (unsigned)handRanges.size(), enumerateAll);
+    mCheckpointResults = mResults;
+    mCheckpointing = enumerateAll && !mCheckpointFile.empty() && mHistogramBins == 0 && !mRunoutBreakdown;
+    mLastCheckpoint = std::chrono::high_resolution_clock::now();
+
+    // Continue from the checkpoint. Combined ranges are built deterministically for enumeration, so the preflop
+    // indexes are the same as in the original calculation.
+    if (checkpoint) {
+        if (checkpoint->preflopCombos != preflopCombos || mHistogramBins > 0 || mRunoutBreakdown
+                || checkpoint->results.winningHandCategories.empty() == mHandCategories)
+            return false;
+        mEnumSlice = {checkpoint->sliceBegin, checkpoint->sliceEnd};
+    }
+    mEnumTotal = mEnumSlice.second - mEnumSlice.first;
+    std::vector<std::pair<uint64_t,uint64_t>> enumRanges(mEnumTotal > 0, mEnumSlice);
+    mEnumReserved = 0;
+    if (checkpoint) {
+        enumRanges = checkpoint->remaining;
+        mEnumReserved = mEnumTotal;
+        for (auto& range : enumRanges)
+            mEnumReserved -= range.second - range.first;
+        addCounts(mResults, checkpoint->results);
+        addCounts(mCheckpointResults, checkpoint->results);
+        mLookup.insert(checkpoint->lookup.begin(), checkpoint->lookup.end());
+    }
     mUpdateResults = mResults;
     mStdevTarget = stdevTarget;
     mCallback = callback;
     mUpdateInterval = updateInterval;
     mStopped = false;
-    mLastUpdate = std::chrono::high_resolution_clock::now();
+    mIncomplete = false;
     if (threadCount == 0)
         threadCount = std::thread::hardware_concurrency();
     mUnfinishedThreads = threadCount;
+    mNextThread = 0;
+    mNodeCombinedRanges.clear();
+    if (enumerateAll)
+        distributeWork(enumRanges, threadCount);
+    mRankStride = 0;
+    mRiverBlocks = false;
+    // Flop ranks take C(47,2) evaluations per combo, so they pay off only if there are more preflops than combos.
+    // Without SSE2 comparing them is slower than the generic enumeration.
+    bool flopRanks = false;
+    #if OMP_SSE2
+    uint64_t rankedCombos = 0;
+    for (unsigned i = 0; i < mCombinedRangeCount; ++i)
+        rankedCombos += mCombinedRanges[i].combos().size() * mCombinedRanges[i].playerCount();
+    flopRanks = bitCount(boardCards) == 3 && mEnumTotal >= rankedCombos;
+    #endif
+    if (enumerateAll && (bitCount(boardCards) >= 4 || flopRanks) && mHistogramBins == 0 && !mRunoutBreakdown
+            && !mHandCategories) {
+        Tracer::Scope scope(mTracer, "precomputeRanks");
+        precomputeRanks();
+    }
+    mDetailStats.init(mResults.players, mHistogramBins > 0, mRunoutBreakdown);
+    unsigned optionalStats = (mHistogramBins > 0 ? STATS_DISTRIBUTIONS : 0) | (mRunoutBreakdown ? STATS_RUNOUTS : 0)
+                             | (mHandCategories ? STATS_CATEGORIES : 0);
+
+    // Monte carlo is instantiated separately for each combination of optional statistics.
+    typedef void (EquityCalculator::*Worker)();
+    static const Worker MONTE_CARLO_WORKERS[] = {
+        &EquityCalculator::simulateRandomWalkMonteCarlo<0>,
+        &EquityCalculator::simulateRandomWalkMonteCarlo<STATS_DISTRIBUTIONS>,
+        &EquityCalculator::simulateRandomWalkMonteCarlo<STATS_RUNOUTS>,
+        &EquityCalculator::simulateRandomWalkMonteCarlo<STATS_DISTRIBUTIONS | STATS_RUNOUTS>,
+        &EquityCalculator::simulateRandomWalkMonteCarlo<STATS_CATEGORIES>,
+        &EquityCalculator::simulateRandomWalkMonteCarlo<STATS_CATEGORIES | STATS_DISTRIBUTIONS>,
+        &EquityCalculator::simulateRandomWalkMonteCarlo<STATS_CATEGORIES | STATS_RUNOUTS>,
+        &EquityCalculator::simulateRandomWalkMonteCarlo<STATS_CATEGORIES | STATS_DISTRIBUTIONS | STATS_RUNOUTS>
+    };
+    Worker worker = enumerateAll ? &EquityCalculator::enumerate : MONTE_CARLO_WORKERS[optionalStats];
+
+    // Fixed flop, turn or river without optional statistics has its own instantiations by the number of random
+    // board cards and for the common player counts.
+    unsigned fixedBoardCards = bitCount(boardCards);
+    if (!enumerateAll && optionalStats == 0 && fixedBoardCards >= 3) {
+        static const Worker FIXED_BOARD_WORKERS[3][4] = {
+            {&EquityCalculator::simulateRandomWalkMonteCarlo<0, 0, 2>,
+             &EquityCalculator::simulateRandomWalkMonteCarlo<0, 0, 3>,
+             &EquityCalculator::simulateRandomWalkMonteCarlo<0, 0, 4>,
+             &EquityCalculator::simulateRandomWalkMonteCarlo<0, 0, 0>},
+            {&EquityCalculator::simulateRandomWalkMonteCarlo<0, 1, 2>,
+             &EquityCalculator::simulateRandomWalkMonteCarlo<0, 1, 3>,
+             &EquityCalculator::simulateRandomWalkMonteCarlo<0, 1, 4>,
+             &EquityCalculator::simulateRandomWalkMonteCarlo<0, 1, 0>},
+            {&EquityCalculator::simulateRandomWalkMonteCarlo<0, 2, 2>,
+             &EquityCalculator::simulateRandomWalkMonteCarlo<0, 2, 3>,
+             &EquityCalculator::simulateRandomWalkMonteCarlo<0, 2, 4>,
+             &EquityCalculator::simulateRandomWalkMonteCarlo<0, 2, 0>}
+        };
+        unsigned players = (unsigned)handRanges.size();
+        worker = FIXED_BOARD_WORKERS[BOARD_CARDS - fixedBoardCards][players >= 2 && players <= 4 ? players - 2 : 3];
+        for (unsigned i = 0; i < mCombinedRangeCount; ++i)
+            mCombinedRanges[i].addBoard(boardCards);
+    }
 
-    // Start threads.
+    // Start threads. Threads measure the time from here to see how long it takes for them to start.
     mThreads.clear();
-    for (unsigned i = 0; i < threadCount; ++i) {
-        mThreads.emplace_back([this,enumerateAll]{
-            if (enumerateAll)
-                enumerate();
-            else
-                simulateRandomWalkMonteCarlo();
-        });
+    mLastUpdate = std::chrono::high_resolution_clock::now();
+    mStopTime = mDeadline;
+    if (mTimeLimit < (double)INFINITE) {
+        mStopTime = std::min(mStopTime, std::chrono::steady_clock::now()
+                + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                    std::chrono::duration<double>(mTimeLimit)));
     }
+    mHasStopTime = mStopTime != std::chrono::steady_clock::time_point::max();
+    mResults.setupTime = 1e-9 * std::chrono::duration_cast<std::chrono::nanoseconds>(
+                mLastUpdate - setupStart).count();
+    mUpdateResults.setupTime = mResults.setupTime;
+    for (unsigned i = 0; i < threadCount; ++i)
+        mThreads.emplace_back(worker, this);
 
     // Started successfully.
     return true;
@@ -70,6 +321,7 @@ bool EquityCalculator::start(const std::vector<CardRange>& handRanges, uint64_t
 // Regular monte carlo simulation.
 void EquityCalculator::simulateRegularMonteCarlo()
 {
+    const CombinedRange* combinedRanges = localCombinedRanges(recordThreadStart());
     unsigned nplayers = (unsigned)mHandRanges.size();
     Hand fixedBoard = getBoardFromBitmask(mBoardCards);
     unsigned remainingCards = BOARD_CARDS - fixedBoard.count();
@@ -80,7 +332,7 @@ void EquityCalculator::simulateRegularMonteCarlo()
     FastUniformIntDistribution<unsigned,21> comboDists[MAX_PLAYERS];
     unsigned combinedRangeCount = mCombinedRangeCount;
     for (unsigned i = 0; i < mCombinedRangeCount; ++i)
-        comboDists[i] = FastUniformIntDistribution<unsigned,21>(0, (unsigned)mCombinedRanges[i].combos().size() - 1);
+        comboDists[i] = FastUniformIntDistribution<unsigned,21>(0, (unsigned)combinedRanges[i].combos().size() - 1);
 
     for (;;) {
         // Randomize hands and check for duplicate holecards.
@@ -89,13 +341,13 @@ void EquityCalculator::simulateRegularMonteCarlo()
         bool ok = true;
         for (unsigned i = 0; i < combinedRangeCount; ++i) {
             unsigned comboIdx = comboDists[i](rng);
-            const CombinedRange::Combo& combo = mCombinedRanges[i].combos()[comboIdx];
+            const CombinedRange::Combo& combo = combinedRanges[i].combos()[comboIdx];
             if (usedCardsMask & combo.cardMask) {
                 ok = false;
                 break;
             }
-            for (unsigned j = 0; j < mCombinedRanges[i].playerCount(); ++j) {
-                unsigned playerIdx = mCombinedRanges[i].players()[j];
+            for (unsigned j = 0; j < combinedRanges[i].playerCount(); ++j) {
+                unsigned playerIdx = combinedRanges[i].players()[j];
                 playerHands[playerIdx] = combo.evalHands[j];
             }
             usedCardsMask |= combo.cardMask;
@@ -115,13 +367,15 @@ void EquityCalculator::simulateRegularMonteCarlo()
         // Update periodically.
         if ((stats.evalCount & 0xfff) == 0) {
             updateResults(stats, false);
-            stats = BatchResults(nplayers);
+            stats.reset();
             if (mStopped)
                 break;
         }
     }
 
     updateResults(stats, true);
+    if (mTracer)
+        mTracer->end("thread");
 }
 
 // Monte carlo simulation using a random walk. On each iteration a random player is chosen and the next feasible
@@ -129,54 +383,86 @@ void EquityCalculator::simulateRegularMonteCarlo()
 // visited the preflop combinations can be thought of as a directed k-regular graph. The transition probability
 // matrix P then has k non-zero values on each row and column, and all non-zero elements have value of 1/k.
 // It is easy to see that (1,1,...,1) * P = (1,1,...,1), i.e. (1,1,...,1) is a stable distribution.
+// With fixed flop, turn or river (tRemainingCards <= 2) the evaluation hands of the combos already include the fixed
+// board (see CombinedRange::addBoard()), so only the random cards are dealt to the board. Loops over the players and
+// the board cards are unrolled when their counts are template parameters (tPlayers = 0 means any count).
+template<unsigned tStats, unsigned tRemainingCards, unsigned tPlayers>
 void EquityCalculator::simulateRandomWalkMonteCarlo()
 {
-    unsigned nplayers = (unsigned)mHandRanges.size();
-    Hand fixedBoard = getBoardFromBitmask(mBoardCards);
-    unsigned remainingCards = 5 - fixedBoard.count();
-    BatchResults stats(nplayers);
+    static const bool tBoardInHands = tRemainingCards <= 2;
+    const CombinedRange* combinedRanges = localCombinedRanges(recordThreadStart());
+    unsigned nplayers = tPlayers ? tPlayers : (unsigned)mHandRanges.size();
+    Hand fixedBoard = tBoardInHands ? Hand::empty() : getBoardFromBitmask(mBoardCards);
+    unsigned remainingCards = tBoardInHands ? tRemainingCards : 5 - fixedBoard.count();
+    static const bool tCategories = (tStats & STATS_CATEGORIES) != 0;
+    static const unsigned tDetailStats = tStats & (STATS_DISTRIBUTIONS | STATS_RUNOUTS);
+    BatchResults stats(nplayers, tCategories);
+    uint64_t batchSize = mBatchSize ? mBatchSize : 0x1000;
+    DetailStats detail;
+    detail.init(nplayers, (tStats & STATS_DISTRIBUTIONS) != 0, (tStats & STATS_RUNOUTS) != 0);
+    unsigned randomFlopCards = remainingCards > 2 ? remainingCards - 2 : 0;
 
     Rng rng{std::random_device{}()};
     FastUniformIntDistribution<unsigned,16> cardDist(0, CARD_COUNT - 1);
     FastUniformIntDistribution<unsigned,21> comboDists[MAX_PLAYERS];
     FastUniformIntDistribution<unsigned,16> combinedRangeDist(0, mCombinedRangeCount - 1);
     for (unsigned i = 0; i < mCombinedRangeCount; ++i)
-        comboDists[i] = FastUniformIntDistribution<unsigned,21>(0, (unsigned)mCombinedRanges[i].combos().size() - 1);
+        comboDists[i] = FastUniformIntDistribution<unsigned,21>(0, (unsigned)combinedRanges[i].combos().size() - 1);
 
     uint64_t usedCardsMask;
     Hand playerHands[MAX_PLAYERS];
     unsigned comboIndexes[MAX_PLAYERS];
 
     // Set initial state.
-    if (randomizeHoleCards(usedCardsMask, comboIndexes, playerHands, rng, comboDists)) {
+    if (randomizeHoleCards(usedCardsMask, comboIndexes, playerHands, rng, comboDists, combinedRanges)) {
         // Loop until stopped.
         for (;;) {
             // Randomize board and evaluate for current holecards.
             Hand board = fixedBoard;
-            randomizeBoard(board, remainingCards, usedCardsMask, rng, cardDist);
-            evaluateHands(playerHands, nplayers, board, &stats, 1);
+            unsigned dealtCards[BOARD_CARDS];
+            randomizeBoard<tDetailStats != 0>(board, remainingCards, usedCardsMask, rng, cardDist, dealtCards);
+            unsigned winnersMask = evaluateHands<tStats>(playerHands, nplayers, board, &stats, 1);
+
+            if (tStats & STATS_DISTRIBUTIONS) {
+                uint64_t flopCards = 0;
+                if (randomFlopCards) {
+                    flopCards = mBoardCards;
+                    for (unsigned i = 0; i < randomFlopCards; ++i)
+                        flopCards |= 1ull << dealtCards[i];
+                }
+                recordShowdownDistributions(winnersMask, comboIndexes, flopCards, &detail);
+            }
+            if (tStats & STATS_RUNOUTS) {
+                for (unsigned i = 0; i < remainingCards; ++i)
+                    ++detail.runoutWins[(dealtCards[i] << nplayers) | winnersMask];
+            }
+
+            // Big batches would delay stopping, so check it also in between.
+            if ((stats.evalCount & 0x3ff) == 0 && shouldStop())
+                break;
 
             // Update results periodically.
-            if ((stats.evalCount & 0xfff) == 0) {
+            if (stats.evalCount >= batchSize) {
                 updateResults(stats, false);
                 if (mStopped)
                     break;
-                stats = BatchResults(nplayers);
+                stats.reset();
                 // Occasionally do a full randomization, because in some rare cases the random walk might
                 // not be able to visit all preflop combinations by changing just one hand at a time.
                 // This shouldn't happen if MAX_COMBINED_RANGE_SIZE is big enough, but extra randomization never hurts.
-                if (!randomizeHoleCards(usedCardsMask, comboIndexes, playerHands, rng, comboDists))
+                if (!randomizeHoleCards(usedCardsMask, comboIndexes, playerHands, rng, comboDists, combinedRanges))
                     break;
             }
 
             // Choose random player and iterate to next valid combo. If current combo is the only one that is valid
             // then will loop back to itself.
             unsigned combinedRangeIdx = combinedRangeDist(rng);
-            const CombinedRange& combinedRange = mCombinedRanges[combinedRangeIdx];
+            const CombinedRange& combinedRange = combinedRanges[combinedRangeIdx];
             unsigned comboIdx = comboIndexes[combinedRangeIdx]; // Caching array accessess for 3% speedup!
             usedCardsMask -= combinedRange.combos()[comboIdx].cardMask;
             uint64_t mask = 0;
             do {
+                OMP_PROFILE_COUNT(randomWalkSkips, mask != 0);
                 if (comboIdx == 0)
                     comboIdx = (unsigned)combinedRange.size();
                 --comboIdx;
@@ -191,64 +477,117 @@ void EquityCalculator::simulateRandomWalkMonteCarlo()
         }
     }
 
+    if (tDetailStats)
+        mergeDetailStats(detail);
     updateResults(stats, true);
+    if (mTracer)
+        mTracer->end("thread");
+}
+
+// Records the delay until the first thread starts running. Other threads can't have updated the results before that.
+// Returns the index of the thread. Pins the thread before it allocates anything.
+unsigned EquityCalculator::recordThreadStart()
+{
+    auto t = std::chrono::high_resolution_clock::now();
+    if (mTracer)
+        mTracer->begin("thread");
+    #if OMP_PROFILE
+    tProfile = Profile();
+    tThreadStart = t;
+    #endif
+    unsigned threadIdx = mNextThread++;
+    if (!mAffinity.empty())
+        pinThread(mAffinity[threadIdx % mAffinity.size()]);
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mResults.threadStartTime == 0)
+        mResults.threadStartTime = 1e-9 * std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    t - mLastUpdate).count();
+    return threadIdx;
+}
+
+// Combined ranges for the thread to use, a copy on the thread's NUMA node if enabled.
+const CombinedRange* EquityCalculator::localCombinedRanges(unsigned threadIdx)
+{
+    if (mAffinity.empty() || !mReplicatePerNode)
+        return mCombinedRanges;
+    unsigned node = numaNode(mAffinity[threadIdx % mAffinity.size()]);
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto& combinedRanges = mNodeCombinedRanges[node];
+    if (!combinedRanges) {
+        combinedRanges.reset(new CombinedRange[MAX_PLAYERS]);
+        std::copy(mCombinedRanges, mCombinedRanges + mCombinedRangeCount, combinedRanges.get());
+    }
+    return combinedRanges.get();
 }
 
 // Randomize holecards using rejection sampling. Returns false if maximum number of attempts was reached.
 bool EquityCalculator::randomizeHoleCards(uint64_t &usedCardsMask, unsigned* comboIndexes, Hand* playerHands,
-                                          Rng& rng, FastUniformIntDistribution<unsigned,21>* comboDists)
+                                          Rng& rng, FastUniformIntDistribution<unsigned,21>* comboDists,
+                                          const CombinedRange* combinedRanges)
 {
     unsigned n = 0;
-    for(bool ok = false; !ok && n < 1000; ++n) {
+    bool ok = false;
+    for(; !ok && n < 1000; ++n) {
         ok = true;
         usedCardsMask = mDeadCards | mBoardCards;
         for (unsigned i = 0; i < mCombinedRangeCount; ++i) {
             unsigned comboIdx = comboDists[i](rng);
             comboIndexes[i] = comboIdx;
-            const CombinedRange::Combo& combo = mCombinedRanges[i].combos()[comboIdx];
+            const CombinedRange::Combo& combo = combinedRanges[i].combos()[comboIdx];
             if (usedCardsMask & combo.cardMask) {
                 ok = false;
                 break;
             }
-            for (unsigned j = 0; j < mCombinedRanges[i].playerCount(); ++j) {
-                unsigned playerIdx = mCombinedRanges[i].players()[j];
+            for (unsigned j = 0; j < combinedRanges[i].playerCount(); ++j) {
+                unsigned playerIdx = combinedRanges[i].players()[j];
                 playerHands[playerIdx] = combo.evalHands[j];
             }
             usedCardsMask |= combo.cardMask;
         }
     }
+    OMP_PROFILE_COUNT(holeCardAttempts, n);
+    OMP_PROFILE_COUNT(holeCardRejections, n - ok);
     return n < 1000;
 }
 
-// Naive method of randomizing the board by using rejection sampling.
+// Naive method of randomizing the board by using rejection sampling. Optionally also stores the dealt cards.
+template<bool tRecordCards>
 void EquityCalculator::randomizeBoard(Hand& board, unsigned remainingCards, uint64_t usedCardsMask,
-                                      Rng& rng, FastUniformIntDistribution<unsigned,16>& cardDist)
+                                      Rng& rng, FastUniformIntDistribution<unsigned,16>& cardDist,
+                                      unsigned* dealtCards)
 {
     omp_assert(remainingCards + bitCount(usedCardsMask) <= CARD_COUNT && remainingCards <= BOARD_CARDS);
     for(unsigned i = 0; i < remainingCards; ++i) {
         unsigned card;
-        uint64_t cardMask;
+        uint64_t cardMask = 0;
         do {
+            OMP_PROFILE_COUNT(boardRejections, cardMask != 0);
             card = cardDist(rng);
             cardMask = 1ull << card;
         } while (usedCardsMask & cardMask);
         usedCardsMask |= cardMask;
         board += Hand(card);
+        if (tRecordCards)
+            dealtCards[i] = card;
     }
 }
 
-// Evaluates a single showdown with one or more players and stores the result.
-template<bool tFlushPossible>
-void EquityCalculator::evaluateHands(const Hand* playerHands, unsigned nplayers, const Hand& board, BatchResults* stats,
+// Evaluates a single showdown with one or more players and stores the result. Returns the mask of winning players.
+// Hand categories are counted only when STATS_CATEGORIES is set, other optional statistics are ignored here.
+template<unsigned tStats, bool tFlushPossible>
+unsigned EquityCalculator::evaluateHands(const Hand* playerHands, unsigned nplayers, const Hand& board, BatchResults* stats,
                                      unsigned weight)
 {
-    omp_assert(board.count() == BOARD_CARDS);
+    // The board can also be partly included in the player hands.
+    omp_assert(board.count() + playerHands[0].count() == BOARD_CARDS + 2);
     ++stats->evalCount;
     unsigned bestRank = 0;
     unsigned winnersMask = 0;
     for (unsigned i = 0, m = 1; i < nplayers; ++i, m <<= 1) {
         Hand hand = board + playerHands[i];
         unsigned rank = mEval.evaluate<tFlushPossible>(hand);
+        if (tStats & STATS_CATEGORIES)
+            stats->categoryCounts[i * HAND_CATEGORY_COUNT + (rank >> HAND_CATEGORY_SHIFT)] += weight;
         if (rank > bestRank) {
             bestRank = rank;
             winnersMask = m;
@@ -258,37 +597,116 @@ void EquityCalculator::evaluateHands(const Hand* playerHands, unsigned nplayers,
     }
 
     stats->winsByPlayerMask[winnersMask] += weight;
+    if (tStats & STATS_CATEGORIES)
+        stats->categoryCounts[nplayers * HAND_CATEGORY_COUNT + (bestRank >> HAND_CATEGORY_SHIFT)] += weight;
+    return winnersMask;
 }
 
 // Calculates exact equities by enumerating through all possible combinations.
 void EquityCalculator::enumerate()
 {
+    unsigned queueIdx = recordThreadStart();
+    const CombinedRange* combinedRanges = localCombinedRanges(queueIdx);
     uint64_t enumPosition = 0, enumEnd = 0;
     uint64_t preflopCombos = getPreflopCombinationCount();
     unsigned nplayers = (unsigned)mHandRanges.size();
-    BatchResults stats(nplayers);
+    bool categories = mHandCategories;
+    BatchResults stats(nplayers, categories);
+    DetailStats detail;
+    bool distributions = !mDetailStats.comboHands.empty();
+    bool runouts = !mDetailStats.runoutWins.empty();
+    detail.init(nplayers, distributions, runouts);
     UniqueRng64 urng(preflopCombos);
     Hand fixedBoard = getBoardFromBitmask(mBoardCards);
+    // Flop distributions are gathered separately for each preflop and then mapped back to the original suits.
+    bool flops = distributions && fixedBoard.count() < 3;
+    std::shared_ptr<const std::vector<double>> flopResults;
     libdivide::libdivide_u64_t fastDividers[MAX_PLAYERS];
     unsigned combinedRangeCount = mCombinedRangeCount;
     for (unsigned i = 0; i < combinedRangeCount; ++i)
-        fastDividers[i] = libdivide::libdivide_u64_gen(mCombinedRanges[i].combos().size());
+        fastDividers[i] = libdivide::libdivide_u64_gen(combinedRanges[i].combos().size());
 
     // Lookup overhead becomes too much if postflop tree is very small.
     uint64_t postflopCombos = getPostflopCombinationCount();
+    uint64_t maxBatchSize = std::max<uint64_t>((mBatchSize ? mBatchSize : 2000000) / postflopCombos, 1);
     bool useLookup = postflopCombos > 500;
+    // Runouts need the results in original suits. (Lookup table would also need the results for every card.)
+    if (runouts)
+        useLookup = false;
 
     // Disable random preflop enumeration order if postflop is too small (bad for caching). It's also makes no sense
     // if all the combos don't fit in the lookup table.
     bool randomizeOrder = postflopCombos > 10000 && preflopCombos <= 2 * MAX_LOOKUP_SIZE;
+    // Flop, turn and river showdowns are resolved from the precomputed ranks.
+    uint64_t rankStride = mRankStride;
+    uint64_t riverBlockSize = mRiverBlocks ? combinedRanges[0].combos().size() : 0;
+    if (rankStride)
+        useLookup = false;
+
+    // Fixed cards are the same in every preflop, so their suits are transformed only once. The holecards continue
+    // from the resulting suit transformation.
+    uint64_t boardCards = mBoardCards, deadCards = mDeadCards;
+    unsigned fixedSuitState = transformSuits(&boardCards, &deadCards);
+    Hand board = getBoardFromBitmask(boardCards);
+
+    // With checkpoints the results of the current batch are also gathered separately.
+    bool checkpointing = mCheckpointing;
+    Results batchResults;
+    if (checkpointing)
+        initResults(batchResults, nplayers, true);
+    // The cost of a preflop varies a lot (lookup hits vs. full postflop enumeration), so batch size follows the
+    // measured cost to keep the batches about equally long. Short batches keep the threads from finishing at
+    // different times, since the last batch of a thread can't be stolen.
+    uint64_t batchSize = maxBatchSize, batchStart = 0;
+    double preflopTime = 0;
+    bool interrupted = false;
+    auto batchStartTime = std::chrono::high_resolution_clock::now();
 
     for (;;++enumPosition) {
         // Ask for more work if we don't have any.
         if (enumPosition >= enumEnd) {
-            uint64_t batchSize = std::max<uint64_t>(2000000 / postflopCombos, 1);
-            std::tie(enumPosition, enumEnd) = reserveBatch(batchSize);
+            if (enumEnd > 0) {
+                auto t = std::chrono::high_resolution_clock::now();
+                double cost = 1e-9 * std::chrono::duration_cast<std::chrono::nanoseconds>(t - batchStartTime).count()
+                              / (enumEnd - batchStart);
+                preflopTime = preflopTime > 0 ? 0.5 * (preflopTime + cost) : cost;
+                batchSize = (uint64_t)std::max(std::min(TARGET_BATCH_TIME / std::max(preflopTime, 1e-12),
+                                                        (double)maxBatchSize), 1.0);
+            }
+            // Batch goes to the checkpoint only after all of its results have been counted.
+            if (checkpointing && enumEnd > 0) {
+                updateResults(stats, false, &batchResults);
+                stats.reset();
+                commitBatch(queueIdx, batchResults);
+                initResults(batchResults, nplayers, true);
+            }
+            if (mTracer && enumEnd > 0)
+                mTracer->end("batch");
+            std::tie(enumPosition, enumEnd) = reserveBatch(queueIdx, batchSize);
+            batchStart = enumPosition;
+            batchStartTime = std::chrono::high_resolution_clock::now();
             if (enumPosition >= enumEnd)
                 break;
+            if (mTracer)
+                mTracer->begin("batch");
+        }
+
+        // On river a whole block of the first range's combos can be resolved at once.
+        if (riverBlockSize && enumPosition % riverBlockSize == 0 && enumPosition + riverBlockSize <= enumEnd) {
+            resolveRiverBlock(enumPosition / riverBlockSize, combinedRanges, &stats);
+            enumPosition += riverBlockSize - 1;
+            if (stats.evalCount >= 10000 || stats.skippedPreflopCombos >= 10000) {
+                updateResults(stats, false, checkpointing ? &batchResults : nullptr);
+                stats.reset();
+                if (mStopped) {
+                    if (enumPosition + 1 < enumEnd)
+                        mIncomplete = true;
+                    if (mTracer)
+                        mTracer->end("batch");
+                    break;
+                }
+            }
+            continue;
         }
 
         // Use a quasi-RNG to randomize the preflop enumeration order, while still making sure
@@ -299,21 +717,27 @@ void EquityCalculator::enumerate()
         bool ok = true;
         uint64_t usedCardsMask = mBoardCards | mDeadCards;
         HandWithPlayerIdx playerHands[MAX_PLAYERS];
+        std::array<uint8_t,2> holeCards[MAX_PLAYERS];
+        const uint16_t* playerRanks[MAX_PLAYERS];
         for (unsigned i = 0; i < combinedRangeCount; ++i) {
             uint64_t quotient = libdivide_u64_do(randomizedEnumPos, &fastDividers[i]);
-            uint64_t remainder = randomizedEnumPos - quotient * mCombinedRanges[i].combos().size();
+            uint64_t remainder = randomizedEnumPos - quotient * combinedRanges[i].combos().size();
             randomizedEnumPos = quotient;
 
-            const CombinedRange::Combo& combo = mCombinedRanges[i].combos()[(size_t)remainder];
+            const CombinedRange::Combo& combo = combinedRanges[i].combos()[(size_t)remainder];
             if (usedCardsMask & combo.cardMask) {
                 ok = false;
                 break;
             }
             usedCardsMask |= combo.cardMask;
-            for (unsigned j = 0; j < mCombinedRanges[i].playerCount(); ++j) {
-                unsigned playerIdx = mCombinedRanges[i].players()[j];
+            for (unsigned j = 0; j < combinedRanges[i].playerCount(); ++j) {
+                unsigned playerIdx = combinedRanges[i].players()[j];
                 playerHands[playerIdx].cards = combo.holeCards[j];
                 playerHands[playerIdx].playerIdx = playerIdx;
+                holeCards[playerIdx] = combo.holeCards[j];
+                if (rankStride)
+                    playerRanks[playerIdx] = &mRankArena[mComboRankOffsets[i][remainder
+                                                                              * combinedRanges[i].playerCount() + j]];
             }
         }
 
@@ -321,66 +745,404 @@ void EquityCalculator::enumerate()
             ++stats.skippedPreflopCombos; //TODO fix skipcount
         } else {
             // Transform preflop into canonical form so that suit and player isomoprhism can be detected.
-            uint64_t boardCards = mBoardCards;
-            uint64_t deadCards = mDeadCards;
             if (useLookup) {
                 // Sort players based on their hand.
-                std::sort(playerHands, playerHands + nplayers, [](const HandWithPlayerIdx& lhs,
-                          const HandWithPlayerIdx& rhs){
-                    if (lhs.cards[0] >> 2 != rhs.cards[0] >> 2)
-                        return lhs.cards[0] >> 2 < rhs.cards[0] >> 2;
-                    if (lhs.cards[1] >> 2 != rhs.cards[1] >> 2)
-                        return lhs.cards[1] >> 2 < rhs.cards[1] >> 2;
-                    if ((lhs.cards[0] & 3) != (rhs.cards[0] & 3))
-                        return (lhs.cards[0] & 3) < (rhs.cards[0] & 3);
-                    return (lhs.cards[1] & 3) < (rhs.cards[1] & 3);
-                });
+                sortHands(playerHands, nplayers);
 
                 // Save original player indexes cause we eventually want the results for the original order.
                 for (unsigned i = 0; i < nplayers; ++i)
                     stats.playerIds[i] = playerHands[i].playerIdx;
 
                 // Suit isomorphism.
-                transformSuits(playerHands, nplayers, &boardCards, &deadCards);
+                unsigned suitTransform[SUIT_COUNT];
+                transformHoleCards(playerHands, nplayers, fixedSuitState, suitTransform);
                 usedCardsMask = boardCards | deadCards;
                 for (unsigned j = 0; j < nplayers; ++j)
                     usedCardsMask |= (1ull << playerHands[j].cards[0]) | (1ull << playerHands[j].cards[1]);
 
                 // Get cached results if this combo has already been calculated.
-                uint64_t preflopId = calculateUniquePreflopId(playerHands, nplayers);
-                if (lookupResults(preflopId, stats)) {
-                    for (unsigned i = 0; i < nplayers; ++i)
-                        stats.playerIds[i] = playerHands[i].playerIdx;
-                    stats.evalCount = 0;
-                    stats.uniquePreflopCombos = 0;
+                PreflopId preflopId = calculateUniquePreflopId(playerHands, nplayers);
+                if (lookupResults(preflopId, stats, flops ? &flopResults : nullptr)) {
+                    ++stats.lookupHits;
+                    OMP_PROFILE_COUNT(lookupHits, 1);
+                    if (flops)
+                        recordPreflopFlops(*flopResults, suitTransform, stats.playerIds, &detail);
                 } else {
                     // Do full postflop enumeration.
                     ++stats.uniquePreflopCombos;
-                    Hand board = getBoardFromBitmask(boardCards);
-                    enumerateBoard(playerHands, nplayers, board, usedCardsMask, &stats);
-                    storeResults(preflopId, stats);
+                    OMP_PROFILE_COUNT(lookupMisses, 1);
+                    if (flops) {
+                        std::fill(detail.preflopFlops.begin(), detail.preflopFlops.end(), 0.0);
+                        detail.dealtFlops.init(boardCards);
+                    }
+                    enumerateBoard(playerHands, nplayers, board, usedCardsMask, &stats, flops ? &detail : nullptr);
+                    if (mStopped.load(std::memory_order_relaxed)) {
+                        interrupted = true;
+                        break;
+                    }
+                    storeResults(preflopId, stats, flops ? &detail.preflopFlops : nullptr);
+                    if (flops)
+                        recordPreflopFlops(detail.preflopFlops, suitTransform, stats.playerIds, &detail);
                 }
+            } else if (rankStride) {
+                ++stats.uniquePreflopCombos;
+                evaluateRanks(playerRanks, nplayers, usedCardsMask, &stats);
             } else {
                 ++stats.uniquePreflopCombos;
-                enumerateBoard(playerHands, nplayers, fixedBoard, usedCardsMask, &stats);
+                if (flops) {
+                    std::fill(detail.preflopFlops.begin(), detail.preflopFlops.end(), 0.0);
+                    detail.dealtFlops.init(mBoardCards);
+                }
+                enumerateBoard(playerHands, nplayers, fixedBoard, usedCardsMask, &stats, &detail);
+                if (mStopped.load(std::memory_order_relaxed)) {
+                    interrupted = true;
+                    break;
+                }
+                if (flops) {
+                    static const unsigned IDENTITY[SUIT_COUNT] = {0, 1, 2, 3};
+                    recordPreflopFlops(detail.preflopFlops, IDENTITY, stats.playerIds, &detail);
+                }
             }
+
+            // Batch contains only the current preflop when distributions are enabled.
+            if (distributions)
+                recordComboDistributions(stats, holeCards, &detail);
         }
 
         //TODO combine lookup results here so we don't need update so often
-        if (stats.evalCount >= 10000 || stats.skippedPreflopCombos >= 10000 || useLookup) {
-            updateResults(stats, false);
-            stats = BatchResults(nplayers);
-            if (mStopped)
+        if (stats.evalCount >= 10000 || stats.skippedPreflopCombos >= 10000 || useLookup || distributions) {
+            updateResults(stats, false, checkpointing ? &batchResults : nullptr);
+            stats.reset();
+            if (mStopped) {
+                if (enumPosition + 1 < enumEnd)
+                    mIncomplete = true;
+                if (mTracer)
+                    mTracer->end("batch");
                 break;
+            }
         }
     }
 
+    // Stopping can cut the board enumeration of a preflop short, so the unreported results of the batch are
+    // discarded. That leaves only complete preflops in the results (and in the lookup table for checkpoints).
+    if (interrupted) {
+        stats.reset();
+        mIncomplete = true;
+        if (mTracer)
+            mTracer->end("batch");
+    }
+    if (distributions || runouts)
+        mergeDetailStats(detail);
     updateResults(stats, true);
+    if (mTracer)
+        mTracer->end("thread");
 }
 
+// Evaluates every combo of every player once on flop, turn or river, so that enumeration only has to compare the
+// ranks. On river each combo has a single rank. On turn there is a rank for each river card, and on flop for each
+// pair of turn and river cards (indexed by the pair's position in the deck, see below). Runouts that contain a card
+// that is on the board, dead or in the combo itself get rank 0. Players with the same combo share its ranks.
+void EquityCalculator::precomputeRanks()
+{
+    Hand board = getBoardFromBitmask(mBoardCards);
+    uint64_t boardAndDead = mBoardCards | mDeadCards;
+    unsigned boardCount = board.count();
+    mRankStride = boardCount == BOARD_CARDS ? 1 : boardCount == 4 ? TURN_RANK_STRIDE : FLOP_RANK_STRIDE;
+    // Combined ranges haven't changed since the ranks were computed for the same cards (see start()).
+    if (mRanksValid && mRankedBoardCards == mBoardCards && mRankedDeadCards == mDeadCards) {
+        mRiverBlocks = mRankStride == 1 && mCombinedRanges[0].playerCount() == 1;
+        return;
+    }
+    mRanksValid = true;
+    mRankedBoardCards = mBoardCards;
+    mRankedDeadCards = mDeadCards;
+
+    // Flop runout of deck cards k < l has index l * (l - 1) / 2 + k.
+    unsigned deck[CARD_COUNT], ndeck = 0;
+    if (mRankStride == FLOP_RANK_STRIDE) {
+        for (unsigned card = 0; card < CARD_COUNT; ++card) {
+            if (!(boardAndDead & (1ull << card)))
+                deck[ndeck++] = card;
+        }
+        mRunouts.assign(FLOP_RUNOUT_WORDS, 0);
+        mRunoutsByCard.assign(CARD_COUNT * FLOP_RUNOUT_WORDS, 0);
+        for (unsigned l = 1, idx = 0; l < ndeck; ++l) {
+            for (unsigned k = 0; k < l; ++k, ++idx) {
+                uint64_t bit = 1ull << (idx & 63);
+                mRunouts[idx >> 6] |= bit;
+                mRunoutsByCard[deck[k] * FLOP_RUNOUT_WORDS + (idx >> 6)] |= bit;
+                mRunoutsByCard[deck[l] * FLOP_RUNOUT_WORDS + (idx >> 6)] |= bit;
+            }
+        }
+    }
+
+    std::vector<int32_t> offsetByCombo(CARD_COUNT * CARD_COUNT, -1);
+    mRankArena.clear();
+    for (unsigned i = 0; i < mCombinedRangeCount; ++i) {
+        const CombinedRange& range = mCombinedRanges[i];
+        std::vector<uint32_t>& offsets = mComboRankOffsets[i];
+        offsets.clear();
+        for (auto& combo : range.combos()) {
+            for (unsigned j = 0; j < range.playerCount(); ++j) {
+                unsigned c0 = std::min(combo.holeCards[j][0], combo.holeCards[j][1]);
+                unsigned c1 = std::max(combo.holeCards[j][0], combo.holeCards[j][1]);
+                int32_t& offset = offsetByCombo[c0 * CARD_COUNT + c1];
+                if (offset >= 0) {
+                    offsets.push_back(offset);
+                    continue;
+                }
+                offset = (int32_t)mRankArena.size();
+                offsets.push_back(offset);
+                mRankArena.resize(mRankArena.size() + mRankStride, 0);
+                uint16_t* r = &mRankArena[offset];
+                Hand hand = board + combo.evalHands[j];
+                uint64_t usedCards = boardAndDead | (1ull << c0) | (1ull << c1);
+                if (mRankStride == 1) {
+                    r[0] = mEval.evaluate(hand);
+                } else if (mRankStride == TURN_RANK_STRIDE) {
+                    for (unsigned card = 0; card < CARD_COUNT; ++card) {
+                        if (!(usedCards & (1ull << card)))
+                            r[card] = mEval.evaluate(hand + card);
+                    }
+                } else {
+                    for (unsigned l = 1; l < ndeck; ++l) {
+                        if (usedCards & (1ull << deck[l]))
+                            continue;
+                        Hand turnHand = hand + deck[l];
+                        uint16_t* lr = r + l * (l - 1) / 2;
+                        for (unsigned k = 0; k < l; ++k) {
+                            if (!(usedCards & (1ull << deck[k])))
+                                lr[k] = mEval.evaluate(turnHand + deck[k]);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    const CombinedRange& first = mCombinedRanges[0];
+    mRiverBlocks = mRankStride == 1 && first.playerCount() == 1;
+    if (!mRiverBlocks)
+        return;
+    mSortedRanks.clear();
+    mRankByCombo.assign(CARD_COUNT * CARD_COUNT, -1);
+    for (unsigned card = 0; card < CARD_COUNT; ++card)
+        mSortedRanksByCard[card].clear();
+    for (size_t i = 0; i < first.combos().size(); ++i) {
+        std::array<uint8_t,2> cards = first.combos()[i].holeCards[0];
+        uint16_t rank = mRankArena[mComboRankOffsets[0][i]];
+        mSortedRanks.push_back(rank);
+        mSortedRanksByCard[cards[0]].push_back(rank);
+        mSortedRanksByCard[cards[1]].push_back(rank);
+        mRankByCombo[cards[0] * CARD_COUNT + cards[1]] = mRankByCombo[cards[1] * CARD_COUNT + cards[0]] = rank;
+    }
+    std::sort(mSortedRanks.begin(), mSortedRanks.end());
+    for (unsigned card = 0; card < CARD_COUNT; ++card)
+        std::sort(mSortedRanksByCard[card].begin(), mSortedRanksByCard[card].end());
+}
+
+// Resolves on river all the preflops that differ only by the combo of the first combined range, i.e. a block of
+// consecutive preflop indexes. The other players' best rank is compared to the sorted ranks of the first range, so
+// that the combos that win, tie and lose are counted with a few binary searches instead of going through them. Combos
+// that conflict with the other players' cards are removed from the counts by inclusion-exclusion: a combo has two
+// cards, so it's enough to subtract the combos with each used card and add back the combos with two used cards.
+void EquityCalculator::resolveRiverBlock(uint64_t outerIdx, const CombinedRange* combinedRanges,
+                                         BatchResults* stats) const
+{
+    uint64_t blockSize = combinedRanges[0].combos().size();
+    uint64_t usedCardsMask = 0;
+    unsigned bestRank = 0, winnersMask = 0;
+    for (unsigned i = 1; i < mCombinedRangeCount; ++i) {
+        const CombinedRange& range = combinedRanges[i];
+        uint64_t comboIdx = outerIdx % range.combos().size();
+        outerIdx /= range.combos().size();
+        const CombinedRange::Combo& combo = range.combos()[(size_t)comboIdx];
+        if (usedCardsMask & combo.cardMask) {
+            stats->skippedPreflopCombos += blockSize;
+            return;
+        }
+        usedCardsMask |= combo.cardMask;
+        for (unsigned j = 0; j < range.playerCount(); ++j) {
+            unsigned rank = mRankArena[mComboRankOffsets[i][comboIdx * range.playerCount() + j]];
+            unsigned m = 1u << range.players()[j];
+            if (rank > bestRank) {
+                bestRank = rank;
+                winnersMask = m;
+            } else if (rank == bestRank) {
+                winnersMask |= m;
+            }
+        }
+    }
+
+    // Numbers of valid combos, and ones with rank at least / above the best rank.
+    auto countFrom = [](const std::vector<uint16_t>& ranks, unsigned rank, bool above){
+        auto it = above ? std::upper_bound(ranks.begin(), ranks.end(), rank)
+                        : std::lower_bound(ranks.begin(), ranks.end(), rank);
+        return (int64_t)(ranks.end() - it);
+    };
+    int64_t valid = (int64_t)blockSize;
+    int64_t atLeast = countFrom(mSortedRanks, bestRank, false), above = countFrom(mSortedRanks, bestRank, true);
+    unsigned usedCards[2 * MAX_PLAYERS], usedCount = 0;
+    for (unsigned card = 0; card < CARD_COUNT; ++card) {
+        if (usedCardsMask & (1ull << card))
+            usedCards[usedCount++] = card;
+    }
+    for (unsigned k = 0; k < usedCount; ++k) {
+        const std::vector<uint16_t>& ranks = mSortedRanksByCard[usedCards[k]];
+        valid -= ranks.size();
+        atLeast -= countFrom(ranks, bestRank, false);
+        above -= countFrom(ranks, bestRank, true);
+        for (unsigned l = k + 1; l < usedCount; ++l) {
+            int32_t rank = mRankByCombo[usedCards[k] * CARD_COUNT + usedCards[l]];
+            valid += rank >= 0;
+            atLeast += rank >= (int32_t)bestRank;
+            above += rank > (int32_t)bestRank;
+        }
+    }
+
+    unsigned m = 1u << combinedRanges[0].players()[0];
+    stats->winsByPlayerMask[m] += (unsigned)above;
+    stats->winsByPlayerMask[winnersMask | m] += (unsigned)(atLeast - above);
+    stats->winsByPlayerMask[winnersMask] += (unsigned)(valid - atLeast);
+    stats->skippedPreflopCombos += blockSize - valid;
+    stats->uniquePreflopCombos += valid;
+    stats->evalCount += valid;
+}
+
+// Resolves the showdowns of a preflop from the precomputed ranks. On turn the winners are found for 8 river cards
+// at a time, and then counted for the cards that are not used.
+void EquityCalculator::evaluateRanks(const uint16_t* const* playerRanks, unsigned nplayers, uint64_t usedCardsMask,
+                                     BatchResults* stats) const
+{
+    if (mRankStride == 1) {
+        unsigned bestRank = 0, winnersMask = 0;
+        for (unsigned i = 0, m = 1; i < nplayers; ++i, m <<= 1) {
+            unsigned rank = playerRanks[i][0];
+            if (rank > bestRank) {
+                bestRank = rank;
+                winnersMask = m;
+            } else if (rank == bestRank) {
+                winnersMask |= m;
+            }
+        }
+        ++stats->evalCount;
+        ++stats->winsByPlayerMask[winnersMask];
+        return;
+    }
+    #if OMP_SSE2
+    if (mRankStride == FLOP_RANK_STRIDE) {
+        evaluateFlopRanks(playerRanks, nplayers, usedCardsMask, stats);
+        return;
+    }
+    #endif
+
+    alignas(16) uint16_t winnerMasks[TURN_RANK_STRIDE];
+    #if OMP_SSE2
+    // Ranks don't fit in signed 16 bits, so they are biased for the signed max.
+    const __m128i bias = _mm_set1_epi16((short)0x8000);
+    for (unsigned c = 0; c < TURN_RANK_STRIDE; c += 8) {
+        __m128i ranks[MAX_PLAYERS];
+        __m128i best = _mm_set1_epi16((short)0x8000);
+        for (unsigned i = 0; i < nplayers; ++i) {
+            ranks[i] = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(playerRanks[i] + c)), bias);
+            best = _mm_max_epi16(best, ranks[i]);
+        }
+        __m128i winners = _mm_setzero_si128();
+        for (unsigned i = 0; i < nplayers; ++i) {
+            __m128i isBest = _mm_cmpeq_epi16(ranks[i], best);
+            winners = _mm_or_si128(winners, _mm_and_si128(isBest, _mm_set1_epi16((short)(1 << i))));
+        }
+        _mm_store_si128((__m128i*)(winnerMasks + c), winners);
+    }
+    #else
+    for (unsigned c = 0; c < TURN_RANK_STRIDE; ++c) {
+        unsigned bestRank = 0, winnersMask = 0;
+        for (unsigned i = 0, m = 1; i < nplayers; ++i, m <<= 1) {
+            unsigned rank = playerRanks[i][c];
+            if (rank > bestRank) {
+                bestRank = rank;
+                winnersMask = m;
+            } else if (rank == bestRank) {
+                winnersMask |= m;
+            }
+        }
+        winnerMasks[c] = (uint16_t)winnersMask;
+    }
+    #endif
+
+    // Only the river cards that are still in the deck are counted.
+    uint64_t freeCards = ~usedCardsMask;
+    for (unsigned c = 0; c < CARD_COUNT; ++c)
+        stats->winsByPlayerMask[winnerMasks[c]] += (freeCards >> c) & 1;
+    stats->evalCount += bitCount(freeCards & ((1ull << CARD_COUNT) - 1));
+}
+
+// Resolves the showdowns of a preflop on flop. The players that have the best rank are found for 16 runouts at a
+// time and stored as a bitset of runouts for each player. The runouts that contain the players' cards are removed
+// with the bitsets of the cards, and then each winner mask is counted with popcounts. With more than 4 players there
+// are too many masks, so the winner mask of each runout is counted separately.
+#if OMP_SSE2
+void EquityCalculator::evaluateFlopRanks(const uint16_t* const* playerRanks, unsigned nplayers,
+                                         uint64_t usedCardsMask, BatchResults* stats) const
+{
+    uint64_t winners[MAX_PLAYERS][FLOP_RUNOUT_WORDS];
+    const __m128i bias = _mm_set1_epi16((short)0x8000);
+    for (unsigned c = 0; c < FLOP_RANK_STRIDE; c += 16) {
+        __m128i lo[MAX_PLAYERS], hi[MAX_PLAYERS];
+        __m128i bestLo = bias, bestHi = bias;
+        for (unsigned i = 0; i < nplayers; ++i) {
+            lo[i] = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(playerRanks[i] + c)), bias);
+            hi[i] = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(playerRanks[i] + c + 8)), bias);
+            bestLo = _mm_max_epi16(bestLo, lo[i]);
+            bestHi = _mm_max_epi16(bestHi, hi[i]);
+        }
+        for (unsigned i = 0; i < nplayers; ++i) {
+            __m128i isBest = _mm_packs_epi16(_mm_cmpeq_epi16(lo[i], bestLo), _mm_cmpeq_epi16(hi[i], bestHi));
+            uint64_t bits = (uint64_t)(unsigned)_mm_movemask_epi8(isBest) << (c & 63);
+            if ((c & 63) == 0)
+                winners[i][c >> 6] = bits;
+            else
+                winners[i][c >> 6] |= bits;
+        }
+    }
+
+    // Runouts that are still in the deck.
+    uint64_t valid[FLOP_RUNOUT_WORDS];
+    std::copy(mRunouts.begin(), mRunouts.end(), valid);
+    uint64_t playerCards = usedCardsMask & ~(mBoardCards | mDeadCards);
+    while (playerCards) {
+        const uint64_t* runouts = &mRunoutsByCard[countTrailingZeros(playerCards) * FLOP_RUNOUT_WORDS];
+        for (unsigned w = 0; w < FLOP_RUNOUT_WORDS; ++w)
+            valid[w] &= ~runouts[w];
+        playerCards &= playerCards - 1;
+    }
+
+    for (unsigned w = 0; w < FLOP_RUNOUT_WORDS; ++w) {
+        uint64_t v = valid[w];
+        stats->evalCount += bitCount(v);
+        if (nplayers <= 4) {
+            for (unsigned mask = 1; mask < 1u << nplayers; ++mask) {
+                uint64_t bits = v;
+                for (unsigned i = 0; i < nplayers; ++i)
+                    bits &= (mask >> i) & 1 ? winners[i][w] : ~winners[i][w];
+                stats->winsByPlayerMask[mask] += bitCount(bits);
+            }
+        } else {
+            for (; v; v &= v - 1) {
+                unsigned b = countTrailingZeros(v), mask = 0;
+                for (unsigned i = 0; i < nplayers; ++i)
+                    mask |= (unsigned)((winners[i][w] >> b) & 1) << i;
+                ++stats->winsByPlayerMask[mask];
+            }
+        }
+    }
+}
+#endif
+
 // Starts the postflop enumeration.
 void EquityCalculator::enumerateBoard(const HandWithPlayerIdx* playerHands, unsigned nplayers,
-                                 const Hand& board, uint64_t usedCardsMask, BatchResults* stats)
+                                 const Hand& board, uint64_t usedCardsMask, BatchResults* stats,
+                                 DetailStats* detail)
 {
     Hand hands[MAX_PLAYERS];
     for (unsigned i = 0; i < nplayers; ++i)
@@ -389,20 +1151,13 @@ void EquityCalculator::enumerateBoard(const HandWithPlayerIdx* playerHands, unsi
     // Take a shortcut when no board cards left to iterate.
     unsigned remainingCards = BOARD_CARDS - board.count();
     if (remainingCards == 0) {
-        evaluateHands(hands, nplayers, board, stats, 1);
+        if (!stats->categoryCounts.empty())
+            evaluateHands<STATS_CATEGORIES>(hands, nplayers, board, stats, 1);
+        else
+            evaluateHands(hands, nplayers, board, stats, 1);
         return;
     }
 
-    // Initialize deck. This also determines the enumeration order. Iterating ranks in descending order is ~5%
-    // faster for some reason. Could be better branch prediction, because lower cards affect hand value less. It's
-    // unlikely to be due to caching, because reversing the evaluator's rank multipliers has no effect.
-    unsigned deck[CARD_COUNT];
-    unsigned ndeck = 0;
-    for (unsigned c = CARD_COUNT; c-- > 0;) {
-        if(!(usedCardsMask & (1ull << c)))
-            deck[ndeck++] = c;
-    }
-
     // Calculate the maximum card count for each suit that any player can have after holecards and fixed board cards.
     unsigned suitCounts[SUIT_COUNT] = {};
     for (unsigned i = 0; i < nplayers; ++i) {
@@ -413,19 +1168,85 @@ void EquityCalculator::enumerateBoard(const HandWithPlayerIdx* playerHands, unsi
             suitCounts[playerHands[i].cards[1] & 3] = std::max(1u, suitCounts[playerHands[i].cards[1] & 3]);
         }
     }
+
     for (unsigned i = 0; i < SUIT_COUNT; ++i)
         suitCounts[i] += board.suitCount(i);
 
-    enumerateBoardRec(hands, nplayers, stats, board, deck, ndeck, suitCounts, remainingCards, 0, 1);
+    // Initialize deck. This also determines the enumeration order. Iterating ranks in descending order is ~5%
+    // faster for some reason. Could be better branch prediction, because lower cards affect hand value less. It's
+    // unlikely to be due to caching, because reversing the evaluator's rank multipliers has no effect.
+    unsigned deck[CARD_COUNT];
+    unsigned ndeck = 0;
+    for (unsigned c = CARD_COUNT; c-- > 0;) {
+        if(!(usedCardsMask & (1ull << c)))
+            deck[ndeck++] = c;
+    }
+
+    // Board recursion is instantiated separately for each combination of optional statistics. Distributions are only
+    // needed there for the flops.
+    typedef void (EquityCalculator::*BoardEnumerator)(const Hand*, unsigned, BatchResults*, const Hand&, unsigned*,
+                                                      unsigned, unsigned*, const unsigned*, unsigned, unsigned,
+                                                      unsigned, DetailStats*);
+    static const BoardEnumerator BOARD_ENUMERATORS[] = {
+        &EquityCalculator::enumerateBoardRec<0>,
+        &EquityCalculator::enumerateBoardRec<STATS_DISTRIBUTIONS>,
+        &EquityCalculator::enumerateBoardRec<STATS_RUNOUTS>,
+        &EquityCalculator::enumerateBoardRec<STATS_DISTRIBUTIONS | STATS_RUNOUTS>,
+        &EquityCalculator::enumerateBoardRec<STATS_CATEGORIES>,
+        &EquityCalculator::enumerateBoardRec<STATS_CATEGORIES | STATS_DISTRIBUTIONS>,
+        &EquityCalculator::enumerateBoardRec<STATS_CATEGORIES | STATS_RUNOUTS>,
+        &EquityCalculator::enumerateBoardRec<STATS_CATEGORIES | STATS_DISTRIBUTIONS | STATS_RUNOUTS>
+    };
+    unsigned optionalStats = 0;
+    if (detail && !detail->flopHands.empty() && board.count() < 3)
+        optionalStats |= STATS_DISTRIBUTIONS;
+    if (detail && !detail->runoutWins.empty())
+        optionalStats |= STATS_RUNOUTS;
+    if (!stats->categoryCounts.empty())
+        optionalStats |= STATS_CATEGORIES;
+
+    // Suits that have the same ranks in every player's hand and in the used cards (board and dead cards) are
+    // interchangeable. Each suit gets the mask of the suits it's interchangeable with. Runouts and flops need the
+    // results for the actual cards, so they don't use this.
+    static const uint64_t SUIT_RANKS = 0x1111111111111ull;
+    unsigned suitClasses[SUIT_COUNT];
+    for (unsigned a = 0; a < SUIT_COUNT; ++a) {
+        suitClasses[a] = 1u << a;
+        for (unsigned b = 0; b < SUIT_COUNT && !(optionalStats & (STATS_DISTRIBUTIONS | STATS_RUNOUTS)); ++b) {
+            bool same = b != a && ((usedCardsMask >> a) & SUIT_RANKS) == ((usedCardsMask >> b) & SUIT_RANKS);
+            for (unsigned i = 0; i < nplayers && same; ++i) {
+                uint64_t cards = (1ull << playerHands[i].cards[0]) | (1ull << playerHands[i].cards[1]);
+                same = ((cards >> a) & SUIT_RANKS) == ((cards >> b) & SUIT_RANKS);
+            }
+            suitClasses[a] |= (unsigned)same << b;
+        }
+    }
+
+    (this->*BOARD_ENUMERATORS[optionalStats])(hands, nplayers, stats, board, deck, ndeck, suitCounts, suitClasses,
+                                              remainingCards, 0, 1, detail);
 }
 
 // Enumerates board cards recursively. Detects some isomorphic subtrees by looking at the number of cards for
 // each suit. Suits that cannot create a flush anymore (called here "irrelevant suits") are handled at the same time,
-// which gives roughly a speedup of 3x.
+// which gives roughly a speedup of 3x. With runout or flop tracking enabled the dealt cards are also kept in a stack,
+// so that the weights of the isomorphic subtrees can be unfolded back to individual cards.
+//
+// Interchangeable suits (suitClasses, see enumerateBoard()) are folded too: when a card of such a suit is dealt, the
+// cards of the same rank in all the interchangeable suits are dealt as a group like the irrelevant suits, and only
+// the first cards of the group are used. After that the suits that got a card and the ones that didn't are
+// interchangeable only among themselves.
+template<unsigned tStats>
 void EquityCalculator::enumerateBoardRec(const Hand* playerHands, unsigned nplayers, BatchResults* stats,
                                 const Hand& board, unsigned* deck, unsigned ndeck, unsigned* suitCounts,
-                                unsigned cardsLeft, unsigned start, unsigned weight)
+                                const unsigned* suitClasses, unsigned cardsLeft, unsigned start, unsigned weight,
+                                DetailStats* detail)
 {
+    static const unsigned BINOM_COEFF[5][5] = {{0}, {0, 1}, {1, 2, 1}, {1, 3, 3, 1}, {1, 4, 6, 4, 1}};
+    static const bool tRunouts = (tStats & STATS_RUNOUTS) != 0;
+    static const bool tFlops = (tStats & STATS_DISTRIBUTIONS) != 0;
+    static const bool tDealtCards = tRunouts || tFlops;
+    OMP_PROFILE_COUNT(boardNodes[cardsLeft], 1);
+
     // More efficient version for the innermost loop.
     if (cardsLeft == 1)
     {
@@ -435,41 +1256,67 @@ void EquityCalculator::enumerateBoardRec(const Hand* playerHands, unsigned nplay
                 unsigned multiplier = 1;
 
                 Hand newBoard = board + deck[i];
+                unsigned first = i;
 
                 // Count how many cards there are with same rank.
                 unsigned rank = deck[i] >> 2;
                 for (++i; i < ndeck && deck[i] >> 2 == rank; ++i)
                     ++multiplier;
-
-                evaluateHands<false>(playerHands, nplayers, newBoard, stats, multiplier * weight);
+                OMP_PROFILE_COUNT(foldedSubtrees, multiplier - 1);
+
+                unsigned winnersMask = evaluateHands<tStats, false>(playerHands, nplayers, newBoard, stats,
+                                                            multiplier * weight);
+                if (tRunouts)
+                    recordRunout(winnersMask, multiplier * weight, &deck[first], multiplier, detail);
+                if (tFlops)
+                    recordLastCardFlops(winnersMask, multiplier * weight, &deck[first], multiplier, detail);
             }
         } else {
-            unsigned lastRank = ~0;
+            unsigned irrelevantSuits = 0;
+            for (unsigned suit = 0; suit < SUIT_COUNT; ++suit)
+                irrelevantSuits |= (unsigned)(suitCounts[suit] < 4) << suit;
+            unsigned lastRank = ~0, foldedSuits = 0;
             for (unsigned i = start; i < ndeck; ++i) {
                 unsigned multiplier = 1;
+                unsigned group[SUIT_COUNT] = {deck[i]};
 
-                if (suitCounts[deck[i] & 3] < 4) {
-                    unsigned rank = deck[i] >> 2;
-                    if (rank == lastRank)
-                        continue;
-                    // Since this is last card there's no need to do reorder deck cards; we just count the
-                    // irrelevant suits in current rank.
-                    for (unsigned j = i + 1; j < ndeck && deck[j] >> 2 == rank; ++j) {
-                        if (suitCounts[deck[j] & 3] < 4)
-                            ++multiplier;
-                    }
+                unsigned rank = deck[i] >> 2, suit = deck[i] & 3;
+                if (rank != lastRank) {
                     lastRank = rank;
+                    foldedSuits = 0;
+                }
+                if ((foldedSuits >> suit) & 1)
+                    continue;
+                // Since this is last card there's no need to do reorder deck cards; we just count the irrelevant or
+                // interchangeable suits in current rank.
+                unsigned sameSuits = (irrelevantSuits >> suit) & 1 ? irrelevantSuits : suitClasses[suit];
+                foldedSuits |= sameSuits;
+                for (unsigned j = i + 1; j < ndeck && deck[j] >> 2 == rank; ++j) {
+                    if ((sameSuits >> (deck[j] & 3)) & 1) {
+                        if (tDealtCards)
+                            group[multiplier] = deck[j];
+                        ++multiplier;
+                    }
                 }
+                OMP_PROFILE_COUNT(foldedSubtrees, multiplier - 1);
 
                 Hand newBoard = board + deck[i];
-                evaluateHands(playerHands, nplayers, newBoard, stats, multiplier * weight);
+                unsigned winnersMask = evaluateHands<tStats>(playerHands, nplayers, newBoard, stats,
+                                                             multiplier * weight);
+                if (tRunouts)
+                    recordRunout(winnersMask, multiplier * weight, group, multiplier, detail);
+                if (tFlops)
+                    recordLastCardFlops(winnersMask, multiplier * weight, group, multiplier, detail);
             }
         }
         return;
     }
 
-    // General version.
+    // General version. Stopping is checked before each card when at least 4 cards are left, which keeps the latency
+    // low even when a single preflop takes a long time to enumerate. Checking deeper slows down the enumeration.
     for (unsigned i = start; i < ndeck; ++i) {
+        if (cardsLeft >= 4 && shouldStop())
+            return;
         Hand newBoard = board;
 
         unsigned suit = deck[i] & 3;
@@ -492,38 +1339,182 @@ void EquityCalculator::enumerateBoardRec(const Hand* playerHands, unsigned nplay
             // When there are multiple cards with irrelevant suits we have to choose how many of them to use,
             // and the number of isomorphic subtrees depends on it.
             for (unsigned repeats = 1; repeats <= std::min(irrelevantCount, cardsLeft); ++repeats) {
-                static const unsigned BINOM_COEFF[5][5] = {{0}, {0, 1}, {1, 2, 1}, {1, 3, 3, 1}, {1, 4, 6, 4, 1}};
                 unsigned newWeight = BINOM_COEFF[irrelevantCount][repeats] * weight;
+                OMP_PROFILE_COUNT(foldedSubtrees, BINOM_COEFF[irrelevantCount][repeats] - 1);
                 newBoard += deck[i + repeats - 1];
-                if (repeats == cardsLeft)
-                    evaluateHands(playerHands, nplayers, newBoard, stats, newWeight);
-                else
-                    enumerateBoardRec(playerHands, nplayers, stats, newBoard, deck, ndeck, suitCounts,
-                                  cardsLeft - repeats, i + irrelevantCount, newWeight);
+                if (tRunouts)
+                    detail->dealt.push(&deck[i], irrelevantCount, repeats);
+                if (tFlops)
+                    detail->dealtFlops.push(&deck[i], irrelevantCount, repeats);
+                if (repeats == cardsLeft) {
+                    unsigned winnersMask = evaluateHands<tStats>(playerHands, nplayers, newBoard, stats, newWeight);
+                    if (tRunouts)
+                        recordRunout(winnersMask, newWeight, nullptr, 0, detail);
+                    if (tFlops)
+                        addShowdown(detail->dealtFlops.levels[detail->dealtFlops.size].totals, winnersMask, newWeight);
+                } else {
+                    enumerateBoardRec<tStats>(playerHands, nplayers, stats, newBoard, deck, ndeck, suitCounts,
+                                              suitClasses, cardsLeft - repeats, i + irrelevantCount, newWeight,
+                                              detail);
+                }
+                if (tRunouts)
+                    detail->dealt.pop();
+                if (tFlops)
+                    popDealtFlops(detail);
             }
 
             i += irrelevantCount - 1;
+        } else if (suitClasses[suit] != 1u << suit) {
+            unsigned suitClass = suitClasses[suit];
+            unsigned rank = deck[i] >> 2;
+            unsigned groupSize = 1;
+
+            // Move the cards of the interchangeable suits to the front like the irrelevant suits above.
+            for (unsigned j = i + 1; j < ndeck && deck[j] >> 2 == rank; ++j) {
+                if ((suitClass >> (deck[j] & 3)) & 1) {
+                    if (j != i + groupSize)
+                        std::swap(deck[j], deck[i + groupSize]);
+                    ++groupSize;
+                }
+            }
+
+            unsigned dealtSuits = 0;
+            unsigned maxRepeats = std::min(groupSize, cardsLeft);
+            for (unsigned repeats = 1; repeats <= maxRepeats; ++repeats) {
+                unsigned newWeight = BINOM_COEFF[groupSize][repeats] * weight;
+                OMP_PROFILE_COUNT(foldedSubtrees, BINOM_COEFF[groupSize][repeats] - 1);
+                unsigned card = deck[i + repeats - 1];
+                newBoard += card;
+                ++suitCounts[card & 3];
+                dealtSuits |= 1u << (card & 3);
+                if (repeats == cardsLeft) {
+                    evaluateHands<tStats>(playerHands, nplayers, newBoard, stats, newWeight);
+                } else {
+                    unsigned newSuitClasses[SUIT_COUNT];
+                    for (unsigned s = 0; s < SUIT_COUNT; ++s) {
+                        if (!((suitClass >> s) & 1))
+                            newSuitClasses[s] = suitClasses[s];
+                        else
+                            newSuitClasses[s] = (dealtSuits >> s) & 1 ? dealtSuits : suitClass & ~dealtSuits;
+                    }
+                    enumerateBoardRec<tStats>(playerHands, nplayers, stats, newBoard, deck, ndeck, suitCounts,
+                                              newSuitClasses, cardsLeft - repeats, i + groupSize, newWeight, detail);
+                }
+            }
+            for (unsigned j = 0; j < maxRepeats; ++j)
+                --suitCounts[deck[i + j] & 3];
+
+            i += groupSize - 1;
         } else {
             newBoard += deck[i];
             ++suitCounts[suit];
-            enumerateBoardRec(playerHands, nplayers, stats, newBoard, deck, ndeck, suitCounts,
-                              cardsLeft - 1, i + 1, weight);
+            if (tRunouts)
+                detail->dealt.push(&deck[i], 1, 1);
+            if (tFlops)
+                detail->dealtFlops.push(&deck[i], 1, 1);
+            enumerateBoardRec<tStats>(playerHands, nplayers, stats, newBoard, deck, ndeck, suitCounts,
+                                      suitClasses, cardsLeft - 1, i + 1, weight, detail);
+            if (tRunouts)
+                detail->dealt.pop();
+            if (tFlops)
+                popDealtFlops(detail);
             --suitCounts[suit];
         }
     }
 }
 
-// Lookup cached results for particular preflop.
-bool EquityCalculator::lookupResults(uint64_t preflopId, BatchResults& results)
+// Records an enumerated showdown for each card that was dealt to the board. The cards are in the dealt card stack
+// and optionally in an extra group for the last card. A group of n interchangeable cards where k cards were dealt
+// represents all the k-card subsets, so each of the cards is on the board in k/n of the weight.
+void EquityCalculator::recordRunout(unsigned winnersMask, uint64_t weight, const unsigned* lastGroup,
+                                    unsigned lastGroupSize, DetailStats* detail) const
+{
+    unsigned nplayers = mResults.players;
+    const DealtCards& dealt = detail->dealt;
+    for (unsigned i = 0; i < dealt.size; ++i) {
+        uint64_t cardWeight = weight * dealt.dealtCounts[i] / dealt.groupSizes[i];
+        for (unsigned j = 0; j < dealt.groupSizes[i]; ++j)
+            detail->runoutWins[(dealt.groups[i][j] << nplayers) | winnersMask] += cardWeight;
+    }
+    for (unsigned j = 0; j < lastGroupSize; ++j)
+        detail->runoutWins[(lastGroup[j] << nplayers) | winnersMask] += weight / lastGroupSize;
+}
+
+// Adds a showdown to totals that consist of hand count followed by equity for each player.
+void EquityCalculator::addShowdown(double* totals, unsigned winnersMask, double weight)
+{
+    totals[0] += weight;
+    double share = weight / bitCount(winnersMask);
+    for (unsigned m = winnersMask; m; m &= m - 1)
+        totals[1 + countTrailingZeros(m)] += share;
+}
+
+// Removes the top level of the dealt flop stack after its subtree has been enumerated. The flops completed by its
+// cards get the showdown totals of the subtree, which are then passed on to the level below.
+void EquityCalculator::popDealtFlops(DetailStats* detail) const
 {
-    if (!mDeadCards && !mBoardCards && lookupPrecalculatedResults(preflopId, results))
+    DealtFlops& dealtFlops = detail->dealtFlops;
+    const DealtFlops::Level& level = dealtFlops.levels[dealtFlops.size];
+    DealtFlops::Level& prevLevel = dealtFlops.levels[--dealtFlops.size];
+    unsigned stride = mResults.players + 1;
+    if (level.totals[0] != 0) {
+        for (size_t i = prevLevel.flopCount; i < level.flopCount; ++i) {
+            double* flopResults = &detail->preflopFlops[dealtFlops.flops[i].first * stride];
+            double weight = dealtFlops.flops[i].second;
+            for (unsigned j = 0; j < stride; ++j)
+                flopResults[j] += weight * level.totals[j];
+        }
+        for (unsigned j = 0; j < stride; ++j)
+            prevLevel.totals[j] += level.totals[j];
+    }
+    for (unsigned i = 0; i < 3; ++i)
+        dealtFlops.partialFlops[i].resize(prevLevel.partialFlopCounts[i]);
+    dealtFlops.flops.resize(prevLevel.flopCount);
+}
+
+// Records a showdown for the flops that are completed by the last card. It's one of the cards in the group.
+void EquityCalculator::recordLastCardFlops(unsigned winnersMask, double weight, const unsigned* lastGroup,
+                                           unsigned lastGroupSize, DetailStats* detail) const
+{
+    DealtFlops& dealtFlops = detail->dealtFlops;
+    addShowdown(dealtFlops.levels[dealtFlops.size].totals, winnersMask, weight);
+    double cardWeight = weight / lastGroupSize;
+    double share = cardWeight / bitCount(winnersMask);
+    for (auto& flop : dealtFlops.partialFlops[2]) {
+        for (unsigned i = 0; i < lastGroupSize; ++i) {
+            double* flopResults = &detail->preflopFlops[getFlopIndex(flop.cards[0], flop.cards[1], lastGroup[i])
+                                                        * (mResults.players + 1)];
+            flopResults[0] += flop.weight * cardWeight;
+            for (unsigned m = winnersMask; m; m &= m - 1)
+                flopResults[1 + countTrailingZeros(m)] += flop.weight * share;
+        }
+    }
+}
+
+// Lookup cached results for particular preflop and add them to the batch, which shouldn't have any other showdowns.
+// Optionally requires the flop results too. Precalculated results don't have hand categories.
+bool EquityCalculator::lookupResults(const PreflopId& preflopId, BatchResults& results,
+                                     std::shared_ptr<const std::vector<double>>* flopResults)
+{
+    if (!flopResults && results.categoryCounts.empty() && !mDeadCards && !mBoardCards && preflopId.high == 0
+            && lookupPrecalculatedResults(preflopId.low, results))
         return true;
 
     std::lock_guard<std::mutex> lock(mMutex);
+    if (flopResults) {
+        auto it = mFlopLookup.find(preflopId);
+        if (it == mFlopLookup.end())
+            return false;
+        *flopResults = it->second;
+    }
     auto it = mLookup.find(preflopId);
-    if (it != mLookup.end())
-        results = it->second;
-    return it != mLookup.end();
+    if (it == mLookup.end())
+        return false;
+    for (auto& e : it->second.winsByPlayerMask)
+        results.winsByPlayerMask[e.first] += e.second;
+    for (size_t i = 0; i < it->second.categoryCounts.size(); ++i)
+        results.categoryCounts[i] += it->second.categoryCounts[i];
+    return true;
 }
 
 // Lookup precalculated results.
@@ -550,79 +1541,146 @@ bool EquityCalculator::lookupPrecalculatedResults(uint64_t preflopId, BatchResul
     return true;
 }
 
-// Store results for one preflop in the lookup table.
-void EquityCalculator::storeResults(uint64_t preflopId, const BatchResults& results)
+// Store results for one preflop in the lookup table. Flop results are only stored while they fit in the memory limit,
+// after which those preflops get enumerated again.
+void EquityCalculator::storeResults(const PreflopId& preflopId, const BatchResults& results,
+                                    const std::vector<double>* flopResults)
 {
+    LookupEntry entry;
+    for (unsigned mask = 1; mask < (1u << results.nplayers); ++mask) {
+        if (results.winsByPlayerMask[mask])
+            entry.winsByPlayerMask.emplace_back(mask, results.winsByPlayerMask[mask]);
+    }
+    entry.categoryCounts = results.categoryCounts;
+
     std::lock_guard<std::mutex> lock(mMutex); //TODO read-write lock
-    mLookup.emplace(preflopId, results);
+    mLookup.emplace(preflopId, std::move(entry));
+    if (flopResults && mFlopLookupSize + flopResults->size() <= MAX_FLOP_LOOKUP_SIZE
+            && mFlopLookup.emplace(preflopId, std::make_shared<const std::vector<double>>(*flopResults)).second)
+        mFlopLookupSize += flopResults->size();
     // Make sure the hash map doesn't eat all memory. Not a great way of doing it but the lookup
     // table is quite useless with that many preflop combos anyway.
-    if (mLookup.size() >= MAX_LOOKUP_SIZE)
+    if (mLookup.size() >= MAX_LOOKUP_SIZE) {
         mLookup.clear();
+        mFlopLookup.clear();
+        mFlopLookupSize = 0;
+    }
 }
 
-// Transforms suits in such way that suit isomorphism can be easily detected. Goes through all the holecards, board
-// cards and dead cards. First encountered suit is mapped to "virtual" suit 0, second suit maps to 1 and so on.
-unsigned EquityCalculator::transformSuits(HandWithPlayerIdx* playerHands, unsigned nplayers,
-                                          uint64_t* boardCards, uint64_t* deadCards)
+// Sorts the hands by ranks and then by suits with a sorting network. Each hand is packed to a sort key that has
+// the ranks and suits in the order of comparison and the player index in the lowest bits.
+void EquityCalculator::sortHands(HandWithPlayerIdx* playerHands, unsigned nplayers)
 {
-    unsigned transform[SUIT_COUNT] = {~0u, ~0u, ~0u, ~0u};
-    unsigned suitCount = 0;
-
-    //TODO transform fixed cards before main enumeration loop.
-
-    uint64_t newBoardCards = 0;
-    for (unsigned i = 0; i < CARD_COUNT; ++i) {
-        if ((*boardCards >> i) & 1) {
-            unsigned suit = i & SUIT_MASK;
-            if (transform[suit] == ~0u)
-                transform[suit] = suitCount++;
-            unsigned newCard = (i & RANK_MASK) | transform[suit];
-            newBoardCards |= 1ull << newCard;
-        }
+    unsigned keys[MAX_PLAYERS];
+    for (unsigned i = 0; i < nplayers; ++i) {
+        unsigned c0 = playerHands[i].cards[0], c1 = playerHands[i].cards[1];
+        keys[i] = (c0 >> 2) << 12 | (c1 >> 2) << 8 | (c0 & 3) << 6 | (c1 & 3) << 4 | playerHands[i].playerIdx;
+    }
+    for (unsigned i = SORTING_NETWORK_OFFSETS[nplayers]; i < SORTING_NETWORK_OFFSETS[nplayers + 1]; ++i) {
+        unsigned& a = keys[SORTING_NETWORKS[i][0]];
+        unsigned& b = keys[SORTING_NETWORKS[i][1]];
+        unsigned lo = std::min(a, b), hi = std::max(a, b);
+        a = lo;
+        b = hi;
     }
-    *boardCards = newBoardCards;
+    for (unsigned i = 0; i < nplayers; ++i) {
+        unsigned key = keys[i];
+        playerHands[i].cards[0] = (uint8_t)(((key >> 10) & 0x3c) | ((key >> 6) & 3));
+        playerHands[i].cards[1] = (uint8_t)(((key >> 6) & 0x3c) | ((key >> 4) & 3));
+        playerHands[i].playerIdx = key & 15;
+    }
+}
 
-    uint64_t newDeadCards = 0;
-    for (unsigned i = 0; i < CARD_COUNT; ++i) {
-        if ((*deadCards >> i) & 1) {
-            unsigned suit = i & SUIT_MASK;
-            if (transform[suit] == ~0u)
-                transform[suit] = suitCount++;
-            unsigned newCard = (i & RANK_MASK) | transform[suit];
-            newDeadCards |= 1ull << newCard;
+// Transforms suits in such way that suit isomorphism can be easily detected. This goes through the board cards and
+// dead cards, and transformHoleCards() continues with the holecards. First encountered suit is mapped to "virtual"
+// suit 0, second suit maps to 1 and so on. Returns the state of the transformation (see SuitTransformState).
+unsigned EquityCalculator::transformSuits(uint64_t* boardCards, uint64_t* deadCards)
+{
+    unsigned state = 0;
+    for (uint64_t* cards : {boardCards, deadCards}) {
+        uint64_t newCards = 0;
+        for (unsigned i = 0; i < CARD_COUNT; ++i) {
+            if ((*cards >> i) & 1) {
+                unsigned suit = i & SUIT_MASK;
+                newCards |= 1ull << ((i & RANK_MASK) | SUIT_TRANSFORM_STATES[state].suits[suit]);
+                state = SUIT_TRANSFORM_STATES[state].next[suit];
+            }
         }
+        *cards = newCards;
     }
-    *deadCards = newDeadCards;
+    return state;
+}
 
-    // Holecards need to be handled after any fixed cards, because the lookup is only based on them.
+// Transforms the suits of the holecards, starting from the state returned by transformSuits(). Holecards need to be
+// handled after any fixed cards, because the lookup is only based on them. Optionally returns the full suit mapping,
+// where the unused suits are mapped to the remaining virtual suits.
+void EquityCalculator::transformHoleCards(HandWithPlayerIdx* playerHands, unsigned nplayers, unsigned state,
+                                          unsigned* suitTransform)
+{
     for (unsigned i = 0; i < nplayers; ++i) {
         for (uint8_t& c : playerHands[i].cards) {
             unsigned suit = c & SUIT_MASK;
-            if (transform[suit] == ~0u)
-                transform[suit] = suitCount++;
-            c = (c & RANK_MASK) | transform[suit];
+            c = (c & RANK_MASK) | SUIT_TRANSFORM_STATES[state].suits[suit];
+            state = SUIT_TRANSFORM_STATES[state].next[suit];
         }
     }
 
-    return suitCount;
+    if (suitTransform) {
+        for (unsigned i = 0; i < SUIT_COUNT; ++i)
+            suitTransform[i] = SUIT_TRANSFORM_STATES[state].full[i];
+    }
 }
 
-// Calculates a unique 64-bit id for each combination of starting hands.
-uint64_t EquityCalculator::calculateUniquePreflopId(const HandWithPlayerIdx* playerHands, unsigned nplayers)
+// Calculates a unique 128-bit id for each combination of starting hands.
+EquityCalculator::PreflopId EquityCalculator::calculateUniquePreflopId(const HandWithPlayerIdx* playerHands,
+                                                                     unsigned nplayers)
 {
-    uint64_t preflopId = 0;
-    // Basically we just map the preflop to a number in base 1327, where each digit represents a hand.
+    PreflopId preflopId = {0, 0};
+    // Basically we just map the preflop to a number in base 1327, where each digit represents a hand. 1327^6 still
+    // fits in 64 bits.
     for (unsigned i = 0; i < nplayers; ++i) {
-        preflopId *= (CARD_COUNT * (CARD_COUNT - 1) >> 1) + 1; //1327
+        uint64_t& part = i < 6 ? preflopId.low : preflopId.high;
+        part *= (CARD_COUNT * (CARD_COUNT - 1) >> 1) + 1; //1327
         auto h = playerHands[i].cards;
         if (h[0] < h[1])
             std::swap(h[0], h[1]);
-        preflopId += (h[0] * (h[0] - 1) >> 1) + h[1] + 1; // map a hand to range [0, 1326]
+        part += (h[0] * (h[0] - 1) >> 1) + h[1] + 1; // map a hand to range [0, 1326]
     }
     return preflopId;
 }
 
+// Maps a two card combo to range [0, 1325].
+unsigned EquityCalculator::getComboIndex(std::array<uint8_t,2> holeCards)
+{
+    if (holeCards[0] < holeCards[1])
+        std::swap(holeCards[0], holeCards[1]);
+    return (holeCards[0] * (holeCards[0] - 1) >> 1) + holeCards[1];
+}
+
+// Maps a bitmask of three cards to range [0, 22099] using the combinatorial number system.
+unsigned EquityCalculator::getFlopIndex(uint64_t flopCards)
+{
+    omp_assert(bitCount(flopCards) == 3);
+    unsigned c[3], n = 0;
+    for (unsigned i = 0; i < CARD_COUNT; ++i) {
+        if (flopCards & (1ull << i))
+            c[n++] = i;
+    }
+    return getFlopIndex(c[0], c[1], c[2]);
+}
+
+// Same for three distinct cards in any order.
+unsigned EquityCalculator::getFlopIndex(unsigned c0, unsigned c1, unsigned c2)
+{
+    if (c0 > c1)
+        std::swap(c0, c1);
+    if (c1 > c2)
+        std::swap(c1, c2);
+    if (c0 > c1)
+        std::swap(c0, c1);
+    return c0 + (c1 * (c1 - 1) >> 1) + c2 * (c2 - 1) * (c2 - 2) / 6;
+}
+
 Hand EquityCalculator::getBoardFromBitmask(uint64_t cards)
 {
     Hand board = Hand::empty();
@@ -633,6 +1691,254 @@ Hand EquityCalculator::getBoardFromBitmask(uint64_t cards)
     return board;
 }
 
+void EquityCalculator::DetailStats::init(unsigned nplayers, bool distributions, bool runouts)
+{
+    unsigned n = distributions ? nplayers : 0;
+    comboEquity.assign(n * COMBO_COUNT, 0);
+    comboHands.assign(n * COMBO_COUNT, 0);
+    flopEquity.assign(n * FLOP_COUNT, 0);
+    flopHands.assign(distributions ? FLOP_COUNT : 0, 0);
+    preflopFlops.assign(distributions ? FLOP_COUNT * (nplayers + 1) : 0, 0);
+    runoutWins.assign(runouts ? CARD_COUNT << nplayers : 0, 0);
+    dealt.size = 0;
+}
+
+// Starts the stack from the fixed board cards, which are part of every flop.
+void EquityCalculator::DealtFlops::init(uint64_t fixedCards)
+{
+    PartialFlop flop = {};
+    flop.weight = 1;
+    for (unsigned c = 0; c < CARD_COUNT; ++c) {
+        if (fixedCards & (1ull << c))
+            flop.cards[flop.count++] = c;
+    }
+    omp_assert(flop.count < 3);
+    for (auto& v : partialFlops)
+        v.clear();
+    flops.clear();
+    partialFlops[flop.count].push_back(flop);
+    size = 0;
+    for (unsigned i = 0; i < 3; ++i)
+        levels[0].partialFlopCounts[i] = partialFlops[i].size();
+    levels[0].flopCount = 0;
+    std::fill(std::begin(levels[0].totals), std::end(levels[0].totals), 0.0);
+}
+
+// Adds a group of interchangeable cards of which some were dealt.
+void EquityCalculator::DealtFlops::push(const unsigned* group, unsigned groupSize, unsigned dealtCount)
+{
+    omp_assert(size < BOARD_CARDS);
+    // Extend the existing partial flops with cards from the group. Bigger flops go first so that the new ones
+    // don't get extended again.
+    for (unsigned count = 3; count-- > 0;) {
+        for (size_t i = 0, n = partialFlops[count].size(); i < n; ++i)
+            addGroupCards(partialFlops[count][i], group, groupSize, dealtCount, 0, 0);
+    }
+    Level& level = levels[++size];
+    for (unsigned i = 0; i < 3; ++i)
+        level.partialFlopCounts[i] = partialFlops[i].size();
+    level.flopCount = flops.size();
+    std::fill(std::begin(level.totals), std::end(level.totals), 0.0);
+}
+
+// Extends a partial flop with one or more cards from the group, starting from given position.
+void EquityCalculator::DealtFlops::addGroupCards(const PartialFlop& flop, const unsigned* group, unsigned groupSize,
+                                                 unsigned dealtCount, unsigned start, unsigned taken)
+{
+    for (unsigned i = start; i < groupSize; ++i) {
+        PartialFlop newFlop = flop;
+        newFlop.cards[newFlop.count++] = group[i];
+        newFlop.weight *= (double)(dealtCount - taken) / (groupSize - taken);
+        if (newFlop.count == 3) {
+            flops.emplace_back(getFlopIndex(newFlop.cards[0], newFlop.cards[1], newFlop.cards[2]), newFlop.weight);
+        } else {
+            partialFlops[newFlop.count].push_back(newFlop);
+            if (taken + 1 < dealtCount)
+                addGroupCards(newFlop, group, groupSize, dealtCount, i + 1, taken + 1);
+        }
+    }
+}
+
+// Records a single monte carlo showdown for the equity distributions. Flop is left out if flopCards is 0.
+void EquityCalculator::recordShowdownDistributions(unsigned winnersMask, const unsigned* comboIndexes,
+                                                   uint64_t flopCards, DetailStats* detail) const
+{
+    double share = 1.0 / bitCount(winnersMask);
+    for (unsigned i = 0; i < mCombinedRangeCount; ++i) {
+        const CombinedRange& combinedRange = mCombinedRanges[i];
+        const CombinedRange::Combo& combo = combinedRange.combos()[comboIndexes[i]];
+        for (unsigned j = 0; j < combinedRange.playerCount(); ++j) {
+            unsigned playerIdx = combinedRange.players()[j];
+            unsigned idx = playerIdx * COMBO_COUNT + getComboIndex(combo.holeCards[j]);
+            detail->comboHands[idx] += 1;
+            if (winnersMask & (1 << playerIdx))
+                detail->comboEquity[idx] += share;
+        }
+    }
+
+    if (flopCards) {
+        unsigned flopIdx = getFlopIndex(flopCards);
+        detail->flopHands[flopIdx] += 1;
+        for (unsigned i = 0; i < mResults.players; ++i) {
+            if (winnersMask & (1 << i))
+                detail->flopEquity[i * FLOP_COUNT + flopIdx] += share;
+        }
+    }
+}
+
+// Records the results of a single enumerated preflop for the combo distributions. Holecards are indexed by the
+// original player index.
+void EquityCalculator::recordComboDistributions(const BatchResults& stats, const std::array<uint8_t,2>* holeCards,
+                                                DetailStats* detail) const
+{
+    unsigned nplayers = mResults.players;
+    double hands = 0, equity[MAX_PLAYERS] = {};
+    for (unsigned mask = 1; mask < (1u << nplayers); ++mask) {
+        unsigned count = stats.winsByPlayerMask[mask];
+        if (count == 0)
+            continue;
+        hands += count;
+        double share = (double)count / bitCount(mask);
+        for (unsigned j = 0; j < nplayers; ++j) {
+            if (mask & (1 << j))
+                equity[stats.playerIds[j]] += share;
+        }
+    }
+
+    if (hands == 0)
+        return;
+    for (unsigned i = 0; i < nplayers; ++i) {
+        unsigned idx = i * COMBO_COUNT + getComboIndex(holeCards[i]);
+        detail->comboHands[idx] += hands;
+        detail->comboEquity[idx] += equity[i];
+    }
+}
+
+// Records the flop results of a single enumerated preflop for the flop distributions. Results are in transformed suits
+// and the players in enumeration order, so they're mapped back to the original suits and players. Free suits are
+// interchangeable, so it doesn't matter how they get mapped.
+void EquityCalculator::recordPreflopFlops(const std::vector<double>& flopResults, const unsigned* suitTransform,
+                                          const uint8_t* playerIds, DetailStats* detail) const
+{
+    unsigned nplayers = mResults.players;
+    unsigned originalSuits[SUIT_COUNT];
+    for (unsigned i = 0; i < SUIT_COUNT; ++i)
+        originalSuits[suitTransform[i]] = i;
+    auto originalCard = [&](unsigned c) { return (c & RANK_MASK) | originalSuits[c & SUIT_MASK]; };
+
+    // Flop indexes follow this iteration order.
+    const double* results = flopResults.data();
+    for (unsigned c2 = 2; c2 < CARD_COUNT; ++c2) {
+        for (unsigned c1 = 1; c1 < c2; ++c1) {
+            for (unsigned c0 = 0; c0 < c1; ++c0, results += nplayers + 1) {
+                if (results[0] == 0)
+                    continue;
+                unsigned flopIdx = getFlopIndex(originalCard(c0), originalCard(c1), originalCard(c2));
+                detail->flopHands[flopIdx] += results[0];
+                for (unsigned i = 0; i < nplayers; ++i)
+                    detail->flopEquity[playerIds[i] * FLOP_COUNT + flopIdx] += results[1 + i];
+            }
+        }
+    }
+}
+
+// Adds a thread's detailed statistics to the shared ones.
+void EquityCalculator::mergeDetailStats(const DetailStats& detail)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto add = [](std::vector<double>& dst, const std::vector<double>& src) {
+        for (size_t i = 0; i < src.size(); ++i)
+            dst[i] += src[i];
+    };
+    add(mDetailStats.comboEquity, detail.comboEquity);
+    add(mDetailStats.comboHands, detail.comboHands);
+    add(mDetailStats.flopEquity, detail.flopEquity);
+    add(mDetailStats.flopHands, detail.flopHands);
+    for (size_t i = 0; i < detail.runoutWins.size(); ++i)
+        mDetailStats.runoutWins[i] += detail.runoutWins[i];
+}
+
+// Results restricted to the boards that include given card.
+EquityCalculator::Results EquityCalculator::getRunoutResults(unsigned card)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return calculateRunoutResults(card);
+}
+
+// Results for one card from the merged runout statistics.
+EquityCalculator::Results EquityCalculator::calculateRunoutResults(unsigned card) const
+{
+    Results results;
+    results.players = mResults.players;
+    results.enumerateAll = mResults.enumerateAll;
+    results.finished = mResults.finished;
+    results.winsByPlayerMask.assign(1u << mResults.players, 0);
+    if (card < CARD_COUNT && !mDetailStats.runoutWins.empty()) {
+        for (unsigned mask = 0; mask < (1u << mResults.players); ++mask)
+            results.winsByPlayerMask[mask] = mDetailStats.runoutWins[(card << mResults.players) | mask];
+    }
+    calculateEquities(results);
+    return results;
+}
+
+// Fills in hand count, wins, ties and equities from winsByPlayerMask.
+void EquityCalculator::calculateEquities(Results& results)
+{
+    results.hands = 0;
+    for (unsigned i = 0; i < results.players; ++i)
+        results.wins[i] = 0, results.ties[i] = 0;
+    for (unsigned mask = 1; mask < (1u << results.players); ++mask) {
+        uint64_t count = results.winsByPlayerMask[mask];
+        results.hands += count;
+        unsigned winnerCount = bitCount(mask);
+        for (unsigned i = 0; i < results.players; ++i) {
+            if (!(mask & (1 << i)))
+                continue;
+            if (winnerCount == 1)
+                results.wins[i] += count;
+            else
+                results.ties[i] += count / (double)winnerCount;
+        }
+    }
+    for (unsigned i = 0; i < results.players; ++i)
+        results.equity[i] = (results.wins[i] + results.ties[i]) / (results.hands + 1e-9);
+}
+
+// Builds the equity histograms from the merged detailed statistics. Monte carlo leaves out the combos and flops with
+// too few samples.
+void EquityCalculator::calculateHistograms()
+{
+    double minSamples = mResults.enumerateAll ? 0 : MIN_HISTOGRAM_SAMPLES;
+    auto fillHistogram = [this, minSamples](std::vector<double>& histogram, const double* equity,
+                                            const double* hands, size_t count) {
+        histogram.assign(mHistogramBins, 0);
+        double totalHands = 0, unreliableHands = 0;
+        for (size_t i = 0; i < count; ++i) {
+            double h = hands[i];
+            totalHands += h;
+            if (h < minSamples || h == 0) {
+                unreliableHands += h;
+                continue;
+            }
+            unsigned bin = std::min((unsigned)(equity[i] / h * mHistogramBins), mHistogramBins - 1);
+            histogram[bin] += h;
+        }
+        for (double& x : histogram)
+            x /= totalHands + 1e-9;
+        return unreliableHands / (totalHands + 1e-9);
+    };
+
+    bool hasFlops = bitCount(mBoardCards) < 3;
+    for (unsigned i = 0; i < mResults.players; ++i) {
+        mResults.comboHistogramUnreliable[i] = fillHistogram(mResults.comboEquityHistogram[i],
+                &mDetailStats.comboEquity[i * COMBO_COUNT], &mDetailStats.comboHands[i * COMBO_COUNT], COMBO_COUNT);
+        if (hasFlops) {
+            mResults.flopHistogramUnreliable = fillHistogram(mResults.flopEquityHistogram[i],
+                    &mDetailStats.flopEquity[i * FLOP_COUNT], &mDetailStats.flopHands[0], FLOP_COUNT);
+        }
+    }
+}
+
 // Removes combos that conflict with board and dead cards.
 std::vector<std::vector<std::array<uint8_t,2>>> EquityCalculator::removeInvalidCombos(
         const std::vector<CardRange>& handRanges, uint64_t reservedCards)
@@ -650,16 +1956,330 @@ std::vector<std::vector<std::array<uint8_t,2>>> EquityCalculator::removeInvalidC
 }
 
 // Work allocation for enumeration threads.
-std::pair<uint64_t,uint64_t> EquityCalculator::reserveBatch(uint64_t batchCount)
+std::pair<uint64_t,uint64_t> EquityCalculator::reserveBatch(unsigned queueIdx, uint64_t batchCount)
+{
+    OMP_PROFILE_COUNT(reservations, 1);
+    WorkQueue& queue = *mWorkQueues[queueIdx];
+    std::pair<uint64_t,uint64_t> batch;
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        batch = takeBatch(queue, batchCount);
+        if (mCheckpointing)
+            queue.inFlight = batch;
+    }
+
+    // Out of work, so steal the back half of the queue that has the most work left. Both queues are locked at the
+    // same time (in index order), so that checkpoints see the moved ranges in one of them.
+    while (batch.first == batch.second) {
+        unsigned victimIdx = queueIdx;
+        uint64_t mostRemaining = 0;
+        for (unsigned i = 0; i < mWorkQueues.size(); ++i) {
+            uint64_t remaining = mWorkQueues[i]->remaining;
+            if (remaining > mostRemaining)
+                mostRemaining = remaining, victimIdx = i;
+        }
+        if (mostRemaining == 0)
+            break;
+
+        Tracer::Scope scope(mTracer, "steal");
+        WorkQueue& victim = *mWorkQueues[victimIdx];
+        std::lock_guard<std::mutex> lock1(mWorkQueues[std::min(queueIdx, victimIdx)]->mutex);
+        std::lock_guard<std::mutex> lock2(mWorkQueues[std::max(queueIdx, victimIdx)]->mutex);
+        uint64_t stealCount = (victim.remaining + 1) / 2;
+        OMP_PROFILE_COUNT(steals, stealCount > 0);
+        while (stealCount > 0) {
+            auto& range = victim.ranges.back();
+            uint64_t n = std::min(stealCount, range.second - range.first);
+            queue.ranges.emplace_front(range.second - n, range.second);
+            range.second -= n;
+            if (range.first == range.second)
+                victim.ranges.pop_back();
+            victim.remaining -= n;
+            queue.remaining += n;
+            stealCount -= n;
+        }
+        batch = takeBatch(queue, batchCount);
+        if (mCheckpointing)
+            queue.inFlight = batch;
+    }
+
+    mEnumReserved += batch.second - batch.first;
+    return batch;
+}
+
+// Must hold the lock of the queue.
+std::pair<uint64_t,uint64_t> EquityCalculator::takeBatch(WorkQueue& queue, uint64_t batchCount)
+{
+    if (queue.ranges.empty())
+        return {0, 0};
+    auto& range = queue.ranges.front();
+    std::pair<uint64_t,uint64_t> batch{range.first, range.first + std::min(batchCount, range.second - range.first)};
+    range.first = batch.second;
+    if (range.first == range.second)
+        queue.ranges.pop_front();
+    queue.remaining -= batch.second - batch.first;
+    return batch;
+}
+
+// Splits the ranges into contiguous pieces of equal size, one for each thread.
+void EquityCalculator::distributeWork(const std::vector<std::pair<uint64_t,uint64_t>>& ranges, unsigned threadCount)
+{
+    uint64_t total = 0;
+    for (auto& range : ranges)
+        total += range.second - range.first;
+    mWorkQueues.clear();
+    auto range = ranges.begin();
+    uint64_t position = range != ranges.end() ? range->first : 0;
+    for (unsigned i = 0; i < threadCount; ++i) {
+        mWorkQueues.emplace_back(new WorkQueue());
+        WorkQueue& queue = *mWorkQueues.back();
+        uint64_t share = total / threadCount + (i < total % threadCount);
+        queue.remaining = share;
+        while (share > 0) {
+            uint64_t n = std::min(share, range->second - position);
+            if (n > 0)
+                queue.ranges.emplace_back(position, position + n);
+            position += n;
+            share -= n;
+            if (position == range->second && ++range != ranges.end())
+                position = range->first;
+        }
+    }
+}
+
+// Moves the results of the completed batch to the checkpoint state.
+void EquityCalculator::commitBatch(unsigned queueIdx, const Results& batchResults)
 {
     std::lock_guard<std::mutex> lock(mMutex);
+    WorkQueue& queue = *mWorkQueues[queueIdx];
+    std::lock_guard<std::mutex> queueLock(queue.mutex);
+    queue.inFlight = {0, 0};
+    addCounts(mCheckpointResults, batchResults);
+}
+
+void EquityCalculator::initResults(Results& results, unsigned players, bool enumerateAll) const
+{
+    results = Results();
+    results.players = players;
+    results.enumerateAll = enumerateAll;
+    results.winsByPlayerMask.assign(1u << players, 0);
+    if (mHandCategories) {
+        for (unsigned i = 0; i < players; ++i)
+            results.handCategories[i].assign(HAND_CATEGORY_COUNT, 0);
+        results.winningHandCategories.assign(HAND_CATEGORY_COUNT, 0);
+    }
+}
+
+// Adds the counts of other results, including the hands that haven't been moved from the interval count yet.
+void EquityCalculator::addCounts(Results& results, const Results& other)
+{
+    auto add = [](std::vector<uint64_t>& v, const std::vector<uint64_t>& w){
+        for (size_t i = 0; i < std::min(v.size(), w.size()); ++i)
+            v[i] += w[i];
+    };
+    results.hands += other.hands + other.intervalHands;
+    for (unsigned i = 0; i < results.players; ++i) {
+        results.wins[i] += other.wins[i];
+        results.ties[i] += other.ties[i];
+        add(results.handCategories[i], other.handCategories[i]);
+    }
+    add(results.winsByPlayerMask, other.winsByPlayerMask);
+    add(results.winningHandCategories, other.winningHandCategories);
+    results.evaluations += other.evaluations;
+    results.skippedPreflopCombos += other.skippedPreflopCombos;
+    results.evaluatedPreflopCombos += other.evaluatedPreflopCombos;
+    results.lookupHits += other.lookupHits;
+}
+
+void EquityCalculator::Results::merge(const Results& other)
+{
+    if (players == 0) {
+        *this = other;
+        return;
+    }
+    bool exact = enumerateAll && other.enumerateAll;
+    addCounts(*this, other);
+    intervalHands = 0;
+    time += other.time;
+    setupTime += other.setupTime;
+    lockWaitTime += other.lockWaitTime;
+    speed = hands / (time + 1e-9);
+    finished = finished && other.finished;
+    interrupted = interrupted || other.interrupted;
+    if (exact) {
+        calculateEquities(*this);
+    } else {
+        for (unsigned i = 0; i < players; ++i)
+            equity[i] = (wins[i] + ties[i]) / (hands + 1e-9);
+        // Variances of independent samples are inversely additive.
+        if (stdev > 0 && other.stdev > 0)
+            stdev = 1 / std::sqrt(1 / (stdev * stdev) + 1 / (other.stdev * other.stdev));
+        stdevPerHand = stdev * std::sqrt(hands);
+    }
+    for (unsigned i = 0; i < MAX_PLAYERS; ++i) {
+        comboEquityHistogram[i].clear();
+        flopEquityHistogram[i].clear();
+        runoutEquity[i].clear();
+    }
+    runoutHands.clear();
+}
+
+static const char CHECKPOINT_MAGIC[8] = {'O', 'M', 'P', 'C', 'K', 'P', 'T', '1'};
 
-    uint64_t totalBatchCount = getPreflopCombinationCount();
-    uint64_t start = mEnumPosition;
-    uint64_t end = std::min<uint64_t>(totalBatchCount, mEnumPosition + batchCount);
-    mEnumPosition = end;
+// Must hold mMutex. Written to a temporary file first, so that a crash during the write leaves the old checkpoint.
+void EquityCalculator::writeCheckpoint()
+{
+    std::string tmpFile = mCheckpointFile + ".tmp";
+    std::ofstream os(tmpFile, std::ios::binary);
+    auto put = [&](uint64_t x){ os.write((const char*)&x, sizeof(x)); };
+    auto putCounts = [&](const std::vector<uint64_t>& v){
+        put(v.size());
+        os.write((const char*)v.data(), v.size() * sizeof(uint64_t));
+    };
+
+    os.write(CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+    put(mOriginalHandRanges.size());
+    for (auto& range : mOriginalHandRanges) {
+        put(range.combinations().size());
+        os.write((const char*)range.combinations().data(), range.combinations().size() * 2);
+    }
+    put(mBoardCards);
+    put(mDeadCards);
+    put(getPreflopCombinationCount());
+    put(mEnumSlice.first);
+    put(mEnumSlice.second);
+
+    // Work can move between the queues, so all of them are locked while collecting the remaining ranges.
+    std::vector<std::pair<uint64_t,uint64_t>> remaining;
+    std::vector<std::unique_lock<std::mutex>> queueLocks;
+    for (auto& queue : mWorkQueues) {
+        queueLocks.emplace_back(queue->mutex);
+        remaining.insert(remaining.end(), queue->ranges.begin(), queue->ranges.end());
+        if (queue->inFlight.first != queue->inFlight.second)
+            remaining.push_back(queue->inFlight);
+    }
+    queueLocks.clear();
+    std::sort(remaining.begin(), remaining.end());
+    // Stealing splits the ranges, so join the adjacent ones.
+    size_t joined = 0;
+    for (size_t i = 0; i < remaining.size(); ++i) {
+        if (joined > 0 && remaining[joined - 1].second == remaining[i].first)
+            remaining[joined - 1].second = remaining[i].second;
+        else
+            remaining[joined++] = remaining[i];
+    }
+    remaining.resize(joined);
+    put(remaining.size());
+    for (auto& range : remaining)
+        put(range.first), put(range.second);
+
+    // Wins and ties are calculated from the winner masks when reading.
+    const Results& r = mCheckpointResults;
+    putCounts(r.winsByPlayerMask);
+    for (unsigned i = 0; i < r.players; ++i)
+        putCounts(r.handCategories[i]);
+    putCounts(r.winningHandCategories);
+    put(r.evaluations);
+    put(r.skippedPreflopCombos);
+    put(r.evaluatedPreflopCombos);
+    put(r.lookupHits);
+
+    put(mLookup.size());
+    for (auto& e : mLookup) {
+        put(e.first.low);
+        put(e.first.high);
+        put(e.second.winsByPlayerMask.size());
+        for (auto& p : e.second.winsByPlayerMask)
+            put(p.first), put(p.second);
+        putCounts(e.second.categoryCounts);
+    }
+
+    os.close();
+    if (os)
+        std::rename(tmpFile.c_str(), mCheckpointFile.c_str());
+}
+
+bool EquityCalculator::readCheckpoint(const std::string& file, Checkpoint& checkpoint)
+{
+    std::ifstream is(file, std::ios::binary);
+    auto get = [&](uint64_t& x){ return (bool)is.read((char*)&x, sizeof(x)); };
+    auto getCounts = [&](std::vector<uint64_t>& v, uint64_t maxSize){
+        uint64_t size;
+        if (!get(size) || size > maxSize)
+            return false;
+        v.resize((size_t)size);
+        return (bool)is.read((char*)v.data(), size * sizeof(uint64_t));
+    };
+
+    char magic[sizeof(CHECKPOINT_MAGIC)];
+    uint64_t players;
+    if (!is.read(magic, sizeof(magic)) || !std::equal(magic, magic + sizeof(magic), CHECKPOINT_MAGIC)
+            || !get(players) || players == 0 || players > MAX_PLAYERS)
+        return false;
+    for (unsigned i = 0; i < players; ++i) {
+        uint64_t size;
+        if (!get(size) || size > COMBO_COUNT)
+            return false;
+        std::vector<std::array<uint8_t,2>> combos((size_t)size);
+        if (!is.read((char*)combos.data(), size * 2))
+            return false;
+        // Cards are used as shift counts, so a corrupt file must not get any further.
+        for (auto& combo : combos) {
+            if (combo[0] >= CARD_COUNT || combo[1] >= CARD_COUNT || combo[0] == combo[1])
+                return false;
+        }
+        checkpoint.handRanges.emplace_back(combos);
+    }
+
+    uint64_t rangeCount;
+    if (!get(checkpoint.boardCards) || !get(checkpoint.deadCards) || !get(checkpoint.preflopCombos)
+            || !get(checkpoint.sliceBegin) || !get(checkpoint.sliceEnd) || !get(rangeCount)
+            || checkpoint.sliceBegin > checkpoint.sliceEnd || checkpoint.sliceEnd > checkpoint.preflopCombos
+            || rangeCount > (1 << 20) || (checkpoint.boardCards | checkpoint.deadCards) >> CARD_COUNT)
+        return false;
+    // Ranges are sorted and must not overlap.
+    checkpoint.remaining.resize((size_t)rangeCount);
+    uint64_t prevEnd = checkpoint.sliceBegin;
+    for (auto& range : checkpoint.remaining) {
+        if (!get(range.first) || !get(range.second) || range.first < prevEnd || range.first > range.second
+                || range.second > checkpoint.sliceEnd)
+            return false;
+        prevEnd = range.second;
+    }
+
+    Results& r = checkpoint.results;
+    r.players = (unsigned)players;
+    r.enumerateAll = true;
+    if (!getCounts(r.winsByPlayerMask, 1ull << MAX_PLAYERS) || r.winsByPlayerMask.size() != 1u << players)
+        return false;
+    for (unsigned i = 0; i < players; ++i) {
+        if (!getCounts(r.handCategories[i], HAND_CATEGORY_COUNT))
+            return false;
+    }
+    if (!getCounts(r.winningHandCategories, HAND_CATEGORY_COUNT) || !get(r.evaluations)
+            || !get(r.skippedPreflopCombos) || !get(r.evaluatedPreflopCombos) || !get(r.lookupHits))
+        return false;
+    calculateEquities(r);
 
-    return {start, end};
+    uint64_t lookupSize;
+    if (!get(lookupSize) || lookupSize > MAX_LOOKUP_SIZE)
+        return false;
+    checkpoint.lookup.resize((size_t)lookupSize);
+    for (auto& e : checkpoint.lookup) {
+        uint64_t winnerMasks;
+        if (!get(e.first.low) || !get(e.first.high) || !get(winnerMasks) || winnerMasks > (1u << players))
+            return false;
+        e.second.winsByPlayerMask.resize((size_t)winnerMasks);
+        for (auto& p : e.second.winsByPlayerMask) {
+            uint64_t mask, count;
+            if (!get(mask) || !get(count))
+                return false;
+            p = {(unsigned)mask, (unsigned)count};
+        }
+        if (!getCounts(e.second.categoryCounts, (MAX_PLAYERS + 1) * HAND_CATEGORY_COUNT))
+            return false;
+    }
+    return true;
 }
 
 // Number of different preflops with given hand ranges, assuming no conflicts between players' hands.
@@ -688,14 +2308,49 @@ uint64_t EquityCalculator::getPostflopCombinationCount()
     return postflopCombos;
 }
 
+// Adds the counters of one thread to the shared profile.
+void EquityCalculator::mergeProfile(const Profile& profile)
+{
+    mProfile.holeCardAttempts += profile.holeCardAttempts;
+    mProfile.holeCardRejections += profile.holeCardRejections;
+    mProfile.boardRejections += profile.boardRejections;
+    mProfile.randomWalkSkips += profile.randomWalkSkips;
+    for (unsigned i = 0; i <= BOARD_CARDS; ++i)
+        mProfile.boardNodes[i] += profile.boardNodes[i];
+    mProfile.foldedSubtrees += profile.foldedSubtrees;
+    mProfile.lookupHits += profile.lookupHits;
+    mProfile.lookupMisses += profile.lookupMisses;
+    mProfile.updates += profile.updates;
+    mProfile.reservations += profile.reservations;
+    mProfile.steals += profile.steals;
+    mProfile.threadTime += profile.threadTime;
+}
+
 // Results aggregation for both enumeration and monte carlo.
-void EquityCalculator::updateResults(const BatchResults& stats, bool threadFinished)
+void EquityCalculator::updateResults(const BatchResults& stats, bool threadFinished, Results* batchResults)
 {
     auto t = std::chrono::high_resolution_clock::now();
+    OMP_PROFILE_COUNT(updates, 1);
+    Tracer::Scope updateScope(mTracer, "update");
 
+    if (mTracer)
+        mTracer->begin("lock wait");
     std::lock_guard<std::mutex> lock(mMutex);
-
-    double batchEquity = combineResults(stats);
+    if (mTracer)
+        mTracer->end("lock wait");
+    bool wasStopped = mStopped;
+    mResults.lockWaitTime += 1e-9 * std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::high_resolution_clock::now() - t).count();
+
+    double batchEquity = combineResults(stats, mResults);
+    if (batchResults)
+        combineResults(stats, *batchResults);
+    #if OMP_PROFILE
+    if (threadFinished) {
+        tProfile.threadTime = 1e-9 * std::chrono::duration_cast<std::chrono::nanoseconds>(t - tThreadStart).count();
+        mergeProfile(tProfile);
+    }
+    #endif
 
     // Store values for stdev calculation
     if (!threadFinished) {
@@ -708,7 +2363,8 @@ void EquityCalculator::updateResults(const BatchResults& stats, bool threadFinis
 
     double dt = 1e-9 * std::chrono::duration_cast<std::chrono::nanoseconds>(t - mLastUpdate).count();
     //std::cout << mResults.hands << " " << mHandLimit << std::endl;
-    if (mResults.time + dt >= mTimeLimit || mResults.hands + mResults.intervalHands >= mHandLimit)
+    if (mResults.time + dt >= mTimeLimit || mResults.hands + mResults.intervalHands >= mHandLimit
+            || (mHasStopTime && std::chrono::steady_clock::now() >= mStopTime))
         mStopped = true;
 
     // Periodic update through callback.
@@ -722,7 +2378,7 @@ void EquityCalculator::updateResults(const BatchResults& stats, bool threadFinis
         mResults.stdev = std::sqrt(1e-9 + mBatchSumSqr - mBatchSum * mBatchSum / mBatchCount) / mBatchCount;
         mResults.stdevPerHand = mResults.stdev * std::sqrt(mResults.hands);
         if (mResults.enumerateAll) {
-            mResults.progress = (double)mEnumPosition / getPreflopCombinationCount();
+            mResults.progress = mEnumTotal > 0 ? (double)mEnumReserved / mEnumTotal : 1;
         } else {
             double estimatedHands = std::pow(mResults.stdev / mStdevTarget, 2) * mResults.hands;
             mResults.progress = mResults.hands / estimatedHands;
@@ -735,49 +2391,103 @@ void EquityCalculator::updateResults(const BatchResults& stats, bool threadFinis
         for (unsigned i = 0; i < mResults.players; ++i)
             mResults.equity[i] = (mResults.wins[i] + mResults.ties[i]) / (mResults.hands + 1e-9);
 
+        // Threads that were stopped may have left preflops in their own queues or batches.
+        if (mResults.finished && mResults.enumerateAll) {
+            mResults.interrupted = mIncomplete;
+            for (auto& queue : mWorkQueues)
+                mResults.interrupted = mResults.interrupted || queue->remaining > 0;
+        } else if (mResults.finished) {
+            mResults.interrupted = !(mResults.stdev < mStdevTarget);
+        }
+        // Board enumerations that were cut short may have recorded some of their showdowns in the detail stats.
+        bool detailValid = !(mResults.enumerateAll && mResults.interrupted);
+
+        // Ties are summed in whatever order the threads happened to update, so recalculate them in a fixed order to
+        // make the final results exactly reproducible (also when resumed from a checkpoint).
+        if (mResults.finished && mResults.enumerateAll)
+            calculateEquities(mResults);
+
+        if (mResults.finished && detailValid && mHistogramBins > 0 && !mDetailStats.comboHands.empty())
+            calculateHistograms();
+
+        if (mResults.finished && detailValid && !mDetailStats.runoutWins.empty()) {
+            mResults.runoutHands.assign(CARD_COUNT, 0);
+            for (unsigned i = 0; i < mResults.players; ++i)
+                mResults.runoutEquity[i].assign(CARD_COUNT, 0);
+            for (unsigned card = 0; card < CARD_COUNT; ++card) {
+                Results runoutResults = calculateRunoutResults(card);
+                mResults.runoutHands[card] = runoutResults.hands;
+                for (unsigned i = 0; i < mResults.players; ++i)
+                    mResults.runoutEquity[i][card] = runoutResults.equity[i];
+            }
+        }
+
         mUpdateResults = mResults;
 
-        if (mCallback)
+        if (mCallback) {
+            Tracer::Scope scope(mTracer, "callback");
             mCallback(mResults);
+        }
 
         mLastUpdate = t;
     }
 
+    if (mCheckpointing && (mResults.finished || 1e-9 * std::chrono::duration_cast<std::chrono::nanoseconds>(
+            t - mLastCheckpoint).count() >= mCheckpointInterval)) {
+        Tracer::Scope scope(mTracer, "checkpoint");
+        writeCheckpoint();
+        mLastCheckpoint = t;
+    }
+
+    if (mTracer && mStopped && !wasStopped)
+        mTracer->instant("stop");
+
     //if (finished)
     //    outputLookupTable();
 }
 
 // Sum batch results in the main results structure.
-double EquityCalculator::combineResults(const BatchResults& batch)
+double EquityCalculator::combineResults(const BatchResults& batch, Results& results)
 {
     uint64_t batchHands = 0;
     double batchEquity = 0;
 
-    for (unsigned i = 0; i < (1u << mResults.players); ++i) {
-        mResults.intervalHands += batch.winsByPlayerMask[i];
+    for (unsigned i = 0; i < (1u << results.players); ++i) {
+        if (batch.winsByPlayerMask[i] == 0)
+            continue;
+        results.intervalHands += batch.winsByPlayerMask[i];
         batchHands += batch.winsByPlayerMask[i];
         unsigned winnerCount = bitCount(i);
         unsigned actualPlayerMask = 0;
-        for (unsigned j = 0; j < mResults.players; ++j) {
+        for (unsigned j = 0; j < results.players; ++j) {
             if (i & (1 << j)) {
                 if (winnerCount == 1) {
-                    mResults.wins[batch.playerIds[j]] += batch.winsByPlayerMask[i];
+                    results.wins[batch.playerIds[j]] += batch.winsByPlayerMask[i];
                     if (batch.playerIds[j] == 0)
                         batchEquity += batch.winsByPlayerMask[i];
                 } else {
-                    mResults.ties[batch.playerIds[j]] += batch.winsByPlayerMask[i] / (double)winnerCount;
+                    results.ties[batch.playerIds[j]] += batch.winsByPlayerMask[i] / (double)winnerCount;
                     if (batch.playerIds[j] == 0)
                         batchEquity += batch.winsByPlayerMask[i] / (double)winnerCount;
                 }
                 actualPlayerMask |= 1 << batch.playerIds[j];
             }
         }
-        mResults.winsByPlayerMask[actualPlayerMask] += batch.winsByPlayerMask[i];
+        results.winsByPlayerMask[actualPlayerMask] += batch.winsByPlayerMask[i];
+    }
+
+    if (!batch.categoryCounts.empty()) {
+        for (unsigned i = 0; i < HAND_CATEGORY_COUNT; ++i) {
+            for (unsigned j = 0; j < results.players; ++j)
+                results.handCategories[batch.playerIds[j]][i] += batch.categoryCounts[j * HAND_CATEGORY_COUNT + i];
+            results.winningHandCategories[i] += batch.categoryCounts[results.players * HAND_CATEGORY_COUNT + i];
+        }
     }
 
-    mResults.evaluations += batch.evalCount;
-    mResults.skippedPreflopCombos += batch.skippedPreflopCombos;
-    mResults.evaluatedPreflopCombos += batch.uniquePreflopCombos;
+    results.evaluations += batch.evalCount;
+    results.skippedPreflopCombos += batch.skippedPreflopCombos;
+    results.evaluatedPreflopCombos += batch.uniquePreflopCombos;
+    results.lookupHits += batch.lookupHits;
 
     return batchEquity / (batchHands + 1e-9);
 }
@@ -787,8 +2497,10 @@ void EquityCalculator::outputLookupTable() const
 {
     std::vector<std::array<unsigned,3>> a;
     for (auto& e: mLookup) {
-        a.push_back({(unsigned)e.first, (unsigned)e.second.winsByPlayerMask[1],
-                     (unsigned)e.second.winsByPlayerMask[3]});
+        unsigned wins[4] = {};
+        for (auto& w : e.second.winsByPlayerMask)
+            wins[w.first & 3] = w.second;
+        a.push_back({(unsigned)e.first.low, wins[1], wins[3]});
     }
     std::sort(a.begin(), a.end(), [](const std::array<unsigned,3>& lhs, const std::array<unsigned,3>& rhs){
         return lhs[0] < rhs[0];
@@ -7,12 +7,17 @@
 #include "HandEvaluator.h"
 #include "Constants.h"
 #include "Util.h"
+#include "Tracer.h"
 #include <chrono>
 #include <thread>
 #include <mutex>
 #include <atomic>
 #include <unordered_map>
+#include <deque>
+#include <memory>
+#include <algorithm>
 #include <array>
+#include <string>
 #include <cstdint>
 
 namespace omp {
@@ -33,15 +38,21 @@ public:
         uint64_t wins[MAX_PLAYERS] = {};
         // Ties by player, adjusted for equity: 2-way splits = 1/2, 3-way = 1/3 etc..
         double ties[MAX_PLAYERS] = {};
-        // Wins for each combination of winning players. Index ranges from 0 to 2^(n-1), where
-        // bit 0 is player 1, bit 1 player 2 etc).
-        uint64_t winsByPlayerMask[1 << MAX_PLAYERS] = {};
+        // Wins for each combination of winning players. Index ranges from 0 to 2^n - 1, where
+        // bit 0 is player 1, bit 1 player 2 etc). Sized by the number of players.
+        std::vector<uint64_t> winsByPlayerMask;
         // Total hand count / hand count for last update period.
         uint64_t hands = 0, intervalHands = 0;
         // Total speed in hands/s / speed for last update period.
         double speed = 0, intervalSpeed = 0;
         // Total duration / duration of the last update period.
         double time = 0, intervalTime = 0;
+        // Time that the threads spent in total waiting for the lock on the shared state when updating results.
+        double lockWaitTime = 0;
+        // Time spent in start() preparing the hand ranges and other state before launching the threads.
+        double setupTime = 0;
+        // Time from launching the threads until the first one started running. Included in the total duration.
+        double threadStartTime = 0;
         // Standard deviation for the total equity of first player.
         double stdev = 0;
         // Single-hand standard deviation.
@@ -56,10 +67,71 @@ public:
         uint64_t evaluatedPreflopCombos = 0;
         // How many showdowns were actually evaluated (instead of using lookups or isomorphism).
         uint64_t evaluations = 0;
+        // How many preflop combos got their results from the lookup table. (Enumeration only.)
+        uint64_t lookupHits = 0;
         // Whether enumeration or monte carlo was used.
         bool enumerateAll = false;
         // Is calculation finished. (Includes stopping.)
         bool finished = false;
+        // Calculation was stopped before it was complete, by stop(), a limit or the deadline, or monte carlo didn't
+        // reach the stdev target. Interrupted enumeration results include only fully enumerated preflops, and no
+        // histograms or runout breakdown.
+        bool interrupted = false;
+        // Distribution of equity over the holecard combos in each player's range. Bin i holds the fraction of the
+        // player's hands where the combo's equity was in [i / bins, (i + 1) / bins). Only filled in at the end of
+        // the calculation and only if enabled with setHistogramBins().
+        std::vector<double> comboEquityHistogram[MAX_PLAYERS];
+        // Distribution of each player's equity over flops, weighted the same way. Only available when the flop
+        // isn't fully fixed by the board cards.
+        std::vector<double> flopEquityHistogram[MAX_PLAYERS];
+        // Fraction of the hands that were left out of the histograms, because their combo or flop got less than
+        // 1000 monte carlo samples, which isn't enough for a reliable equity. Together with the bins these add up
+        // to 1. With no fixed flop cards it takes well over 20 million hands to get every flop reliable. Always 0
+        // for enumeration.
+        double comboHistogramUnreliable[MAX_PLAYERS] = {};
+        double flopHistogramUnreliable = 0;
+        // Equity of each player by board card, i.e. the equity if that card comes. On flop this is the table of
+        // equities by turn card (same as by river card), on turn by river card. Only filled in at the end of the
+        // calculation and only if enabled with setRunoutBreakdown(), otherwise empty.
+        std::vector<double> runoutEquity[MAX_PLAYERS];
+        // Number of hands where each card was on the board. Empty when runout breakdown is disabled.
+        std::vector<uint64_t> runoutHands;
+        // Showdowns by hand category for each player. Indexed by rank >> HAND_CATEGORY_SHIFT, i.e. 1 is high card
+        // and 9 straight flush (see Constants.h). Empty unless enabled with setHandCategories().
+        std::vector<uint64_t> handCategories[MAX_PLAYERS];
+        // Showdowns by the category of the winning hand.
+        std::vector<uint64_t> winningHandCategories;
+
+        // Add the results of another calculation of the same situation. Merging the enumerations of all the slices
+        // (see setEnumerationRange()) gives exactly the same results as enumerating everything at once. Monte carlo
+        // results are combined as independent samples. Durations are summed. Histograms and runout breakdown are
+        // not merged. Merging into default constructed results copies the other results.
+        void merge(const Results& other);
+    };
+
+    // Counters for the important events in the hot loops, summed over all threads. Only gathered when the library is
+    // built with OMP_PROFILE defined (make PROFILE=1), otherwise always zero.
+    struct Profile
+    {
+        // Monte carlo holecard randomizations and how many of them were rejected because of conflicting cards.
+        uint64_t holeCardAttempts = 0, holeCardRejections = 0;
+        // Monte carlo board cards that had to be drawn again because they were already used.
+        uint64_t boardRejections = 0;
+        // Combos that the monte carlo random walk had to skip because they conflicted with other players' cards.
+        uint64_t randomWalkSkips = 0;
+        // Nodes of the board enumeration by the number of board cards still left to deal.
+        uint64_t boardNodes[BOARD_CARDS + 1] = {};
+        // Board subtrees that were not enumerated, because they are isomorphic to another one due to irrelevant suits.
+        uint64_t foldedSubtrees = 0;
+        // Preflops that were found in the lookup table, and ones that had to be enumerated.
+        uint64_t lookupHits = 0, lookupMisses = 0;
+        // Calls to updateResults() and reserveBatch(). The time spent waiting for the lock of updateResults() is in
+        // Results::lockWaitTime.
+        uint64_t updates = 0, reservations = 0;
+        // Enumeration batches that a thread took from the queue of another thread after running out of its own work.
+        uint64_t steals = 0;
+        // Total running time of the threads.
+        double threadTime = 0;
     };
 
     // Start a new calculation. Returns false if calculation is impossible for given hand ranges and board/dead cards.
@@ -76,9 +148,18 @@ public:
                std::function<void(const Results&)> callback = nullptr,
                double updateInterval = 0.2, unsigned threadCount = 0);
 
+    // Continue an exact enumeration from a checkpoint written with setCheckpoint(). Hand ranges, board and dead cards
+    // are read from the checkpoint and the other arguments are the same as in start(). Gives the same results as an
+    // uninterrupted calculation. Returns false if the checkpoint can't be read or doesn't match the current settings
+    // (hand categories), or if histograms or runout breakdown are enabled.
+    bool resume(const std::string& checkpointFile, std::function<void(const Results&)> callback = nullptr,
+                double updateInterval = 0.2, unsigned threadCount = 0);
+
     // Force current calculation to stop before it's ready. Still must call wait()!
     void stop()
     {
+        if (mTracer)
+            mTracer->instant("stop");
         mStopped = true;
     }
 
@@ -96,6 +177,15 @@ public:
         mTimeLimit = seconds <= 0 ? INFINITE : seconds;
     }
 
+    // Stop the calculation at given point of time. The threads check the time often, so an enumeration stops within
+    // about a millisecond even in the middle of a long board enumeration. Without arguments the deadline is disabled
+    // (default).
+    void setDeadline(std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max())
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mDeadline = deadline;
+    }
+
     // Set a hand limit for the calculation or 0 to disable. Disabled by default.
     void setHandLimit(uint64_t handLimit)
     {
@@ -103,6 +193,95 @@ public:
         mHandLimit = handLimit == 0 ? INFINITE : handLimit;
     }
 
+    // Only enumerate the preflop combos with index in [begin, end), so that a big enumeration can be split into slices
+    // that are calculated separately, e.g. in different processes, and combined with Results::merge(). The indexes
+    // go up to Results::preflopCombos, which depends only on hand ranges and board/dead cards, so it can be found
+    // by calculating an empty slice, which finishes right away. Progress is relative to the slice. Doesn't affect
+    // monte carlo. By default everything is enumerated.
+    void setEnumerationRange(uint64_t begin = 0, uint64_t end = ~0ull)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mEnumBegin = begin;
+        mEnumEnd = end;
+    }
+
+    // Set the approximate number of hands each thread handles between synchronizations with the shared state, which
+    // in monte carlo means updating the results. In enumeration it's the upper limit for the preflops that a thread
+    // reserves from its work queue at a time. Batches are made smaller when the preflops are expensive. Use 0 for the
+    // defaults, which are 4096 for monte carlo and 2 million for enumeration.
+    void setBatchSize(uint64_t hands)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mBatchSize = hands;
+    }
+
+    // Enable equity histograms (see Results::comboEquityHistogram) with given number of bins, or 0 to disable.
+    // Disabled by default. The flop histogram makes enumeration slower when the flop isn't fixed, because the
+    // results have to be recorded for every flop of every board, and stored with each preflop in the lookup table.
+    void setHistogramBins(unsigned bins)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mHistogramBins = bins;
+    }
+
+    // Record the results separately for each card that gets dealt to the board (see Results::runoutEquity and
+    // getRunoutResults()). Disabled by default. Enumeration can't use the preflop lookup table with this, so
+    // preflop enumeration can get slower.
+    void setRunoutBreakdown(bool enabled)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mRunoutBreakdown = enabled;
+    }
+
+    // Count the showdowns by hand category (see Results::handCategories). Disabled by default.
+    void setHandCategories(bool enabled)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mHandCategories = enabled;
+    }
+
+    bool handCategories()
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return mHandCategories;
+    }
+
+    // Save the state of exact enumerations to given file every interval seconds, and when the calculation finishes
+    // or is stopped, so that it can be continued with resume(). Only the preflops in completed batches are saved,
+    // together with the lookup table. The file is replaced atomically. Use an empty file name to disable. Disabled
+    // by default. Histograms and runout breakdown can't be saved, so they are not used with checkpoints.
+    void setCheckpoint(const std::string& file, double interval = 60)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mCheckpointFile = file;
+        mCheckpointInterval = interval;
+    }
+
+    // Pin the calculation threads to given CPUs, thread i to cpus[i % cpus.size()]. With replicatePerNode the threads
+    // on each NUMA node also use their own copy of the combined hand ranges, which are read in every iteration of
+    // the hot loops. The copy is made by the first thread of the node, so it's allocated from the node's local memory.
+    // Other per-thread state is always allocated by the thread itself. An empty list disables pinning (default).
+    // Supported on Linux and Windows, elsewhere the threads aren't pinned.
+    void setThreadAffinity(const std::vector<unsigned>& cpus, bool replicatePerNode = false)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mAffinity = cpus;
+        mReplicatePerNode = replicatePerNode;
+    }
+
+    // Record the phases of the calculation (setup, enumeration batches, lock waits, result updates, callbacks and
+    // stopping) to given tracer, or nullptr to disable. The tracer must outlive the calculation. Disabled by default.
+    void setTracer(Tracer* tracer)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mTracer = tracer;
+    }
+
+    // Results restricted to the boards that include the given card. Requires runout breakdown. When there's only one
+    // card left to come on turn, or on flop where both turn and river are enumerated, these are the same results that
+    // a new calculation would give after adding the card to the board. Available after the calculation finishes.
+    Results getRunoutResults(unsigned card);
+
     // Get results from previous update.
     Results getResults()
     {
@@ -110,6 +289,13 @@ public:
         return mUpdateResults;
     }
 
+    // Profiling counters of the threads that have finished. See Profile.
+    Profile getProfile()
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return mProfile;
+    }
+
     // Hand ranges used in current calculation.
     const std::vector<CardRange>& handRanges() const
     {
@@ -121,22 +307,183 @@ private:
 
     static const size_t MAX_LOOKUP_SIZE = 1000000;
     static const size_t MAX_COMBINED_RANGE_SIZE = 10000;
+    static const size_t MAX_FLOP_LOOKUP_SIZE = 8000000; // Doubles stored for flop results in the lookup table.
     static const uint64_t INFINITE = ~0ull;
+    static const unsigned FLOP_COUNT = 22100; // 52 choose 3
+    static const unsigned MIN_HISTOGRAM_SAMPLES = 1000;
+    // Ranks by river card per combo on turn, padded to a multiple of the SIMD width.
+    static const unsigned TURN_RANK_STRIDE = 56;
+    // Ranks by turn and river cards per combo on flop: C(49,2) = 1176 runouts, padded to whole 64-bit words of a
+    // runout bitset.
+    static const unsigned FLOP_RUNOUT_WORDS = 19;
+    static const unsigned FLOP_RANK_STRIDE = FLOP_RUNOUT_WORDS * 64;
+
+    // Optional statistics that are gathered in the hot loops. Used as template flags so that there's no overhead
+    // when they are disabled.
+    static const unsigned STATS_DISTRIBUTIONS = 1;
+    static const unsigned STATS_RUNOUTS = 2;
+    static const unsigned STATS_CATEGORIES = 4;
 
-    // Temporary storage for results.
+    // Temporary storage for results. Each thread keeps one and resets it after every update, so that only the
+    // winner masks of the actual player count need to be cleared.
     struct BatchResults
     {
-        BatchResults(unsigned nplayers)
+        BatchResults(unsigned nplayers, bool categories = false)
+            : nplayers(nplayers)
         {
+            if (categories)
+                categoryCounts.resize((nplayers + 1) * HAND_CATEGORY_COUNT);
+            reset();
+        }
+
+        void reset()
+        {
+            skippedPreflopCombos = uniquePreflopCombos = evalCount = lookupHits = 0;
             for (unsigned i = 0; i < nplayers; ++i)
                 playerIds[i] = i;
+            std::fill(winsByPlayerMask, winsByPlayerMask + (1u << nplayers), 0);
+            std::fill(categoryCounts.begin(), categoryCounts.end(), 0);
         }
 
-        uint64_t skippedPreflopCombos = 0;
-        uint64_t uniquePreflopCombos = 0;
-        uint64_t evalCount = 0;
+        unsigned nplayers;
+        uint64_t skippedPreflopCombos;
+        uint64_t uniquePreflopCombos;
+        uint64_t evalCount;
+        uint64_t lookupHits;
         uint8_t playerIds[MAX_PLAYERS];
-        unsigned winsByPlayerMask[1 << MAX_PLAYERS] = {};
+        unsigned winsByPlayerMask[1 << MAX_PLAYERS];
+        // Showdowns by hand category for each player followed by the winning hand. Empty when not requested.
+        std::vector<uint64_t> categoryCounts;
+    };
+
+    // Unique id for the holecards of all players. Base 1327 needs more than 64 bits with over 6 players, so the
+    // first 6 players go to the low part and the rest to the high part.
+    struct PreflopId
+    {
+        bool operator==(const PreflopId& other) const
+        {
+            return low == other.low && high == other.high;
+        }
+
+        uint64_t low, high;
+    };
+
+    struct PreflopIdHash
+    {
+        size_t operator()(const PreflopId& id) const
+        {
+            return std::hash<uint64_t>()(id.low ^ (id.high * 0x9e3779b97f4a7c15ull));
+        }
+    };
+
+    // Results of one preflop in the lookup table. Only the winner masks with non-zero count are stored, because
+    // with more players most of the 2^n masks never win.
+    struct LookupEntry
+    {
+        std::vector<std::pair<unsigned,unsigned>> winsByPlayerMask;
+        std::vector<uint64_t> categoryCounts;
+    };
+
+    // Stack of the board cards dealt in enumerateBoardRec(). Each entry is a group of interchangeable cards of which
+    // some were dealt.
+    struct DealtCards
+    {
+        void push(const unsigned* group, unsigned groupSize, unsigned dealtCount)
+        {
+            omp_assert(size < BOARD_CARDS);
+            groups[size] = group;
+            groupSizes[size] = groupSize;
+            dealtCounts[size++] = dealtCount;
+        }
+
+        void pop()
+        {
+            --size;
+        }
+
+        const unsigned* groups[BOARD_CARDS];
+        unsigned groupSizes[BOARD_CARDS], dealtCounts[BOARD_CARDS];
+        unsigned size = 0;
+    };
+
+    // Flops that can be formed from the fixed board cards and the cards in the dealt card stack. Each level of the
+    // stack keeps the flops that are completed by its cards together with showdown totals for the subtree, so that
+    // every flop is recorded once per subtree instead of unfolding the whole board again at every leaf. Taking a
+    // particular set of m cards from a group of n where k were dealt has a weight of C(n-m,k-m)/C(n,k).
+    struct DealtFlops
+    {
+        struct PartialFlop
+        {
+            unsigned cards[3];
+            unsigned count;
+            double weight;
+        };
+
+        struct Level
+        {
+            // Stack sizes after this level.
+            size_t partialFlopCounts[3], flopCount;
+            // Hand count followed by equity for each player, for all the showdowns below this level.
+            double totals[MAX_PLAYERS + 1];
+        };
+
+        void init(uint64_t fixedCards);
+        void push(const unsigned* group, unsigned groupSize, unsigned dealtCount);
+        void addGroupCards(const PartialFlop& flop, const unsigned* group, unsigned groupSize, unsigned dealtCount,
+                           unsigned start, unsigned taken);
+
+        // Flops that are still missing cards, by their card count.
+        std::vector<PartialFlop> partialFlops[3];
+        // Complete flops as (flop index, weight) pairs.
+        std::vector<std::pair<unsigned,double>> flops;
+        Level levels[BOARD_CARDS + 1];
+        unsigned size = 0;
+    };
+
+    // Per-thread accumulators for the optional detailed statistics. Unlike BatchResults these are merged to the
+    // shared results only once when the thread finishes.
+    struct DetailStats
+    {
+        void init(unsigned nplayers, bool distributions, bool runouts);
+
+        // Equity and hand count by player and holecard combo. Indexed by player * COMBO_COUNT + getComboIndex().
+        std::vector<double> comboEquity, comboHands;
+        // Equity by player and flop, indexed by player * FLOP_COUNT + getFlopIndex(), and hand count by flop.
+        std::vector<double> flopEquity, flopHands;
+        // Wins for each winner mask by board card, indexed by (card << nplayers) | winnersMask.
+        std::vector<uint64_t> runoutWins;
+        DealtCards dealt;
+        // Flop results of the current preflop with transformed suits and players in enumeration order. Indexed by
+        // flop * (nplayers + 1), which has the hand count followed by equity for each player.
+        std::vector<double> preflopFlops;
+        DealtFlops dealtFlops;
+    };
+
+    // Saved state of an enumeration. See setCheckpoint().
+    struct Checkpoint
+    {
+        std::vector<CardRange> handRanges;
+        uint64_t boardCards = 0, deadCards = 0;
+        uint64_t preflopCombos = 0;
+        // Enumerated slice, see setEnumerationRange().
+        uint64_t sliceBegin = 0, sliceEnd = 0;
+        // Preflop index ranges that haven't been completed.
+        std::vector<std::pair<uint64_t,uint64_t>> remaining;
+        // Results of the completed preflops. Only the counts are saved.
+        Results results;
+        std::vector<std::pair<PreflopId,LookupEntry>> lookup;
+    };
+
+    // Enumeration work of one thread as preflop index ranges. The owner takes batches from the front and the threads
+    // that run out of work steal from the back. Locked only by the owner and thieves, except by checkpoints.
+    struct WorkQueue
+    {
+        std::mutex mutex;
+        std::deque<std::pair<uint64_t,uint64_t>> ranges;
+        // Total size of the ranges. Can be read without the lock to choose a victim.
+        std::atomic<uint64_t> remaining{0};
+        // Batch that the owner is enumerating. Only tracked for checkpoints.
+        std::pair<uint64_t,uint64_t> inFlight{0, 0};
     };
 
     // Ad-hoc struct used when sorting hands.
@@ -146,36 +493,97 @@ private:
         unsigned playerIdx;
     };
 
+    unsigned recordThreadStart();
+    const CombinedRange* localCombinedRanges(unsigned threadIdx);
     void simulateRegularMonteCarlo();
+    template<unsigned tStats, unsigned tRemainingCards = ~0u, unsigned tPlayers = 0>
     void simulateRandomWalkMonteCarlo();
     bool randomizeHoleCards(uint64_t &usedCardsMask, unsigned* comboIndexes, Hand* playerHands,
-                            Rng& rng, FastUniformIntDistribution<unsigned,21>*comboDists);
+                            Rng& rng, FastUniformIntDistribution<unsigned,21>*comboDists,
+                            const CombinedRange* combinedRanges);
+    template<bool tRecordCards = false>
     OMP_FORCE_INLINE void randomizeBoard(Hand& board, unsigned remainingCards, uint64_t usedCardsMask,
-                        Rng& rng, FastUniformIntDistribution<unsigned,16>& cardDist);
-    template<bool tFlushPossible = true>
-    OMP_FORCE_INLINE void evaluateHands(const Hand* playerHands, unsigned nplayers, const Hand& board,
+                        Rng& rng, FastUniformIntDistribution<unsigned,16>& cardDist, unsigned* dealtCards = nullptr);
+    template<unsigned tStats = 0, bool tFlushPossible = true>
+    OMP_FORCE_INLINE unsigned evaluateHands(const Hand* playerHands, unsigned nplayers, const Hand& board,
             BatchResults* stats, unsigned weight);
     void enumerate();
+    void precomputeRanks();
+    void resolveRiverBlock(uint64_t outerIdx, const CombinedRange* combinedRanges, BatchResults* stats) const;
+    OMP_FORCE_INLINE void evaluateRanks(const uint16_t* const* playerRanks, unsigned nplayers, uint64_t usedCardsMask,
+                                        BatchResults* stats) const;
+    #if OMP_SSE2
+    void evaluateFlopRanks(const uint16_t* const* playerRanks, unsigned nplayers, uint64_t usedCardsMask,
+                           BatchResults* stats) const;
+    #endif
     void enumerateBoard(const HandWithPlayerIdx* playerHands, unsigned nplayers,
-                   const Hand& board, uint64_t usedCardsMask, BatchResults* stats);
+                   const Hand& board, uint64_t usedCardsMask, BatchResults* stats, DetailStats* detail);
+    template<unsigned tStats>
     void enumerateBoardRec(const Hand* playerHands, unsigned nplayers, BatchResults* stats,
                            const Hand& board, unsigned* deck, unsigned ndeck,  unsigned* suitCounts,
-                           unsigned k, unsigned start, unsigned weight);
-    bool lookupResults(uint64_t hash, BatchResults& results);
+                           const unsigned* suitClasses, unsigned k, unsigned start, unsigned weight,
+                           DetailStats* detail);
+    void recordRunout(unsigned winnersMask, uint64_t weight, const unsigned* lastGroup, unsigned lastGroupSize,
+                      DetailStats* detail) const;
+    static void addShowdown(double* totals, unsigned winnersMask, double weight);
+    void popDealtFlops(DetailStats* detail) const;
+    OMP_FORCE_INLINE void recordLastCardFlops(unsigned winnersMask, double weight, const unsigned* lastGroup,
+                                              unsigned lastGroupSize, DetailStats* detail) const;
+    bool startCalculation(const std::vector<CardRange>& handRanges, uint64_t boardCards, uint64_t deadCards,
+                          bool enumerateAll, double stdevTarget, std::function<void(const Results&)> callback,
+                          double updateInterval, unsigned threadCount, const Checkpoint* checkpoint);
+    bool lookupResults(const PreflopId& preflopId, BatchResults& results,
+                       std::shared_ptr<const std::vector<double>>* flopResults = nullptr);
     bool lookupPrecalculatedResults(uint64_t hash, BatchResults& results) const;
-    void storeResults(uint64_t hash, const BatchResults& results);
-    static unsigned transformSuits(HandWithPlayerIdx* playerHands, unsigned nplayers,
-                                   uint64_t* boardCards, uint64_t* usedCards);
-    static uint64_t calculateUniquePreflopId(const HandWithPlayerIdx* playerHands, unsigned nplayers);
+    void storeResults(const PreflopId& preflopId, const BatchResults& results,
+                      const std::vector<double>* flopResults = nullptr);
+    static void sortHands(HandWithPlayerIdx* playerHands, unsigned nplayers);
+    static unsigned transformSuits(uint64_t* boardCards, uint64_t* deadCards);
+    static void transformHoleCards(HandWithPlayerIdx* playerHands, unsigned nplayers, unsigned state,
+                                   unsigned* suitTransform = nullptr);
+    static PreflopId calculateUniquePreflopId(const HandWithPlayerIdx* playerHands, unsigned nplayers);
     static Hand getBoardFromBitmask(uint64_t board);
+    static unsigned getComboIndex(std::array<uint8_t,2> holeCards);
+    static unsigned getFlopIndex(uint64_t flopCards);
+    static unsigned getFlopIndex(unsigned c0, unsigned c1, unsigned c2);
+    void recordShowdownDistributions(unsigned winnersMask, const unsigned* comboIndexes, uint64_t flopCards,
+                                     DetailStats* detail) const;
+    void recordComboDistributions(const BatchResults& stats, const std::array<uint8_t,2>* holeCards,
+                                  DetailStats* detail) const;
+    void recordPreflopFlops(const std::vector<double>& flopResults, const unsigned* suitTransform,
+                            const uint8_t* playerIds, DetailStats* detail) const;
+    void mergeDetailStats(const DetailStats& detail);
+    void calculateHistograms();
+    static void calculateEquities(Results& results);
+    Results calculateRunoutResults(unsigned card) const;
     static std::vector<std::vector<std::array<uint8_t,2>>> removeInvalidCombos(const std::vector<CardRange>& handRanges,
                                                                uint64_t reservedCards);
-    std::pair<uint64_t,uint64_t> reserveBatch(uint64_t batchCount);
+    void distributeWork(const std::vector<std::pair<uint64_t,uint64_t>>& ranges, unsigned threadCount);
+    std::pair<uint64_t,uint64_t> reserveBatch(unsigned queueIdx, uint64_t batchCount);
+    static std::pair<uint64_t,uint64_t> takeBatch(WorkQueue& queue, uint64_t batchCount);
+    void commitBatch(unsigned queueIdx, const Results& batchResults);
+    void initResults(Results& results, unsigned players, bool enumerateAll) const;
+    static void addCounts(Results& results, const Results& other);
+    void writeCheckpoint();
+    static bool readCheckpoint(const std::string& file, Checkpoint& checkpoint);
     uint64_t getPreflopCombinationCount();
     uint64_t getPostflopCombinationCount();
 
-    void updateResults(const BatchResults& stats, bool finished);
-    double combineResults(const BatchResults& batch);
+    // Cheap check for stopping in the hot loops. Reads the clock only if there's a deadline or time limit.
+    bool shouldStop()
+    {
+        if (mStopped.load(std::memory_order_relaxed))
+            return true;
+        if (mHasStopTime && std::chrono::steady_clock::now() >= mStopTime) {
+            mStopped = true;
+            return true;
+        }
+        return false;
+    }
+
+    void mergeProfile(const Profile& profile);
+    void updateResults(const BatchResults& stats, bool finished, Results* batchResults = nullptr);
+    double combineResults(const BatchResults& batch, Results& results);
     void outputLookupTable() const;
 
     std::vector<std::thread> mThreads;
@@ -183,22 +591,73 @@ private:
     // Shared between threads, protected by mMutex.
     std::mutex mMutex;
     std::atomic<bool> mStopped;
+    // Set by enumeration threads that stop with some of their preflops not enumerated.
+    std::atomic<bool> mIncomplete;
     unsigned mUnfinishedThreads;
     std::chrono::high_resolution_clock::time_point mLastUpdate;
     Results mResults, mUpdateResults;
     double mBatchSum, mBatchSumSqr, mBatchCount;
-    uint64_t mEnumPosition;
-    std::unordered_map<uint64_t, BatchResults> mLookup;
+    // Enumerated slice, the work queue of each thread, and the total and reserved counts for progress.
+    std::pair<uint64_t,uint64_t> mEnumSlice;
+    std::vector<std::unique_ptr<WorkQueue>> mWorkQueues;
+    uint64_t mEnumTotal;
+    std::atomic<uint64_t> mEnumReserved;
+    // Results of the completed batches. Checkpoints only.
+    Results mCheckpointResults;
+    std::chrono::high_resolution_clock::time_point mLastCheckpoint;
+    bool mCheckpointing = false;
+    std::unordered_map<PreflopId, LookupEntry, PreflopIdHash> mLookup;
+    std::unordered_map<PreflopId, std::shared_ptr<const std::vector<double>>, PreflopIdHash> mFlopLookup;
+    size_t mFlopLookupSize = 0;
+    DetailStats mDetailStats;
+    Profile mProfile;
 
     // Constant shared data
     std::vector<CardRange> mOriginalHandRanges; // Original ranges without before card removal.
     std::vector<std::vector<std::array<uint8_t,2>>> mHandRanges; // Ranges after card removal.
+    // Ranges after card removal that the combined ranges were joined from for enumeration (empty for monte carlo).
+    std::vector<std::vector<std::array<uint8_t,2>>> mJoinedHandRanges;
     CombinedRange mCombinedRanges[MAX_PLAYERS];
     unsigned mCombinedRangeCount;
+    // Showdown ranks of the combos when the board has 3 to 5 cards (see precomputeRanks()). The arena has mRankStride
+    // ranks for each distinct hole card combo, so players with the same combos share them. Offsets into the arena are
+    // indexed by combined range and then by combo index * player count + player. Empty when not used.
+    std::vector<uint16_t> mRankArena;
+    std::vector<uint32_t> mComboRankOffsets[MAX_PLAYERS];
+    unsigned mRankStride = 0;
+    // Cards that the ranks were computed for, if the combined ranges are still the same.
+    bool mRanksValid = false;
+    uint64_t mRankedBoardCards = 0, mRankedDeadCards = 0;
+    // Flop runouts as bitsets of FLOP_RUNOUT_WORDS words: all of them, and the ones that contain each card.
+    std::vector<uint64_t> mRunouts, mRunoutsByCard;
+    // Ranks of the first combined range sorted for counting the combos above a rank on river, when the range has a
+    // single player (see resolveRiverBlock()). Also by each card, and by both cards (-1 if the combo isn't in the
+    // range, indexed by card1 * CARD_COUNT + card2).
+    std::vector<uint16_t> mSortedRanks, mSortedRanksByCard[CARD_COUNT];
+    std::vector<int32_t> mRankByCombo;
+    bool mRiverBlocks = false;
+    // Copies of the combined ranges by NUMA node, see setThreadAffinity().
+    std::unordered_map<unsigned, std::unique_ptr<CombinedRange[]>> mNodeCombinedRanges;
+    // Index of the next thread to start.
+    std::atomic<unsigned> mNextThread;
     uint64_t mDeadCards, mBoardCards;
     HandEvaluator mEval;
     double mStdevTarget = 5e-5, mTimeLimit = (double)INFINITE, mUpdateInterval = 0.1;
+    std::chrono::steady_clock::time_point mDeadline = std::chrono::steady_clock::time_point::max();
+    // Earlier of the deadline and the end of the time limit, fixed when the calculation starts.
+    std::chrono::steady_clock::time_point mStopTime;
+    bool mHasStopTime = false;
     uint64_t mHandLimit = INFINITE;
+    uint64_t mBatchSize = 0;
+    unsigned mHistogramBins = 0;
+    bool mRunoutBreakdown = false;
+    bool mHandCategories = false;
+    std::string mCheckpointFile;
+    double mCheckpointInterval = 60;
+    uint64_t mEnumBegin = 0, mEnumEnd = ~0ull;
+    std::vector<unsigned> mAffinity;
+    bool mReplicatePerNode = false;
+    Tracer* mTracer = nullptr;
     std::function<void(const Results& results)> mCallback;
 
     // Precalculated results for 2 player preflop situations. Uses a sorted array for lowest memory use.
@@ -0,0 +1,245 @@
+#ifndef OMP_EQUITYCOROUTINE_H
+#define OMP_EQUITYCOROUTINE_H
+
+// C++20 coroutine interface for equity calculations. The rest of the library is C++11, so this header is empty unless
+// it's compiled as C++20 or newer. Header-only, so lib/ompeval.a doesn't need to be built as C++20.
+
+#if __cplusplus >= 202002L
+
+#include "EquityCalculator.h"
+#include "EquityPool.h"
+#include <coroutine>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <exception>
+#include <cstdint>
+
+namespace omp {
+
+// Awaitable equity calculation, returned by AsyncEquityCalculator::run(). Awaiting it suspends the coroutine until the
+// calculation is finished and returns the final results:
+//
+//     EquityCalculator::Results r = co_await calc.run(query);
+//
+// Intermediate results can be streamed instead, one per update interval. The last results returned by next() are the
+// final ones:
+//
+//     EquityRun run = calc.run(query);
+//     while (co_await run.next())
+//         send(run.results());
+//
+// Nothing runs on the calculation threads except storing the results and scheduling the coroutine, and the coroutine
+// is always resumed through the executor given to AsyncEquityCalculator. Destroying an unfinished run stops the
+// calculation and waits for its threads. A suspended coroutine can be destroyed even if its resumption has already
+// been scheduled: the executor gets a handle that resumes the coroutine only if its run still exists. The coroutine
+// must then be destroyed on the thread where the executor resumes the handles (e.g. the event loop).
+class EquityRun
+{
+public:
+    EquityRun(EquityRun&&) = default;
+
+    ~EquityRun()
+    {
+        if (!mCalculator)
+            return;
+        mCalculator->stop();
+        mCalculator->wait();
+        // Coroutine that owns this run is being destroyed, so it must not be resumed anymore, even if a resumption
+        // is already waiting in the executor (see resumeWaiter()).
+        std::lock_guard<std::mutex> lock(mChannel->mutex);
+        mChannel->waiter = nullptr;
+        mChannel->scheduled = nullptr;
+    }
+
+    // Awaitable that gives true when there are new results, and false after the final results have been returned.
+    auto next()
+    {
+        struct Awaiter
+        {
+            EquityRun& run;
+            bool await_ready() { return run.ready(true); }
+            bool await_suspend(std::coroutine_handle<> handle) { return run.suspend(handle, true); }
+            bool await_resume() { return run.take(); }
+        };
+        return Awaiter{*this};
+    }
+
+    // Awaitable that gives the final results.
+    auto operator co_await()
+    {
+        struct Awaiter
+        {
+            EquityRun& run;
+            bool await_ready() { return run.ready(false); }
+            bool await_suspend(std::coroutine_handle<> handle) { return run.suspend(handle, false); }
+            EquityCalculator::Results await_resume()
+            {
+                run.take();
+                return run.mResults;
+            }
+        };
+        return Awaiter{*this};
+    }
+
+    // Latest results returned by next().
+    const EquityCalculator::Results& results() const
+    {
+        return mResults;
+    }
+
+    // Stop the calculation early. The awaiters still get the final (partial) results.
+    void stop()
+    {
+        if (mCalculator)
+            mCalculator->stop();
+    }
+
+private:
+    friend class AsyncEquityCalculator;
+
+    // Shared with the callback of the calculator.
+    struct Channel
+    {
+        std::mutex mutex;
+        EquityCalculator::Results latest;
+        uint64_t version = 0;
+        bool finished = false;
+        std::coroutine_handle<> waiter;
+        // Waiter is resumed by any update, not only the final one.
+        bool waiterAnyUpdate = false;
+        // Waiter whose resumption has been given to the executor.
+        std::coroutine_handle<> scheduled;
+        std::function<void(std::coroutine_handle<>)> executor;
+    };
+
+    // Coroutine that starts suspended and destroys itself when it finishes.
+    struct Resumer
+    {
+        struct promise_type
+        {
+            Resumer get_return_object() { return {std::coroutine_handle<promise_type>::from_promise(*this)}; }
+            std::suspend_always initial_suspend() noexcept { return {}; }
+            std::suspend_never final_suspend() noexcept { return {}; }
+            void return_void() {}
+            void unhandled_exception() { std::terminate(); }
+        };
+        std::coroutine_handle<promise_type> handle;
+    };
+
+    // Given to the executor instead of the waiter, so that a waiter that was destroyed in the meantime isn't resumed.
+    static Resumer resumeWaiter(std::shared_ptr<Channel> channel)
+    {
+        std::coroutine_handle<> waiter;
+        {
+            std::lock_guard<std::mutex> lock(channel->mutex);
+            std::swap(waiter, channel->scheduled);
+        }
+        if (waiter)
+            waiter.resume();
+        co_return;
+    }
+
+    EquityRun(std::function<void(std::coroutine_handle<>)> executor)
+        : mChannel(std::make_shared<Channel>())
+    {
+        mChannel->executor = std::move(executor);
+    }
+
+    // Called from a calculation thread while it holds the lock of the calculator.
+    static void publish(const std::shared_ptr<Channel>& channel, const EquityCalculator::Results& results)
+    {
+        {
+            std::lock_guard<std::mutex> lock(channel->mutex);
+            channel->latest = results;
+            ++channel->version;
+            channel->finished = results.finished;
+            if (!channel->waiter || !(channel->finished || channel->waiterAnyUpdate))
+                return;
+            channel->scheduled = channel->waiter;
+            channel->waiter = nullptr;
+        }
+        channel->executor(resumeWaiter(channel).handle);
+    }
+
+    bool ready(bool anyUpdate)
+    {
+        std::lock_guard<std::mutex> lock(mChannel->mutex);
+        return mChannel->finished || (anyUpdate && mChannel->version > mVersion);
+    }
+
+    // Returns false if the results arrived after await_ready(), so that the coroutine continues without suspending.
+    bool suspend(std::coroutine_handle<> handle, bool anyUpdate)
+    {
+        std::lock_guard<std::mutex> lock(mChannel->mutex);
+        if (mChannel->finished || (anyUpdate && mChannel->version > mVersion))
+            return false;
+        mChannel->waiter = handle;
+        mChannel->waiterAnyUpdate = anyUpdate;
+        return true;
+    }
+
+    bool take()
+    {
+        std::lock_guard<std::mutex> lock(mChannel->mutex);
+        if (mChannel->version == mVersion)
+            return false;
+        mResults = mChannel->latest;
+        mVersion = mChannel->version;
+        return true;
+    }
+
+    std::unique_ptr<EquityCalculator> mCalculator;
+    std::shared_ptr<Channel> mChannel;
+    EquityCalculator::Results mResults;
+    uint64_t mVersion = 0;
+};
+
+// Starts equity calculations for coroutines. Each run has its own EquityCalculator and threads, so the awaiting
+// coroutine never blocks the thread it runs on, except briefly when a finished run is destroyed.
+class AsyncEquityCalculator
+{
+public:
+    // executor: schedules a suspended coroutine to be resumed, typically by posting it to the event loop. Called from
+    // the calculation threads, so it must not resume the coroutine directly. Every handle given to the executor must
+    // be resumed eventually, even if its coroutine has been destroyed.
+    // threadCount: number of threads for each calculation, 0 for maximum parallelism supported by hardware
+    // updateInterval: how often intermediate results are published, in seconds
+    AsyncEquityCalculator(std::function<void(std::coroutine_handle<>)> executor, unsigned threadCount = 1,
+                          double updateInterval = 0.2)
+        : mExecutor(std::move(executor)), mThreadCount(threadCount), mUpdateInterval(updateInterval)
+    {
+    }
+
+    // Start a calculation. Query::priority is ignored. If calculation is impossible for given hand ranges and
+    // board/dead cards, the run finishes right away with empty results (players = 0).
+    EquityRun run(const EquityPool::Query& query)
+    {
+        EquityRun run(mExecutor);
+        run.mCalculator.reset(new EquityCalculator());
+        run.mCalculator->setTimeLimit(query.timeLimit);
+        std::shared_ptr<EquityRun::Channel> channel = run.mChannel;
+        auto callback = [channel](const EquityCalculator::Results& results){
+            EquityRun::publish(channel, results);
+        };
+        if (!run.mCalculator->start(query.handRanges, query.boardCards, query.deadCards, query.enumerateAll,
+                                    query.stdevTarget, callback, mUpdateInterval, mThreadCount)) {
+            run.mCalculator.reset();
+            EquityCalculator::Results empty;
+            empty.finished = true;
+            EquityRun::publish(channel, empty);
+        }
+        return run;
+    }
+
+private:
+    std::function<void(std::coroutine_handle<>)> mExecutor;
+    unsigned mThreadCount;
+    double mUpdateInterval;
+};
+
+}
+
+#endif // __cplusplus >= 202002L
+
+#endif // OMP_EQUITYCOROUTINE_H
@@ -0,0 +1,133 @@
+#include "EquityPool.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace omp {
+
+EquityPool::EquityPool(unsigned threadCount, double timeSlice)
+    : mTimeSlice(timeSlice)
+{
+    if (threadCount == 0)
+        threadCount = std::max(std::thread::hardware_concurrency(), 1u);
+    for (unsigned i = 0; i < threadCount; ++i)
+        mWorkers.emplace_back(&EquityPool::work, this);
+}
+
+EquityPool::~EquityPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStopped = true;
+    }
+    mJobAvailable.notify_all();
+    for (auto& t : mWorkers)
+        t.join();
+    while (!mQueue.empty()) {
+        std::shared_ptr<Job> job = mQueue.top();
+        mQueue.pop();
+        job->results.finished = false;
+        job->results.interrupted = true;
+        job->callback(job->results);
+    }
+}
+
+std::future<EquityCalculator::Results> EquityPool::submit(const Query& query)
+{
+    auto promise = std::make_shared<std::promise<EquityCalculator::Results>>();
+    submit(query, [promise](const EquityCalculator::Results& results){ promise->set_value(results); });
+    return promise->get_future();
+}
+
+void EquityPool::submit(const Query& query, std::function<void(const EquityCalculator::Results&)> callback)
+{
+    auto job = std::make_shared<Job>();
+    job->query = query;
+    job->callback = callback;
+    if (!query.enumerateAll && query.stdevTarget <= 0 && query.timeLimit <= 0) {
+        callback(job->results);
+        return;
+    }
+    enqueue(job);
+}
+
+void EquityPool::enqueue(const std::shared_ptr<Job>& job)
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        job->sequence = mNextSequence++;
+        mQueue.push(job);
+    }
+    mJobAvailable.notify_one();
+}
+
+void EquityPool::work()
+{
+    EquityCalculator calculator;
+    for (;;) {
+        std::shared_ptr<Job> job;
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mJobAvailable.wait(lock, [&]{ return mStopped || !mQueue.empty(); });
+            if (mStopped)
+                return;
+            job = mQueue.top();
+            mQueue.pop();
+        }
+        if (runSlice(calculator, *job))
+            job->callback(job->results);
+        else
+            enqueue(job);
+    }
+}
+
+// Runs one time slice of the query and adds its results to the job. Returns true if the query is finished.
+bool EquityPool::runSlice(EquityCalculator& calculator, Job& job)
+{
+    const Query& query = job.query;
+    EquityCalculator::Results& results = job.results;
+    double timeLeft = query.timeLimit > 0 ? query.timeLimit - results.time : 0;
+    double stdevTarget = 0;
+    if (query.enumerateAll) {
+        // A slice that is stopped midway can't be merged, so only the query's own time limit can stop it.
+        calculator.setTimeLimit(timeLeft);
+        calculator.setEnumerationRange(job.enumPosition, job.enumPosition + job.sliceSize);
+    } else {
+        calculator.setTimeLimit(query.timeLimit > 0 ? std::min(mTimeSlice, timeLeft) : mTimeSlice);
+        calculator.setEnumerationRange();
+        // Only the missing accuracy is needed (variances are inversely additive).
+        stdevTarget = query.stdevTarget;
+        if (results.stdev > 0 && stdevTarget > 0)
+            stdevTarget = 1 / std::sqrt(1 / (stdevTarget * stdevTarget) - 1 / (results.stdev * results.stdev));
+    }
+
+    if (!calculator.start(query.handRanges, query.boardCards, query.deadCards, query.enumerateAll, stdevTarget,
+                          nullptr, 0.002, 1)) {
+        results = EquityCalculator::Results();
+        return true;
+    }
+    calculator.wait();
+    EquityCalculator::Results slice = calculator.getResults();
+    // Monte carlo slice without any hands has no stdev to combine.
+    if (query.enumerateAll || slice.hands > 0)
+        results.merge(slice);
+    bool timeUp = query.timeLimit > 0 && results.time >= query.timeLimit;
+
+    if (query.enumerateAll) {
+        job.enumPosition = std::min(job.enumPosition + job.sliceSize, slice.preflopCombos);
+        results.progress = slice.preflopCombos > 0 ? (double)job.enumPosition / slice.preflopCombos : 1;
+        // Size the next slice to enumerate for about one time slice. Setup and thread start are paid by every slice
+        // regardless of its size, so they are left out, or short slices would measure mostly the overhead.
+        double enumerationTime = std::max(slice.time - slice.threadStartTime, 0.0);
+        double scale = std::max(std::min(mTimeSlice / (enumerationTime + 1e-9), 8.0), 0.125);
+        job.sliceSize = std::max<uint64_t>(std::min<uint64_t>((uint64_t)(job.sliceSize * scale), 1ull << 40), 1);
+        return job.enumPosition >= slice.preflopCombos || timeUp;
+    } else {
+        // Every slice is stopped by the time slice, so only the combined accuracy tells if the query was completed.
+        bool reached = query.stdevTarget > 0 && results.stdev > 0 && results.stdev <= query.stdevTarget;
+        results.interrupted = !reached;
+        return reached || timeUp;
+    }
+}
+
+}
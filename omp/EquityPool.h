@@ -0,0 +1,93 @@
+#ifndef OMP_EQUITYPOOL_H
+#define OMP_EQUITYPOOL_H
+
+#include "EquityCalculator.h"
+#include "CardRange.h"
+#include <vector>
+#include <queue>
+#include <memory>
+#include <functional>
+#include <future>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+
+namespace omp {
+
+// Runs many calculations concurrently on a shared pool of worker threads. Each worker runs one single-threaded
+// calculation at a time in short time slices: monte carlo runs until the time slice ends, and enumeration covers a
+// slice of the preflops (see EquityCalculator::setEnumerationRange()) sized to take about one time slice. Unfinished
+// queries go back to the queue, and the slices are combined with Results::merge(), so enumeration results are exact.
+// Queries with higher priority are run first and queries with equal priority take turns, so a slow query can't keep
+// fast ones waiting for longer than a time slice per worker. Enumerations lose the preflop lookup table between
+// slices, which makes big enumerations somewhat slower than with a single EquityCalculator.
+class EquityPool
+{
+public:
+    struct Query
+    {
+        std::vector<CardRange> handRanges;
+        uint64_t boardCards = 0, deadCards = 0;
+        bool enumerateAll = false;
+        // Monte carlo only. 0 runs until the time limit.
+        double stdevTarget = 5e-5;
+        // Calculation time limit in seconds, or 0 for none. Time spent waiting in the queue doesn't count.
+        double timeLimit = 0;
+        // Higher priority queries are run first.
+        int priority = 0;
+    };
+
+    // threadCount: number of worker threads, 0 for maximum parallelism supported by hardware
+    // timeSlice: how long a query runs before it gives its worker to the next query, in seconds
+    EquityPool(unsigned threadCount = 0, double timeSlice = 0.01);
+
+    // Queued queries are completed with the results calculated so far, with Results::finished set to false and
+    // Results::interrupted to true.
+    ~EquityPool();
+
+    // Queue a calculation. The results are empty (players = 0) if calculation is impossible for given hand ranges
+    // and board/dead cards, or if it's monte carlo with neither stdev target nor time limit.
+    std::future<EquityCalculator::Results> submit(const Query& query);
+
+    // Same as above, but the callback is called with the results from a worker thread instead.
+    void submit(const Query& query, std::function<void(const EquityCalculator::Results&)> callback);
+
+private:
+    struct Job
+    {
+        Query query;
+        std::function<void(const EquityCalculator::Results&)> callback;
+        EquityCalculator::Results results;
+        // Next enumeration slice.
+        uint64_t enumPosition = 0, sliceSize = 16;
+        // Order of queueing among queries with the same priority.
+        uint64_t sequence = 0;
+    };
+
+    struct JobOrder
+    {
+        bool operator()(const std::shared_ptr<Job>& lhs, const std::shared_ptr<Job>& rhs) const
+        {
+            if (lhs->query.priority != rhs->query.priority)
+                return lhs->query.priority < rhs->query.priority;
+            return lhs->sequence > rhs->sequence;
+        }
+    };
+
+    void work();
+    bool runSlice(EquityCalculator& calculator, Job& job);
+    void enqueue(const std::shared_ptr<Job>& job);
+
+    std::mutex mMutex;
+    std::condition_variable mJobAvailable;
+    std::priority_queue<std::shared_ptr<Job>, std::vector<std::shared_ptr<Job>>, JobOrder> mQueue;
+    uint64_t mNextSequence = 0;
+    bool mStopped = false;
+    double mTimeSlice;
+    std::vector<std::thread> mWorkers;
+};
+
+}
+
+#endif // OMP_EQUITYPOOL_H
@@ -0,0 +1,67 @@
+#include "EquitySession.h"
+
+#include "Util.h"
+
+namespace omp {
+
+bool EquitySession::calculate(const std::vector<CardRange>& handRanges, uint64_t boardCards, uint64_t deadCards,
+                              bool enumerateAll, double stdevTarget, unsigned threadCount)
+{
+    mReused = false;
+    bool sameSituation = mValid && enumerateAll == mEnumerateAll && deadCards == mDeadCards && sameRanges(handRanges);
+
+    // Identical query.
+    if (sameSituation && boardCards == mBoardCards && (enumerateAll || stdevTarget >= mStdevTarget)) {
+        mReused = true;
+        return true;
+    }
+
+    // One new board card: use the results of the subtree where that card was dealt.
+    uint64_t newCards = boardCards & ~mBoardCards;
+    if (sameSituation && mHasBreakdown && (boardCards & mBoardCards) == mBoardCards && bitCount(newCards) == 1
+            && !(newCards & mDeadCards)) {
+        unsigned card = 0;
+        while (!(newCards & (1ull << card)))
+            ++card;
+        EquityCalculator::Results results = mCalculator.getRunoutResults(card);
+        if (results.hands == 0)
+            return false;
+        mResults = results;
+        mBoardCards = boardCards;
+        mHasBreakdown = false;
+        mReused = true;
+        return true;
+    }
+
+    // Breakdown is only useful when the next street adds a single card.
+    unsigned boardCount = bitCount(boardCards);
+    bool breakdown = enumerateAll && boardCount >= 3 && boardCount < BOARD_CARDS;
+    mCalculator.setRunoutBreakdown(breakdown);
+    mValid = mHasBreakdown = false;
+    if (!mCalculator.start(handRanges, boardCards, deadCards, enumerateAll, stdevTarget, nullptr, 0.2, threadCount))
+        return false;
+    mCalculator.wait();
+
+    mResults = mCalculator.getResults();
+    mHandRanges = handRanges;
+    mBoardCards = boardCards;
+    mDeadCards = deadCards;
+    mEnumerateAll = enumerateAll;
+    mStdevTarget = stdevTarget;
+    mValid = true;
+    mHasBreakdown = breakdown;
+    return true;
+}
+
+bool EquitySession::sameRanges(const std::vector<CardRange>& handRanges) const
+{
+    if (handRanges.size() != mHandRanges.size())
+        return false;
+    for (size_t i = 0; i < handRanges.size(); ++i) {
+        if (handRanges[i].combinations() != mHandRanges[i].combinations())
+            return false;
+    }
+    return true;
+}
+
+}
@@ -0,0 +1,55 @@
+#ifndef OMP_EQUITYSESSION_H
+#define OMP_EQUITYSESSION_H
+
+#include "EquityCalculator.h"
+#include "CardRange.h"
+#include <vector>
+#include <cstdint>
+
+namespace omp {
+
+// Calculates equities for a sequence of related situations, typically the streets of a single hand. Exact
+// enumerations on flop and turn are done with runout breakdown, so that when the next query only adds one board card
+// (with same ranges and dead cards), the results are taken directly from the previous calculation. Other queries are
+// calculated normally, which on river means enumerating only the river subtree.
+class EquitySession
+{
+public:
+    // Calculate equities and wait for the results. Arguments are the same as in EquityCalculator::start(). Returns
+    // false if calculation is impossible for given hand ranges and board/dead cards.
+    bool calculate(const std::vector<CardRange>& handRanges, uint64_t boardCards = 0, uint64_t deadCards = 0,
+                   bool enumerateAll = false, double stdevTarget = 5e-5, unsigned threadCount = 0);
+
+    // Results of the latest calculate() call.
+    const EquityCalculator::Results& results() const
+    {
+        return mResults;
+    }
+
+    // True if the latest results were reused from the previous calculation instead of calculating them.
+    bool reused() const
+    {
+        return mReused;
+    }
+
+    // Forget the previous calculation.
+    void reset()
+    {
+        mValid = mHasBreakdown = false;
+    }
+
+private:
+    bool sameRanges(const std::vector<CardRange>& handRanges) const;
+
+    EquityCalculator mCalculator;
+    EquityCalculator::Results mResults;
+    std::vector<CardRange> mHandRanges;
+    uint64_t mBoardCards = 0, mDeadCards = 0;
+    bool mEnumerateAll = false;
+    double mStdevTarget = 0;
+    bool mValid = false, mHasBreakdown = false, mReused = false;
+};
+
+}
+
+#endif // OMP_EQUITYSESSION_H
@@ -0,0 +1,92 @@
+#include "Tracer.h"
+
+#include <atomic>
+
+namespace omp {
+
+// Ids identify the tracer for the thread local buffer pointer, since a new tracer could be allocated at the same
+// address as a destroyed one.
+static std::atomic<uint64_t> nextTracerId(1);
+
+thread_local uint64_t Tracer::tTracerId = 0;
+thread_local Tracer::ThreadBuffer* Tracer::tBuffer = nullptr;
+
+Tracer::Tracer(size_t eventsPerThread)
+    : mStartTime(std::chrono::high_resolution_clock::now()), mCapacity(1), mId(nextTracerId++)
+{
+    while (mCapacity < eventsPerThread)
+        mCapacity *= 2;
+}
+
+void Tracer::record(const char* name, char phase)
+{
+    auto t = std::chrono::high_resolution_clock::now();
+    if (tTracerId != mId) {
+        tBuffer = registerThread();
+        tTracerId = mId;
+    }
+    Event e = {name, (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(t - mStartTime).count(), phase};
+    // Buffer grows until it's full, so that short lived threads don't take much memory.
+    if (tBuffer->count < mCapacity)
+        tBuffer->events.push_back(e);
+    else
+        tBuffer->events[tBuffer->count & (mCapacity - 1)] = e;
+    ++tBuffer->count;
+}
+
+// Finds or allocates the buffer of the calling thread.
+Tracer::ThreadBuffer* Tracer::registerThread()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    for (auto& buffer : mBuffers) {
+        if (buffer->thread == std::this_thread::get_id())
+            return buffer.get();
+    }
+    mBuffers.emplace_back(new ThreadBuffer{std::this_thread::get_id(), (unsigned)mBuffers.size() + 1, 0, {}});
+    return mBuffers.back().get();
+}
+
+void Tracer::write(std::ostream& os) const
+{
+    os << "{\"traceEvents\": [\n";
+    bool first = true;
+    for (auto& buffer : mBuffers) {
+        uint64_t begin = buffer->count > mCapacity ? buffer->count - mCapacity : 0;
+        for (uint64_t i = begin; i < buffer->count; ++i) {
+            const Event& e = buffer->events[i & (mCapacity - 1)];
+            os << (first ? "" : ",\n") << "{\"name\": \"";
+            for (const char* c = e.name; *c; ++c) {
+                if (*c == '"' || *c == '\\')
+                    os << '\\';
+                os << *c;
+            }
+            // Timestamps are in microseconds.
+            os << "\", \"ph\": \"" << e.phase << "\", \"ts\": " << e.time / 1000 << "." << e.time / 100 % 10
+               << e.time / 10 % 10 << e.time % 10 << ", \"pid\": 1, \"tid\": " << buffer->threadId;
+            if (e.phase == 'i')
+                os << ", \"s\": \"t\"";
+            os << "}";
+            first = false;
+        }
+    }
+    os << "\n], \"displayTimeUnit\": \"ns\"}\n";
+}
+
+uint64_t Tracer::droppedEvents() const
+{
+    uint64_t dropped = 0;
+    for (auto& buffer : mBuffers)
+        dropped += buffer->count > mCapacity ? buffer->count - mCapacity : 0;
+    return dropped;
+}
+
+void Tracer::clear()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    for (auto& buffer : mBuffers) {
+        buffer->count = 0;
+        buffer->events.clear();
+    }
+}
+
+}
@@ -0,0 +1,107 @@
+#ifndef OMP_TRACER_H
+#define OMP_TRACER_H
+
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <memory>
+#include <vector>
+#include <ostream>
+#include <cstdint>
+
+namespace omp {
+
+// Records a timeline of events from multiple threads and writes it in Chrome Trace Event format, which can be opened
+// in chrome://tracing or Perfetto. Each thread records to its own ring buffer, so recording an event only stores a
+// timestamp without any locking. When a buffer is full the oldest events of that thread are overwritten.
+class Tracer
+{
+public:
+    // Marks a duration event for the lifetime of the object. Does nothing if tracer is null.
+    class Scope
+    {
+    public:
+        Scope(Tracer* tracer, const char* name)
+            : mTracer(tracer), mName(name)
+        {
+            if (mTracer)
+                mTracer->begin(mName);
+        }
+
+        ~Scope()
+        {
+            if (mTracer)
+                mTracer->end(mName);
+        }
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+    private:
+        Tracer* mTracer;
+        const char* mName;
+    };
+
+    // Buffer size is rounded up to a power of 2.
+    Tracer(size_t eventsPerThread = 0x10000);
+
+    // Start and end a duration event on the calling thread. Event names aren't copied, so they must stay valid until
+    // the trace is written (string literals are fine).
+    void begin(const char* name)
+    {
+        record(name, 'B');
+    }
+
+    void end(const char* name)
+    {
+        record(name, 'E');
+    }
+
+    // Record an instant event on the calling thread.
+    void instant(const char* name)
+    {
+        record(name, 'i');
+    }
+
+    // Write the recorded events as Chrome Trace Event JSON. Must not be called while other threads are recording.
+    void write(std::ostream& os) const;
+
+    // Number of events that were overwritten because a buffer was full.
+    uint64_t droppedEvents() const;
+
+    // Remove all recorded events.
+    void clear();
+
+private:
+    struct Event
+    {
+        const char* name;
+        uint64_t time; // Nanoseconds since the tracer was created.
+        char phase;
+    };
+
+    struct ThreadBuffer
+    {
+        std::thread::id thread;
+        unsigned threadId; // Small sequential id for the trace.
+        uint64_t count;
+        std::vector<Event> events;
+    };
+
+    void record(const char* name, char phase);
+    ThreadBuffer* registerThread();
+
+    std::chrono::high_resolution_clock::time_point mStartTime;
+    size_t mCapacity;
+    uint64_t mId;
+    std::mutex mMutex;
+    std::vector<std::unique_ptr<ThreadBuffer>> mBuffers;
+
+    // Buffer of the calling thread in the tracer that it last recorded to.
+    static thread_local uint64_t tTracerId;
+    static thread_local ThreadBuffer* tBuffer;
+};
+
+}
+
+#endif // OMP_TRACER_H
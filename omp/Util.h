@@ -43,6 +43,28 @@ inline unsigned countTrailingZeros(unsigned x)
     #endif
 }
 
+inline unsigned countTrailingZeros(unsigned long long x)
+{
+    #if _MSC_VER && _M_X64
+    unsigned long bitIdx;
+    _BitScanForward64(&bitIdx, x);
+    return bitIdx;
+    #elif _MSC_VER
+    return (unsigned)x ? countTrailingZeros((unsigned)x) : 32 + countTrailingZeros((unsigned)(x >> 32));
+    #else
+    return __builtin_ctzll(x);
+    #endif
+}
+
+inline unsigned countTrailingZeros(unsigned long x)
+{
+    #if _MSC_VER
+    return countTrailingZeros((unsigned)x);
+    #else
+    return __builtin_ctzl(x);
+    #endif
+}
+
 inline unsigned countLeadingZeros(unsigned x)
 {
     #if _MSC_VER
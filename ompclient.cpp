@@ -0,0 +1,208 @@
+// Load test client for ompserver. Opens a number of connections that each send a deterministic mix of small queries
+// (hand vs hand on flop and turn, hand vs range on turn) with a fixed number of queries in flight, and reports the
+// throughput, the latency percentiles and the number of results by status. Optionally every nth query is cancelled
+// right after sending it, and queries can be given a deadline.
+//
+// Usage: ompclient [--socket path] [--connections n] [--queries n] [--window n] [--deadline seconds]
+//                  [--cancel-every n] [--enumerate 0|1] [--verbose 1]
+
+#include "ompserver.h"
+#include "omp/CardRange.h"
+#include "omp/Random.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+
+using namespace std;
+using namespace omp;
+using namespace ompserver;
+
+typedef chrono::steady_clock Clock;
+
+struct Options
+{
+    string socketPath = DEFAULT_SOCKET;
+    unsigned connections = 4;
+    unsigned queries = 1000;
+    unsigned window = 8;
+    double deadline = 0;
+    unsigned cancelEvery = 0;
+    bool enumerate = true;
+    bool verbose = false;
+};
+
+struct Stats
+{
+    vector<double> latencies;
+    unsigned statusCounts[4] = {};
+    unsigned errors = 0;
+};
+
+static int connectToServer(const string& socketPath)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socketPath.c_str(), sizeof(addr.sun_path) - 1);
+    if (fd < 0 || connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+        cerr << "Can't connect to " << socketPath << endl;
+        exit(1);
+    }
+    return fd;
+}
+
+// Builds the i:th query of the mix with random cards.
+static vector<char> makeQuery(unsigned i, XoroShiro128Plus& rng, const Options& options)
+{
+    static const char RANKS[] = "23456789TJQKA", SUITS[] = "shcd";
+    FastUniformIntDistribution<unsigned> cardDist(0, 51);
+    uint64_t used = 0;
+    auto dealCard = [&]{
+        unsigned card;
+        do {
+            card = cardDist(rng);
+        } while (used & (1ull << card));
+        used |= 1ull << card;
+        return string{RANKS[card >> 2], SUITS[card & 3]};
+    };
+
+    vector<string> ranges;
+    string board;
+    ranges.push_back(dealCard() + dealCard());
+    if (i % 3 == 2)
+        ranges.push_back("22+,A2s+,K9s+,Q9s+,J9s+,T9s,ATo+,KTo+,QTo+,JTo");
+    else
+        ranges.push_back(dealCard() + dealCard());
+    for (unsigned j = 0; j < (i % 3 == 0 ? 3u : 4u); ++j)
+        board += dealCard();
+
+    MessageWriter writer;
+    writer.put(options.deadline);
+    writer.put(1e-3);
+    writer.put(CardRange::getCardMask(board));
+    writer.put((uint64_t)0);
+    writer.put((uint8_t)options.enumerate);
+    writer.put((uint8_t)ranges.size());
+    for (auto& range : ranges)
+        writer.putString(range);
+    return writer.data();
+}
+
+static void runConnection(unsigned connectionIdx, const Options& options, Stats& stats, mutex& statsMutex)
+{
+    int fd = connectToServer(options.socketPath);
+    XoroShiro128Plus rng(connectionIdx);
+    unordered_map<uint64_t,Clock::time_point> sendTimes;
+    Stats local;
+    unsigned sent = 0, received = 0;
+    while (received < options.queries) {
+        // Keep the window full.
+        while (sent < options.queries && sent - received < options.window) {
+            MessageHeader header = {0, QUERY, sent, 0, 0};
+            sendTimes[sent] = Clock::now();
+            if (!sendMessage(fd, header, makeQuery(sent, rng, options)))
+                break;
+            if (options.cancelEvery && sent % options.cancelEvery == 0) {
+                header.type = CANCEL;
+                sendMessage(fd, header, {});
+            }
+            ++sent;
+        }
+
+        MessageHeader header;
+        vector<char> payload;
+        if (!receiveMessage(fd, header, payload)) {
+            cerr << "Connection " << connectionIdx << " lost" << endl;
+            local.errors += options.queries - received;
+            break;
+        }
+        ++received;
+        local.latencies.push_back(chrono::duration<double>(Clock::now() - sendTimes[header.id]).count());
+        sendTimes.erase(header.id);
+        if (header.status < 4)
+            ++local.statusCounts[header.status];
+        else
+            ++local.errors;
+
+        if (options.verbose) {
+            MessageReader reader(payload);
+            uint8_t players = 0;
+            reader.get(players);
+            lock_guard<mutex> lock(statsMutex);
+            cout << connectionIdx << "/" << header.id << " status " << header.status << " equity";
+            for (unsigned i = 0; i < players; ++i) {
+                double equity = 0;
+                reader.get(equity);
+                cout << " " << equity;
+            }
+            cout << endl;
+        }
+    }
+    close(fd);
+
+    lock_guard<mutex> lock(statsMutex);
+    stats.latencies.insert(stats.latencies.end(), local.latencies.begin(), local.latencies.end());
+    for (unsigned i = 0; i < 4; ++i)
+        stats.statusCounts[i] += local.statusCounts[i];
+    stats.errors += local.errors;
+}
+
+static double percentile(vector<double>& v, double p)
+{
+    if (v.empty())
+        return 0;
+    size_t idx = min(v.size() - 1, (size_t)(p * v.size()));
+    nth_element(v.begin(), v.begin() + idx, v.end());
+    return v[idx];
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        string arg = argv[i];
+        if (arg == "--socket")
+            options.socketPath = argv[i + 1];
+        else if (arg == "--connections")
+            options.connections = stoul(argv[i + 1]);
+        else if (arg == "--queries")
+            options.queries = stoul(argv[i + 1]);
+        else if (arg == "--window")
+            options.window = max(stoul(argv[i + 1]), 1ul);
+        else if (arg == "--deadline")
+            options.deadline = stod(argv[i + 1]);
+        else if (arg == "--cancel-every")
+            options.cancelEvery = stoul(argv[i + 1]);
+        else if (arg == "--enumerate")
+            options.enumerate = stoul(argv[i + 1]) != 0;
+        else if (arg == "--verbose")
+            options.verbose = stoul(argv[i + 1]) != 0;
+    }
+
+    Stats stats;
+    mutex statsMutex;
+    auto t1 = Clock::now();
+    vector<thread> threads;
+    for (unsigned i = 0; i < options.connections; ++i)
+        threads.emplace_back(runConnection, i, cref(options), ref(stats), ref(statsMutex));
+    for (auto& t : threads)
+        t.join();
+    double time = chrono::duration<double>(Clock::now() - t1).count();
+
+    cout << stats.latencies.size() << " results in " << time << "s (" << stats.latencies.size() / time
+         << " queries/s)" << endl;
+    cout << "latency p50 " << 1e3 * percentile(stats.latencies, 0.5) << "ms  p99 "
+         << 1e3 * percentile(stats.latencies, 0.99) << "ms  max " << 1e3 * percentile(stats.latencies, 1) << "ms"
+         << endl;
+    cout << "ok " << stats.statusCounts[OK] << "  invalid " << stats.statusCounts[INVALID] << "  cancelled "
+         << stats.statusCounts[CANCELLED] << "  deadline exceeded " << stats.statusCounts[DEADLINE_EXCEEDED]
+         << "  errors " << stats.errors << endl;
+    return stats.errors > 0;
+}
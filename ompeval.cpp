@@ -0,0 +1,389 @@
+// Command line tool for batch equity calculations. Reads one JSON query per line from a file or stdin and writes one
+// JSON result per line to stdout. Queries are run in parallel by a pool of worker threads, each of which does one
+// single-threaded calculation at a time. Results are written in input order (default) or in completion order.
+//
+// Usage: ompeval [--threads n] [--order input|completion] [file]
+//
+// Query fields:
+//   ranges    array of hand ranges, one per player (required)
+//   board     board cards, e.g. "Ah7c2d"
+//   dead      dead cards
+//   mode      "enumerate" or "montecarlo" (default)
+//   accuracy  standard deviation target for monte carlo, must be positive (default 5e-5)
+//   id        any JSON value, copied to the result
+//
+// Example:
+//   {"id": 1, "ranges": ["AK", "QQ+"], "board": "Qh7h2c", "mode": "enumerate"}
+// gives
+//   {"id": 1, "equity": [0.0924242, 0.907576], "hands": 142560, "stdev": 0, "time": 0.000584935}
+
+#include "omp/EquityCalculator.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <string>
+#include <vector>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+using namespace std;
+using namespace omp;
+
+// Minimal JSON reader for the query objects.
+class JsonReader
+{
+public:
+    JsonReader(const string& text)
+        : mText(text), mPos(0)
+    {
+    }
+
+    bool readString(string& s)
+    {
+        skipSpace();
+        if (!consume('"'))
+            return false;
+        s.clear();
+        while (mPos < mText.size() && mText[mPos] != '"') {
+            char c = mText[mPos++];
+            if (c == '\\') {
+                if (mPos >= mText.size())
+                    return false;
+                c = mText[mPos++];
+                switch (c) {
+                case 'n': c = '\n'; break;
+                case 't': c = '\t'; break;
+                case 'r': c = '\r'; break;
+                case 'b': c = '\b'; break;
+                case 'f': c = '\f'; break;
+                case 'u':
+                    // Only ASCII is meaningful in card ranges.
+                    if (mPos + 4 > mText.size())
+                        return false;
+                    c = (char)strtoul(mText.substr(mPos, 4).c_str(), nullptr, 16);
+                    mPos += 4;
+                    break;
+                }
+            }
+            s += c;
+        }
+        return consume('"');
+    }
+
+    bool readNumber(double& x)
+    {
+        skipSpace();
+        const char* begin = mText.c_str() + mPos;
+        char* end;
+        x = strtod(begin, &end);
+        mPos += end - begin;
+        return end != begin;
+    }
+
+    bool readStringArray(vector<string>& v)
+    {
+        skipSpace();
+        if (!consume('['))
+            return false;
+        v.clear();
+        skipSpace();
+        if (consume(']'))
+            return true;
+        do {
+            string s;
+            if (!readString(s))
+                return false;
+            v.push_back(s);
+            skipSpace();
+        } while (consume(','));
+        return consume(']');
+    }
+
+    // Skips any value and returns its text.
+    bool readRaw(string& raw)
+    {
+        skipSpace();
+        size_t begin = mPos;
+        if (!skipValue())
+            return false;
+        raw = mText.substr(begin, mPos - begin);
+        return true;
+    }
+
+    // Calls readField(key) for each key of an object. The callback reads the value.
+    template<class T>
+    bool readObject(T readField)
+    {
+        skipSpace();
+        if (!consume('{'))
+            return false;
+        skipSpace();
+        if (consume('}'))
+            return true;
+        do {
+            string key;
+            if (!readString(key))
+                return false;
+            skipSpace();
+            if (!consume(':') || !readField(key))
+                return false;
+            skipSpace();
+        } while (consume(','));
+        return consume('}');
+    }
+
+    bool atEnd()
+    {
+        skipSpace();
+        return mPos == mText.size();
+    }
+
+private:
+    bool skipValue()
+    {
+        skipSpace();
+        if (mPos >= mText.size())
+            return false;
+        char c = mText[mPos];
+        string s;
+        double x;
+        if (c == '"')
+            return readString(s);
+        if (c == '{')
+            return readObject([&](const string&){ return skipValue(); });
+        if (c == '[') {
+            ++mPos;
+            skipSpace();
+            if (consume(']'))
+                return true;
+            do {
+                if (!skipValue())
+                    return false;
+                skipSpace();
+            } while (consume(','));
+            return consume(']');
+        }
+        for (const char* word : {"true", "false", "null"}) {
+            if (mText.compare(mPos, strlen(word), word) == 0) {
+                mPos += strlen(word);
+                return true;
+            }
+        }
+        return readNumber(x);
+    }
+
+    void skipSpace()
+    {
+        while (mPos < mText.size() && isspace((unsigned char)mText[mPos]))
+            ++mPos;
+    }
+
+    bool consume(char c)
+    {
+        if (mPos < mText.size() && mText[mPos] == c) {
+            ++mPos;
+            return true;
+        }
+        return false;
+    }
+
+    const string& mText;
+    size_t mPos;
+};
+
+struct Query
+{
+    string id;
+    vector<string> ranges;
+    string board, dead;
+    bool enumerate = false;
+    double accuracy = 5e-5;
+};
+
+static bool parseQuery(const string& line, Query& q, string& error)
+{
+    JsonReader reader(line);
+    bool ok = reader.readObject([&](const string& key){
+        if (key == "id")
+            return reader.readRaw(q.id);
+        if (key == "ranges")
+            return reader.readStringArray(q.ranges);
+        if (key == "board")
+            return reader.readString(q.board);
+        if (key == "dead")
+            return reader.readString(q.dead);
+        if (key == "accuracy")
+            return reader.readNumber(q.accuracy);
+        if (key == "mode") {
+            string mode;
+            if (!reader.readString(mode))
+                return false;
+            if (mode != "enumerate" && mode != "montecarlo") {
+                error = "unknown mode";
+                return false;
+            }
+            q.enumerate = mode == "enumerate";
+            return true;
+        }
+        string ignored;
+        return reader.readRaw(ignored);
+    });
+    if (!ok || !reader.atEnd()) {
+        if (error.empty())
+            error = "invalid JSON";
+        return false;
+    }
+    if (q.ranges.empty()) {
+        error = "no ranges";
+        return false;
+    }
+    // Monte carlo would never reach the target and never return.
+    if (!q.enumerate && !(q.accuracy > 0)) {
+        error = "accuracy must be positive";
+        return false;
+    }
+    return true;
+}
+
+// Runs one query and formats the result line. Monte carlo checks the accuracy on every update, so updates are frequent.
+static string runQuery(EquityCalculator& eq, const string& line)
+{
+    Query q;
+    string error;
+    ostringstream os;
+    os.precision(6);
+    if (parseQuery(line, q, error)) {
+        vector<CardRange> ranges(q.ranges.begin(), q.ranges.end());
+        if (eq.start(ranges, CardRange::getCardMask(q.board), CardRange::getCardMask(q.dead), q.enumerate,
+                     q.accuracy, nullptr, 0.01, 1)) {
+            eq.wait();
+            auto r = eq.getResults();
+            os << "{";
+            if (!q.id.empty())
+                os << "\"id\": " << q.id << ", ";
+            os << "\"equity\": [";
+            for (unsigned i = 0; i < r.players; ++i)
+                os << (i ? ", " : "") << r.equity[i];
+            os << "], \"hands\": " << r.hands << ", \"stdev\": " << (q.enumerate ? 0 : r.stdev) << ", \"time\": "
+               << r.time << "}";
+            return os.str();
+        }
+        error = "invalid ranges or cards";
+    }
+    os << "{";
+    if (!q.id.empty())
+        os << "\"id\": " << q.id << ", ";
+    os << "\"error\": \"" << error << "\"}";
+    return os.str();
+}
+
+// Worker pool that reads queries from a shared input stream and writes the results in the requested order.
+class BatchRunner
+{
+public:
+    BatchRunner(istream& in, ostream& out, bool inputOrder)
+        : mIn(in), mOut(out), mInputOrder(inputOrder)
+    {
+    }
+
+    // Runs all queries and returns when the results have been written.
+    void run(unsigned threads)
+    {
+        mMaxPending = 64 * threads;
+        vector<thread> workers;
+        for (unsigned i = 0; i < threads; ++i)
+            workers.emplace_back(&BatchRunner::work, this);
+        for (auto& t : workers)
+            t.join();
+        mOut.flush();
+    }
+
+private:
+    void work()
+    {
+        EquityCalculator eq;
+        for (;;) {
+            string line;
+            uint64_t seq;
+            {
+                // In input order a slow query holds back the output, so limit how far ahead the others can go.
+                unique_lock<mutex> lock(mMutex);
+                mReadable.wait(lock, [&]{ return !mInputOrder || mNextRead < mNextWrite + mMaxPending; });
+                do {
+                    if (!getline(mIn, line))
+                        return;
+                } while (line.find_first_not_of(" \t\r") == string::npos);
+                seq = mNextRead++;
+            }
+
+            string result = runQuery(eq, line);
+
+            lock_guard<mutex> lock(mMutex);
+            if (!mInputOrder) {
+                mOut << result << '\n';
+                continue;
+            }
+            mPending[seq] = move(result);
+            while (!mPending.empty() && mPending.begin()->first == mNextWrite) {
+                mOut << mPending.begin()->second << '\n';
+                mPending.erase(mPending.begin());
+                ++mNextWrite;
+            }
+            mReadable.notify_all();
+        }
+    }
+
+    istream& mIn;
+    ostream& mOut;
+    bool mInputOrder;
+    uint64_t mMaxPending = 0;
+    mutex mMutex;
+    condition_variable mReadable;
+    uint64_t mNextRead = 0, mNextWrite = 0;
+    map<uint64_t,string> mPending;
+};
+
+int main(int argc, char** argv)
+{
+    unsigned threads = thread::hardware_concurrency();
+    bool inputOrder = true;
+    string inFile;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc) {
+            threads = stoul(argv[++i]);
+        } else if (arg == "--order" && i + 1 < argc) {
+            string order = argv[++i];
+            if (order != "input" && order != "completion") {
+                cerr << "Unknown order: " << order << endl;
+                return 1;
+            }
+            inputOrder = order == "input";
+        } else if (arg[0] == '-' && arg != "-") {
+            cerr << "Usage: ompeval [--threads n] [--order input|completion] [file]" << endl;
+            return 1;
+        } else {
+            inFile = arg;
+        }
+    }
+
+    ifstream file;
+    if (!inFile.empty() && inFile != "-") {
+        file.open(inFile);
+        if (!file) {
+            cerr << "Can't open " << inFile << endl;
+            return 1;
+        }
+    }
+
+    // Results are written through the stream buffer, which is flushed only when full and at the end.
+    ios::sync_with_stdio(false);
+    cin.tie(nullptr);
+    BatchRunner runner(file.is_open() ? file : cin, cout, inputOrder);
+    runner.run(max(threads, 1u));
+}
@@ -0,0 +1,320 @@
+// Long-running equity server. Listens on a Unix domain socket and calculates the queries of all connected clients
+// (see ompserver.h for the protocol) with a fixed pool of worker threads, so that the evaluator tables, the parsed
+// range cache and the workers stay warm between queries. Each worker runs one single-threaded calculation at a time.
+// Clients are served round-robin, so a client with a long queue doesn't starve the others. Queries can be cancelled
+// and can have a deadline, after which they return the results calculated so far.
+//
+// Usage: ompserver [--socket path] [--threads n]
+
+#include "ompserver.h"
+#include "omp/EquityCalculator.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <csignal>
+#include <cerrno>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <atomic>
+
+using namespace std;
+using namespace omp;
+using namespace ompserver;
+
+typedef chrono::steady_clock Clock;
+
+struct Connection;
+
+struct Job
+{
+    uint64_t id;
+    shared_ptr<Connection> connection;
+    vector<string> ranges;
+    uint64_t board, dead;
+    bool enumerate;
+    double accuracy;
+    bool hasDeadline;
+    Clock::time_point deadline;
+    atomic<bool> cancelled{false};
+    EquityCalculator* calculator = nullptr; // While running.
+};
+
+struct Connection
+{
+    Connection(int fd)
+        : fd(fd)
+    {
+    }
+
+    ~Connection()
+    {
+        close(fd);
+    }
+
+    int fd;
+    mutex writeMutex;
+    deque<shared_ptr<Job>> queue; // Protected by server mutex.
+    bool closed = false;
+};
+
+class Server
+{
+public:
+    Server(unsigned threads)
+    {
+        for (unsigned i = 0; i < threads; ++i)
+            mWorkers.emplace_back(&Server::work, this);
+    }
+
+    // Accepts connections forever. Returns only on error.
+    void serve(const string& socketPath)
+    {
+        int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        if (listenFd < 0 || socketPath.size() >= sizeof(addr.sun_path)) {
+            cerr << "Invalid socket " << socketPath << endl;
+            return;
+        }
+        strcpy(addr.sun_path, socketPath.c_str());
+        unlink(socketPath.c_str());
+        if (bind(listenFd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(listenFd, 64) < 0) {
+            cerr << "Can't listen on " << socketPath << ": " << strerror(errno) << endl;
+            return;
+        }
+        cout << "Listening on " << socketPath << " with " << mWorkers.size() << " workers" << endl;
+        for (;;) {
+            int fd = accept(listenFd, nullptr, nullptr);
+            if (fd < 0) {
+                if (errno == EINTR)
+                    continue;
+                cerr << "accept: " << strerror(errno) << endl;
+                return;
+            }
+            thread(&Server::readConnection, this, make_shared<Connection>(fd)).detach();
+        }
+    }
+
+private:
+    static const size_t MAX_RANGE_CACHE_SIZE = 10000;
+
+    // Reads the messages of one client until it disconnects.
+    void readConnection(shared_ptr<Connection> connection)
+    {
+        MessageHeader header;
+        vector<char> payload;
+        while (receiveMessage(connection->fd, header, payload)) {
+            if (header.type == QUERY) {
+                auto job = make_shared<Job>();
+                job->id = header.id;
+                job->connection = connection;
+                if (!parseQuery(payload, *job)) {
+                    respond(*job, INVALID, nullptr);
+                    continue;
+                }
+                enqueue(job);
+            } else if (header.type == CANCEL) {
+                cancel(*connection, header.id);
+            }
+        }
+
+        // Drop the queued queries and stop the running ones.
+        lock_guard<mutex> lock(mMutex);
+        connection->closed = true;
+        connection->queue.clear();
+        mReady.remove(connection);
+        for (auto& job : mRunning) {
+            if (job->connection == connection)
+                stopJob(*job);
+        }
+    }
+
+    static bool parseQuery(const vector<char>& payload, Job& job)
+    {
+        MessageReader reader(payload);
+        double deadline;
+        uint8_t enumerate, players;
+        if (!reader.get(deadline) || !reader.get(job.accuracy) || !reader.get(job.board) || !reader.get(job.dead)
+                || !reader.get(enumerate) || !reader.get(players))
+            return false;
+        job.enumerate = enumerate != 0;
+        job.hasDeadline = deadline > 0;
+        job.deadline = Clock::now() + chrono::duration_cast<Clock::duration>(chrono::duration<double>(deadline));
+        job.ranges.resize(players);
+        for (auto& range : job.ranges) {
+            if (!reader.getString(range))
+                return false;
+        }
+        return true;
+    }
+
+    void enqueue(const shared_ptr<Job>& job)
+    {
+        lock_guard<mutex> lock(mMutex);
+        Connection& connection = *job->connection;
+        if (connection.queue.empty())
+            mReady.push_back(job->connection);
+        connection.queue.push_back(job);
+        mJobAvailable.notify_one();
+    }
+
+    // Takes the first job of the next client in turn.
+    shared_ptr<Job> nextJob()
+    {
+        unique_lock<mutex> lock(mMutex);
+        mJobAvailable.wait(lock, [&]{ return !mReady.empty(); });
+        shared_ptr<Connection> connection = mReady.front();
+        mReady.pop_front();
+        shared_ptr<Job> job = connection->queue.front();
+        connection->queue.pop_front();
+        if (!connection->queue.empty())
+            mReady.push_back(connection);
+        mRunning.push_back(job);
+        return job;
+    }
+
+    void cancel(Connection& connection, uint64_t id)
+    {
+        unique_lock<mutex> lock(mMutex);
+        auto it = find_if(connection.queue.begin(), connection.queue.end(),
+                          [&](const shared_ptr<Job>& job){ return job->id == id; });
+        if (it != connection.queue.end()) {
+            shared_ptr<Job> job = *it;
+            connection.queue.erase(it);
+            if (connection.queue.empty())
+                mReady.remove(job->connection);
+            lock.unlock();
+            respond(*job, CANCELLED, nullptr);
+            return;
+        }
+        for (auto& job : mRunning) {
+            if (job->connection.get() == &connection && job->id == id)
+                stopJob(*job);
+        }
+    }
+
+    // Must hold mMutex. If the calculation hasn't been started yet, the worker sees the flag after starting it.
+    static void stopJob(Job& job)
+    {
+        job.cancelled = true;
+        if (job.calculator)
+            job.calculator->stop();
+    }
+
+    void work()
+    {
+        EquityCalculator eq;
+        for (;;) {
+            shared_ptr<Job> job = nextJob();
+            Status status = OK;
+            EquityCalculator::Results results;
+            if (job->cancelled) {
+                status = CANCELLED;
+            } else if (job->hasDeadline && Clock::now() >= job->deadline) {
+                status = DEADLINE_EXCEEDED;
+            } else {
+                vector<CardRange> ranges = getRanges(job->ranges);
+                if (job->hasDeadline)
+                    eq.setDeadline(job->deadline);
+                else
+                    eq.setDeadline();
+                {
+                    lock_guard<mutex> lock(mMutex);
+                    job->calculator = &eq;
+                }
+                if (eq.start(ranges, job->board, job->dead, job->enumerate, job->accuracy, nullptr, 0.01, 1)) {
+                    if (job->cancelled)
+                        eq.stop();
+                    eq.wait();
+                    results = eq.getResults();
+                    if (job->cancelled)
+                        status = CANCELLED;
+                    else if (job->hasDeadline && results.interrupted)
+                        status = DEADLINE_EXCEEDED;
+                } else {
+                    status = INVALID;
+                }
+            }
+
+            {
+                lock_guard<mutex> lock(mMutex);
+                job->calculator = nullptr;
+                mRunning.erase(find(mRunning.begin(), mRunning.end(), job));
+            }
+            respond(*job, status, results.players > 0 ? &results : nullptr);
+        }
+    }
+
+    // Parsing big ranges takes a while, so parsed ranges are cached by their text.
+    vector<CardRange> getRanges(const vector<string>& texts)
+    {
+        vector<CardRange> ranges;
+        for (auto& text : texts) {
+            {
+                lock_guard<mutex> lock(mMutex);
+                auto it = mRangeCache.find(text);
+                if (it != mRangeCache.end()) {
+                    ranges.push_back(it->second);
+                    continue;
+                }
+            }
+            ranges.emplace_back(text);
+            lock_guard<mutex> lock(mMutex);
+            if (mRangeCache.size() >= MAX_RANGE_CACHE_SIZE)
+                mRangeCache.clear();
+            mRangeCache.emplace(text, ranges.back());
+        }
+        return ranges;
+    }
+
+    static void respond(Job& job, Status status, const EquityCalculator::Results* results)
+    {
+        MessageWriter writer;
+        if (results) {
+            writer.put((uint8_t)results->players);
+            for (unsigned i = 0; i < results->players; ++i)
+                writer.put(results->equity[i]);
+            writer.put(results->hands);
+            writer.put(results->stdev);
+            writer.put(results->time);
+        }
+        MessageHeader header = {0, RESULT, job.id, status, 0};
+        // Errors mean that the client has disconnected, which the reader thread will notice.
+        lock_guard<mutex> lock(job.connection->writeMutex);
+        sendMessage(job.connection->fd, header, writer.data());
+    }
+
+    mutex mMutex;
+    condition_variable mJobAvailable;
+    list<shared_ptr<Connection>> mReady; // Clients with queued jobs in round-robin order.
+    vector<shared_ptr<Job>> mRunning;
+    unordered_map<string,CardRange> mRangeCache;
+    vector<thread> mWorkers;
+};
+
+int main(int argc, char** argv)
+{
+    string socketPath = DEFAULT_SOCKET;
+    unsigned threads = thread::hardware_concurrency();
+    for (int i = 1; i + 1 < argc; i += 2) {
+        string arg = argv[i];
+        if (arg == "--socket")
+            socketPath = argv[i + 1];
+        else if (arg == "--threads")
+            threads = stoul(argv[i + 1]);
+    }
+
+    // Writing to a disconnected client must not kill the server.
+    signal(SIGPIPE, SIG_IGN);
+    Server server(max(threads, 1u));
+    server.serve(socketPath);
+    return 1;
+}
@@ -0,0 +1,154 @@
+// Binary protocol between ompserver and its clients. Every message is a header followed by size bytes of payload.
+// Values are in native byte order, since the server only listens on a local socket.
+//
+// QUERY payload:  double deadline (seconds after receiving, 0 for none), double accuracy (monte carlo stdev target),
+//                 uint64 board, uint64 dead, uint8 enumerate, uint8 players, and for each player uint16 length + range.
+// CANCEL payload: none. Header id is the id of the query to cancel. A cancelled query still gets its RESULT.
+// RESULT payload: uint8 players, double equity[players], uint64 hands, double stdev, double time. Empty if the query
+//                 was invalid or was cancelled/expired before it started.
+
+#ifndef OMPSERVER_H
+#define OMPSERVER_H
+
+#include <unistd.h>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cstddef>
+#include <cstdint>
+
+namespace ompserver {
+
+static const char* const DEFAULT_SOCKET = "/tmp/ompserver.sock";
+static const uint32_t MAX_MESSAGE_SIZE = 1 << 16;
+
+enum MessageType : uint32_t
+{
+    QUERY = 1,
+    CANCEL = 2,
+    RESULT = 3
+};
+
+enum Status : uint32_t
+{
+    OK = 0,
+    INVALID = 1,
+    CANCELLED = 2,
+    DEADLINE_EXCEEDED = 3
+};
+
+struct MessageHeader
+{
+    uint32_t size;
+    uint32_t type;
+    uint64_t id; // Chosen by the client, unique within a connection.
+    uint32_t status; // Results only.
+    uint32_t reserved;
+};
+
+// Appends values to a message payload.
+class MessageWriter
+{
+public:
+    template<class T>
+    void put(const T& x)
+    {
+        const char* p = (const char*)&x;
+        mData.insert(mData.end(), p, p + sizeof(T));
+    }
+
+    void putString(const std::string& s)
+    {
+        put((uint16_t)s.size());
+        mData.insert(mData.end(), s.begin(), s.end());
+    }
+
+    const std::vector<char>& data() const
+    {
+        return mData;
+    }
+
+private:
+    std::vector<char> mData;
+};
+
+// Reads values from a message payload. Returns false if there's not enough data left.
+class MessageReader
+{
+public:
+    MessageReader(const std::vector<char>& data)
+        : mPos(data.data()), mEnd(data.data() + data.size())
+    {
+    }
+
+    template<class T>
+    bool get(T& x)
+    {
+        if (mEnd - mPos < (std::ptrdiff_t)sizeof(T))
+            return false;
+        std::memcpy(&x, mPos, sizeof(T));
+        mPos += sizeof(T);
+        return true;
+    }
+
+    bool getString(std::string& s)
+    {
+        uint16_t len;
+        if (!get(len) || mEnd - mPos < len)
+            return false;
+        s.assign(mPos, len);
+        mPos += len;
+        return true;
+    }
+
+private:
+    const char* mPos;
+    const char* mEnd;
+};
+
+inline bool readFully(int fd, void* buffer, size_t size)
+{
+    char* p = (char*)buffer;
+    while (size > 0) {
+        ssize_t n = read(fd, p, size);
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+inline bool writeFully(int fd, const void* buffer, size_t size)
+{
+    const char* p = (const char*)buffer;
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+// Sends header and payload with a single write when possible. Concurrent senders must be serialized by the caller.
+inline bool sendMessage(int fd, MessageHeader header, const std::vector<char>& payload)
+{
+    header.size = (uint32_t)payload.size();
+    std::vector<char> message((const char*)&header, (const char*)&header + sizeof(header));
+    message.insert(message.end(), payload.begin(), payload.end());
+    return writeFully(fd, message.data(), message.size());
+}
+
+inline bool receiveMessage(int fd, MessageHeader& header, std::vector<char>& payload)
+{
+    if (!readFully(fd, &header, sizeof(header)) || header.size > MAX_MESSAGE_SIZE)
+        return false;
+    payload.resize(header.size);
+    return readFully(fd, payload.data(), payload.size());
+}
+
+}
+
+#endif // OMPSERVER_H
@@ -0,0 +1,188 @@
+// Splits an exact enumeration into slices of the preflop index space (see EquityCalculator::setEnumerationRange()),
+// calculates each slice in a separate child process and merges the results. Children send the raw counts of their
+// slice back through a pipe. With --verify 1 the same enumeration is also done in a single process and the equities
+// are compared bit for bit.
+//
+// Usage: ompshard [--shards n] [--threads n] [--board cards] [--dead cards] [--verify 1] range1 range2 ...
+//
+// Example: ompshard --shards 4 --board 2c3c8h random AA KQs
+
+#include "omp/EquityCalculator.h"
+#include <sys/wait.h>
+#include <unistd.h>
+#include <iostream>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+using namespace omp;
+
+struct Options
+{
+    unsigned shards = 4;
+    unsigned threads = 1;
+    uint64_t board = 0, dead = 0;
+    bool verify = false;
+    vector<CardRange> ranges;
+};
+
+static bool writeFully(int fd, const void* buffer, size_t size)
+{
+    const char* p = (const char*)buffer;
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool readFully(int fd, void* buffer, size_t size)
+{
+    char* p = (char*)buffer;
+    while (size > 0) {
+        ssize_t n = read(fd, p, size);
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+// Only the counts are sent. Wins, ties and equities are recalculated from them when merging.
+static bool sendCounts(int fd, const EquityCalculator::Results& r)
+{
+    vector<uint64_t> data{r.players, r.hands, r.evaluations, r.skippedPreflopCombos, r.evaluatedPreflopCombos,
+                          r.lookupHits, r.preflopCombos};
+    data.insert(data.end(), r.winsByPlayerMask.begin(), r.winsByPlayerMask.end());
+    return writeFully(fd, &r.time, sizeof(r.time)) && writeFully(fd, data.data(), data.size() * sizeof(uint64_t));
+}
+
+static bool receiveCounts(int fd, EquityCalculator::Results& r)
+{
+    uint64_t header[7];
+    if (!readFully(fd, &r.time, sizeof(r.time)) || !readFully(fd, header, sizeof(header))
+            || header[0] == 0 || header[0] > MAX_PLAYERS)
+        return false;
+    r.players = (unsigned)header[0];
+    r.hands = header[1];
+    r.evaluations = header[2];
+    r.skippedPreflopCombos = header[3];
+    r.evaluatedPreflopCombos = header[4];
+    r.lookupHits = header[5];
+    r.preflopCombos = header[6];
+    r.enumerateAll = true;
+    r.finished = true;
+    r.winsByPlayerMask.resize(1u << r.players);
+    return readFully(fd, r.winsByPlayerMask.data(), r.winsByPlayerMask.size() * sizeof(uint64_t));
+}
+
+static EquityCalculator::Results enumerate(const Options& options, uint64_t begin, uint64_t end)
+{
+    EquityCalculator eq;
+    eq.setEnumerationRange(begin, end);
+    if (!eq.start(options.ranges, options.board, options.dead, true, 0, nullptr, 0.2, options.threads)) {
+        cerr << "Invalid ranges or board" << endl;
+        exit(1);
+    }
+    eq.wait();
+    return eq.getResults();
+}
+
+static void printResults(const string& title, const EquityCalculator::Results& r)
+{
+    cout << title << ":";
+    for (unsigned i = 0; i < r.players; ++i)
+        cout << " " << r.equity[i];
+    cout << "  hands " << r.hands << "  time " << r.time << "s" << endl;
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg.compare(0, 2, "--") == 0 && i + 1 < argc) {
+            string value = argv[++i];
+            if (arg == "--shards")
+                options.shards = max((unsigned)stoul(value), 1u);
+            else if (arg == "--threads")
+                options.threads = stoul(value);
+            else if (arg == "--board")
+                options.board = CardRange::getCardMask(value);
+            else if (arg == "--dead")
+                options.dead = CardRange::getCardMask(value);
+            else if (arg == "--verify")
+                options.verify = stoul(value) != 0;
+        } else {
+            options.ranges.emplace_back(arg);
+        }
+    }
+    if (options.ranges.size() < 2) {
+        cerr << "Usage: ompshard [--shards n] [--threads n] [--board cards] [--dead cards] [--verify 1] "
+             << "range1 range2 ..." << endl;
+        return 1;
+    }
+
+    // Empty slice finishes right away and tells the size of the index space.
+    uint64_t preflopCombos = enumerate(options, 0, 0).preflopCombos;
+    cout << preflopCombos << " preflop combos in " << options.shards << " shards" << endl;
+
+    vector<pid_t> children;
+    vector<int> pipes;
+    for (unsigned i = 0; i < options.shards; ++i) {
+        uint64_t begin = preflopCombos * i / options.shards, end = preflopCombos * (i + 1) / options.shards;
+        int fds[2];
+        if (pipe(fds) < 0) {
+            cerr << "pipe: " << strerror(errno) << endl;
+            return 1;
+        }
+        pid_t pid = fork();
+        if (pid < 0) {
+            cerr << "fork: " << strerror(errno) << endl;
+            return 1;
+        }
+        if (pid == 0) {
+            close(fds[0]);
+            bool ok = sendCounts(fds[1], enumerate(options, begin, end));
+            _exit(ok ? 0 : 1);
+        }
+        close(fds[1]);
+        children.push_back(pid);
+        pipes.push_back(fds[0]);
+    }
+
+    EquityCalculator::Results merged;
+    bool ok = true;
+    for (unsigned i = 0; i < options.shards; ++i) {
+        EquityCalculator::Results shard;
+        if (receiveCounts(pipes[i], shard))
+            merged.merge(shard);
+        else
+            ok = false;
+        close(pipes[i]);
+        int status;
+        waitpid(children[i], &status, 0);
+        ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+    if (!ok) {
+        cerr << "Shard failed" << endl;
+        return 1;
+    }
+    printResults("merged", merged);
+
+    if (options.verify) {
+        EquityCalculator::Results single = enumerate(options, 0, ~0ull);
+        printResults("single", single);
+        bool identical = single.winsByPlayerMask == merged.winsByPlayerMask && single.hands == merged.hands;
+        for (unsigned i = 0; i < single.players; ++i)
+            identical = identical && memcmp(&single.equity[i], &merged.equity[i], sizeof(double)) == 0;
+        cout << (identical ? "identical" : "MISMATCH") << endl;
+        return identical ? 0 : 1;
+    }
+}
@@ -1,6 +1,9 @@
 
 #include "omp/HandEvaluator.h"
 #include "omp/EquityCalculator.h"
+#include "omp/EquitySession.h"
+#include "omp/EquityCache.h"
+#include "omp/EquityPool.h"
 #include "omp/Random.h"
 #include "ttest/ttest.h"
 #include <iostream>
@@ -8,6 +11,9 @@
 #include <unordered_map>
 #include <vector>
 #include <list>
+#include <sstream>
+#include <fstream>
+#include <iterator>
 #include <numeric>
 #include <cmath>
 
@@ -307,6 +313,21 @@ class EquityCalculatorTest : public ttest::TestBase
     {
         eq.setTimeLimit(0);
         eq.setHandLimit(0);
+        eq.setHistogramBins(0);
+        eq.setRunoutBreakdown(false);
+        eq.setHandCategories(false);
+        eq.setBatchSize(0);
+        eq.setTracer(nullptr);
+        eq.setCheckpoint("");
+        eq.setEnumerationRange();
+        eq.setDeadline();
+    }
+
+    // Checks that histogram is normalized and has all the mass in one bin.
+    void checkHistogram(const vector<double>& histogram, unsigned expectedBin)
+    {
+        TTEST_EQUAL(std::abs(accumulate(histogram.begin(), histogram.end(), 0.0) - 1) < 1e-6, true);
+        TTEST_EQUAL(histogram[expectedBin] > 0.999, true);
     }
 
     TTEST_CASE("start() returns false when too many board cards")
@@ -316,7 +337,95 @@ class EquityCalculatorTest : public ttest::TestBase
 
     TTEST_CASE("start() returns false when too many players")
     {
-        TTEST_EQUAL(eq.start({"AA", "KK", "QQ", "JJ", "TT", "99", "88"}), false);
+        TTEST_EQUAL(eq.start({"AA", "KK", "QQ", "JJ", "TT", "99", "88", "77", "66", "55", "44"}), false);
+    }
+
+    TTEST_CASE("10 players")
+    {
+        // Two players with identical ranges have the same equity. Enumeration goes through the preflop lookup.
+        vector<CardRange> ranges{"AA", "AA", "KsKd", "QsQd", "JsJd", "TsTd", "9s9d", "8s8d", "7s7d", "6s6d"};
+        eq.start(ranges, 0, 0, true);
+        eq.wait();
+        auto r = eq.getResults();
+        TTEST_EQUAL(r.winsByPlayerMask.size(), 1024u);
+        TTEST_EQUAL(r.hands, 6 * 201376ull);
+        TTEST_EQUAL(std::abs(r.equity[0] - r.equity[1]) < 1e-9, true);
+        TTEST_EQUAL(std::abs(accumulate(r.equity, r.equity + 10, 0.0) - 1) < 1e-6, true);
+
+        eq.setHandLimit(2000000);
+        eq.start(vector<CardRange>(10, CardRange("random")), 0, 0, false, 0);
+        eq.wait();
+        r = eq.getResults();
+        for (unsigned i = 0; i < 10; ++i)
+            TTEST_EQUAL(std::abs(r.equity[i] - 0.1) < 0.005, true);
+    }
+
+    TTEST_CASE("batch size doesn't change results")
+    {
+        vector<CardRange> ranges{"AK", "QQ,JJ", "random"};
+        uint64_t board = CardRange::getCardMask("2c3d");
+        eq.start(ranges, board, 0, true);
+        eq.wait();
+        auto expected = eq.getResults();
+        eq.setBatchSize(1000);
+        eq.start(ranges, board, 0, true);
+        eq.wait();
+        auto r = eq.getResults();
+        TTEST_EQUAL(r.winsByPlayerMask == expected.winsByPlayerMask, true);
+        TTEST_EQUAL(r.lockWaitTime >= 0, true);
+    }
+
+    TTEST_CASE("setup and thread start times")
+    {
+        eq.start({"AhKh", "QQ"}, CardRange::getCardMask("2c3d4h5s"), 0, true);
+        eq.wait();
+        auto r = eq.getResults();
+        TTEST_EQUAL(r.setupTime > 0, true);
+        TTEST_EQUAL(r.threadStartTime > 0 && r.threadStartTime <= r.time, true);
+    }
+
+    TTEST_CASE("profiling counters")
+    {
+        eq.setHandLimit(100000);
+        eq.start({"AK", "QQ", "random"}, 0, 0, false, 0);
+        eq.wait();
+        auto mc = eq.getProfile();
+        eq.start({"AK", "QQ"}, CardRange::getCardMask("2c3d"), 0, true);
+        eq.wait();
+        auto enumeration = eq.getProfile();
+        #if OMP_PROFILE
+        TTEST_EQUAL(mc.holeCardAttempts > 0 && mc.randomWalkSkips > 0 && mc.updates > 0, true);
+        TTEST_EQUAL(enumeration.lookupHits + enumeration.lookupMisses, eq.getResults().evaluatedPreflopCombos
+                    + eq.getResults().lookupHits);
+        TTEST_EQUAL(enumeration.boardNodes[3] > 0 && enumeration.foldedSubtrees > 0, true);
+        #else
+        TTEST_EQUAL(mc.holeCardAttempts + mc.updates + enumeration.lookupHits + enumeration.boardNodes[3], 0u);
+        #endif
+    }
+
+    TTEST_CASE("tracer records calculation phases")
+    {
+        // Own calculator, since an enumeration of the same ranges as the previous one doesn't join them again.
+        EquityCalculator eq;
+        Tracer tracer;
+        eq.setTracer(&tracer);
+        eq.setBatchSize(100000);
+        eq.start({"AK", "QQ"}, CardRange::getCardMask("2c3d"), 0, true, 0, nullptr, 0.2, 2);
+        eq.wait();
+        ostringstream os;
+        tracer.write(os);
+        string trace = os.str();
+        TTEST_EQUAL(trace.compare(0, 16, "{\"traceEvents\": "), 0);
+        for (string name : {"setup", "joinRanges", "thread", "batch", "lock wait", "update"})
+            TTEST_EQUAL(trace.find("{\"name\": \"" + name + "\", \"ph\": \"B\"") != string::npos, true);
+        TTEST_EQUAL(trace.find("\"tid\": 4"), string::npos);
+        TTEST_EQUAL(tracer.droppedEvents(), 0u);
+
+        Tracer small(4);
+        eq.setTracer(&small);
+        eq.start({"AK", "QQ"}, CardRange::getCardMask("2c3d"), 0, true, 0, nullptr, 0.2, 1);
+        eq.wait();
+        TTEST_EQUAL(small.droppedEvents() > 0, true);
     }
 
     TTEST_CASE("start() returns false when too few cards left in the deck")
@@ -366,6 +475,357 @@ class EquityCalculatorTest : public ttest::TestBase
         TTEST_EQUAL(r.hands >= 3000000 && r.hands <= 3000000 + 16 * 0x1000, true);
     }
 
+    TTEST_CASE("equity histograms - enumeration")
+    {
+        eq.setHistogramBins(10);
+        eq.start({"AA", "KK"}, 0, 0, true);
+        eq.wait();
+        auto r = eq.getResults();
+        checkHistogram(r.comboEquityHistogram[0], 8);
+        checkHistogram(r.comboEquityHistogram[1], 1);
+        TTEST_EQUAL(r.flopEquityHistogram[0].size(), 10u);
+        TTEST_EQUAL(std::abs(accumulate(r.flopEquityHistogram[0].begin(), r.flopEquityHistogram[0].end(), 0.0) - 1)
+                    < 1e-6, true);
+        TTEST_EQUAL(r.flopEquityHistogram[0][0] > 0 && r.flopEquityHistogram[0][9] > 0.5, true);
+        TTEST_EQUAL(r.winsByPlayerMask[1], 50371344u);
+    }
+
+    TTEST_CASE("flop equity histogram matches separate flop enumerations")
+    {
+        vector<CardRange> ranges{"AA", "KK"};
+        uint64_t board = CardRange::getCardMask("2c");
+        eq.setHistogramBins(20);
+        eq.start(ranges, board, 0, true);
+        eq.wait();
+        auto r = eq.getResults();
+
+        vector<double> expected(20);
+        double totalHands = 0;
+        for (unsigned c1 = 0; c1 < CARD_COUNT; ++c1) {
+            for (unsigned c2 = c1 + 1; c2 < CARD_COUNT; ++c2) {
+                uint64_t flop = board | (1ull << c1) | (1ull << c2);
+                EquityCalculator eq2;
+                if (bitCount(flop) != 3 || !eq2.start(ranges, flop, 0, true, 0, nullptr, 0.2, 1))
+                    continue;
+                eq2.wait();
+                auto flopResults = eq2.getResults();
+                double equity = (flopResults.wins[0] + flopResults.ties[0]) / flopResults.hands;
+                expected[std::min((unsigned)(equity * 20), 19u)] += flopResults.hands;
+                totalHands += flopResults.hands;
+            }
+        }
+        for (unsigned i = 0; i < 20; ++i)
+            TTEST_EQUAL(std::abs(r.flopEquityHistogram[0][i] - expected[i] / totalHands) < 1e-9, true);
+    }
+
+    TTEST_CASE("equity histograms - monte carlo")
+    {
+        eq.setHistogramBins(10);
+        eq.setHandLimit(1000000);
+        eq.start({"AA", "KK"}, CardRange::getCardMask("2c3d"), 0, false, 0);
+        eq.wait();
+        auto r = eq.getResults();
+        checkHistogram(r.comboEquityHistogram[0], 8);
+        checkHistogram(r.comboEquityHistogram[1], 1);
+        TTEST_EQUAL(r.flopHistogramUnreliable, 0.0);
+        TTEST_EQUAL(std::abs(accumulate(r.flopEquityHistogram[1].begin(), r.flopEquityHistogram[1].end(), 0.0) - 1)
+                    < 1e-6, true);
+
+        // About 45 samples per flop.
+        eq.start({"AA", "KK"}, 0, 0, false, 0);
+        eq.wait();
+        r = eq.getResults();
+        TTEST_EQUAL(r.flopHistogramUnreliable > 0.99, true);
+        TTEST_EQUAL(std::abs(accumulate(r.flopEquityHistogram[1].begin(), r.flopEquityHistogram[1].end(), 0.0)
+                             + r.flopHistogramUnreliable - 1) < 1e-6, true);
+    }
+
+    TTEST_CASE("runout results")
+    {
+        vector<CardRange> ranges{"random", "AA", "33"};
+        uint64_t board = CardRange::getCardMask("2c3c8c"), dead = CardRange::getCardMask("6h");
+        eq.setRunoutBreakdown(true);
+        eq.start(ranges, board, dead, true);
+        eq.wait();
+        for (unsigned card : {1u, 27u, 51u}) {
+            auto r = eq.getRunoutResults(card);
+            EquityCalculator eq2;
+            eq2.start(ranges, board | (1ull << card), dead, true);
+            eq2.wait();
+            auto expected = eq2.getResults();
+            for (unsigned i = 0; i < 8; ++i)
+                TTEST_EQUAL(r.winsByPlayerMask[i], expected.winsByPlayerMask[i]);
+            TTEST_EQUAL(r.hands, expected.hands);
+        }
+    }
+
+    TTEST_CASE("interchangeable suits are folded in board enumeration")
+    {
+        // Hearts and diamonds are interchangeable. Runout breakdown enumerates every board separately.
+        vector<CardRange> ranges{"AsKs", "QhQd", "7h7d"};
+        eq.start(ranges, 0, CardRange::getCardMask("2h2d"), true);
+        eq.wait();
+        auto r = eq.getResults();
+        eq.setRunoutBreakdown(true);
+        eq.start(ranges, 0, CardRange::getCardMask("2h2d"), true);
+        eq.wait();
+        auto expected = eq.getResults();
+        TTEST_EQUAL(r.winsByPlayerMask == expected.winsByPlayerMask, true);
+        TTEST_EQUAL(r.hands, expected.hands);
+        TTEST_EQUAL(r.evaluations < expected.evaluations, true);
+    }
+
+    TTEST_CASE("runout equities - monte carlo")
+    {
+        vector<CardRange> ranges{"AA", "KK"};
+        uint64_t board = CardRange::getCardMask("2c3c8h");
+        eq.setRunoutBreakdown(true);
+        eq.start(ranges, board, 0, true);
+        eq.wait();
+        auto expected = eq.getResults();
+        TTEST_EQUAL(expected.runoutEquity[0][1], eq.getRunoutResults(1).equity[0]);
+
+        eq.setHandLimit(2000000);
+        eq.start(ranges, board, 0, false, 0);
+        eq.wait();
+        auto r = eq.getResults();
+        TTEST_EQUAL(r.runoutHands.size(), (size_t)CARD_COUNT);
+        for (unsigned card = 0; card < CARD_COUNT; ++card) {
+            TTEST_EQUAL(r.runoutHands[card] > 0, expected.runoutHands[card] > 0);
+            TTEST_EQUAL(std::abs(r.runoutEquity[0][card] - expected.runoutEquity[0][card]) < 0.02, true);
+        }
+    }
+
+    TTEST_CASE("hand categories")
+    {
+        vector<CardRange> ranges{"AsAd", "KsKd"};
+        uint64_t board = CardRange::getCardMask("AhKh2c3d");
+        eq.setHandCategories(true);
+        eq.start(ranges, board, 0, true);
+        eq.wait();
+        auto r = eq.getResults();
+        TTEST_EQUAL(r.hands, 44ull);
+        // Both have trips, full house with 2, 3 or the other's card, and quads with the last card of their rank.
+        vector<uint64_t> expected{0, 0, 0, 0, 36, 0, 0, 7, 1, 0}, expectedWinning{0, 0, 0, 0, 36, 0, 0, 6, 2, 0};
+        TTEST_EQUAL(r.handCategories[0] == expected, true);
+        TTEST_EQUAL(r.handCategories[1] == expected, true);
+        TTEST_EQUAL(r.winningHandCategories == expectedWinning, true);
+
+        // Preflop lookup and monte carlo.
+        ranges = {"KK,QQ", "AA", "72o"};
+        board = CardRange::getCardMask("2c3d7h");
+        for (bool enumerateAll : {true, false}) {
+            eq.setHandLimit(enumerateAll ? 0 : 1000000);
+            eq.start(ranges, board, 0, enumerateAll, 0);
+            eq.wait();
+            r = eq.getResults();
+            for (unsigned i = 0; i < 3; ++i)
+                TTEST_EQUAL(accumulate(r.handCategories[i].begin(), r.handCategories[i].end(), 0ull), r.hands);
+            TTEST_EQUAL(accumulate(r.winningHandCategories.begin(), r.winningHandCategories.end(), 0ull), r.hands);
+            // 72o always has at least two pair.
+            TTEST_EQUAL(r.handCategories[2][HIGH_CARD >> HAND_CATEGORY_SHIFT], 0ull);
+            TTEST_EQUAL(r.handCategories[2][PAIR >> HAND_CATEGORY_SHIFT], 0ull);
+        }
+    }
+
+    TTEST_CASE("resume from checkpoint")
+    {
+        vector<CardRange> ranges{"random", "AA", "KQs"};
+        uint64_t board = CardRange::getCardMask("2c3c8h");
+        eq.setHandCategories(true);
+        eq.start(ranges, board, 0, true, 0, nullptr, 0.2, 2);
+        eq.wait();
+        auto expected = eq.getResults();
+
+        // Interrupted by the hand limit, so there are batches in progress when the final checkpoint is written.
+        string file = "omp_test_checkpoint.bin";
+        eq.setCheckpoint(file);
+        eq.setBatchSize(10);
+        eq.setHandLimit(expected.hands / 3);
+        eq.start(ranges, board, 0, true, 0, nullptr, 0.2, 2);
+        eq.wait();
+        TTEST_EQUAL(eq.getResults().hands < expected.hands, true);
+
+        eq.setHandLimit(0);
+        TTEST_EQUAL(eq.resume(file, nullptr, 0.2, 2), true);
+        eq.wait();
+        auto r = eq.getResults();
+        TTEST_EQUAL(r.hands, expected.hands);
+        TTEST_EQUAL(r.winsByPlayerMask == expected.winsByPlayerMask, true);
+        TTEST_EQUAL(r.winningHandCategories == expected.winningHandCategories, true);
+        for (unsigned i = 0; i < 3; ++i)
+            TTEST_EQUAL(r.equity[i], expected.equity[i]);
+
+        // Checkpoint of a finished calculation gives the final results.
+        TTEST_EQUAL(eq.resume(file), true);
+        eq.wait();
+        TTEST_EQUAL(eq.getResults().winsByPlayerMask == expected.winsByPlayerMask, true);
+
+        // Corrupt or truncated checkpoint is rejected. The first combo of the first range starts after the magic,
+        // the player count and the range size.
+        string data;
+        {
+            ifstream is(file, ios::binary);
+            data.assign(istreambuf_iterator<char>(is), istreambuf_iterator<char>());
+        }
+        auto writeFile = [&](const string& contents){ ofstream(file, ios::binary) << contents; };
+        string corrupt = data;
+        corrupt[24] = (char)CARD_COUNT;
+        writeFile(corrupt);
+        TTEST_EQUAL(eq.resume(file), false);
+        corrupt = data;
+        corrupt[25] = corrupt[24];
+        writeFile(corrupt);
+        TTEST_EQUAL(eq.resume(file), false);
+        writeFile(data.substr(0, data.size() / 2));
+        TTEST_EQUAL(eq.resume(file), false);
+        std::remove(file.c_str());
+        TTEST_EQUAL(eq.resume(file), false);
+    }
+
+    TTEST_CASE("work stealing enumerates every preflop once")
+    {
+        vector<CardRange> ranges{"random", "AA", "KQs"};
+        uint64_t board = CardRange::getCardMask("2c3c8h");
+        for (uint64_t sliceEnd : {~0ull, 5ull}) {
+            eq.setEnumerationRange(0, sliceEnd);
+            eq.start(ranges, board, 0, true, 0, nullptr, 0.2, 1);
+            eq.wait();
+            auto expected = eq.getResults();
+            // Threads run out of their own work at different times, and with the small slice most start with none.
+            for (unsigned threads : {3u, 16u}) {
+                eq.start(ranges, board, 0, true, 0, nullptr, 0.2, threads);
+                eq.wait();
+                auto r = eq.getResults();
+                TTEST_EQUAL(r.progress, 1.0);
+                TTEST_EQUAL(r.hands, expected.hands);
+                TTEST_EQUAL(r.winsByPlayerMask == expected.winsByPlayerMask, true);
+            }
+        }
+    }
+
+    TTEST_CASE("pinned threads with per node ranges")
+    {
+        vector<CardRange> ranges{"AK,QQ", "random"};
+        uint64_t board = CardRange::getCardMask("2c3c8h");
+        eq.start(ranges, board, 0, true, 0, nullptr, 0.2, 1);
+        eq.wait();
+        auto expected = eq.getResults();
+        eq.setThreadAffinity({0}, true);
+        for (bool enumerateAll : {true, false}) {
+            eq.setHandLimit(enumerateAll ? 0 : 1000000);
+            eq.start(ranges, board, 0, enumerateAll, 0, nullptr, 0.2, 2);
+            eq.wait();
+            auto r = eq.getResults();
+            if (enumerateAll)
+                TTEST_EQUAL(r.winsByPlayerMask == expected.winsByPlayerMask, true);
+            else
+                TTEST_EQUAL(std::abs(r.equity[0] - expected.equity[0]) < 0.01, true);
+        }
+        eq.setThreadAffinity({});
+    }
+
+    TTEST_CASE("merged enumeration slices")
+    {
+        vector<CardRange> ranges{"random", "AA", "KQs"};
+        uint64_t board = CardRange::getCardMask("2c3c8h");
+        eq.start(ranges, board, 0, true);
+        eq.wait();
+        auto expected = eq.getResults();
+
+        eq.setEnumerationRange(0, 0);
+        eq.start(ranges, board, 0, true);
+        eq.wait();
+        TTEST_EQUAL(eq.getResults().hands, 0ull);
+        uint64_t preflopCombos = eq.getResults().preflopCombos;
+        TTEST_EQUAL(preflopCombos, expected.preflopCombos);
+
+        EquityCalculator::Results merged;
+        // Any order, last slice open ended.
+        vector<pair<uint64_t,uint64_t>> slices{{preflopCombos / 2, ~0ull}, {0, preflopCombos / 3},
+                                               {preflopCombos / 3, preflopCombos / 2}};
+        for (auto& slice : slices) {
+            eq.setEnumerationRange(slice.first, slice.second);
+            eq.start(ranges, board, 0, true, 0, nullptr, 0.2, 2);
+            eq.wait();
+            TTEST_EQUAL(eq.getResults().progress, 1.0);
+            merged.merge(eq.getResults());
+        }
+        TTEST_EQUAL(merged.hands, expected.hands);
+        TTEST_EQUAL(merged.winsByPlayerMask == expected.winsByPlayerMask, true);
+        for (unsigned i = 0; i < 3; ++i)
+            TTEST_EQUAL(merged.equity[i], expected.equity[i]);
+    }
+
+    TTEST_CASE("deadline interrupts enumeration within a preflop")
+    {
+        vector<CardRange> ranges{"random", "random", "random"};
+        eq.start({"AK", "QQ"}, 0, 0, true);
+        eq.wait();
+        TTEST_EQUAL(eq.getResults().interrupted, false);
+
+        for (bool enumerateAll : {true, false}) {
+            auto t = std::chrono::steady_clock::now();
+            eq.setDeadline(t + std::chrono::milliseconds(20));
+            eq.start(ranges, 0, 0, enumerateAll, 0, nullptr, 0.2, 2);
+            eq.wait();
+            double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - t).count();
+            auto r = eq.getResults();
+            TTEST_EQUAL(elapsed < 0.5, true);
+            TTEST_EQUAL(r.finished && r.interrupted, true);
+            // Only complete preflops are counted, and each of them has all the 46 choose 5 boards.
+            if (enumerateAll)
+                TTEST_EQUAL(r.hands % 1370754, 0ull);
+        }
+    }
+
+    TTEST_CASE("fixed board monte carlo")
+    {
+        // Specialized for 2-4 players, generic for other player counts.
+        vector<pair<vector<CardRange>,string>> cases{{{"AK", "QQ"}, "2c3c8hTd"}, {{"AK", "QQ"}, "2c3c8h"},
+                {{"AK", "QQ", "JJ", "A2s", "KQ"}, "2c3c8h"}, {{"random", "AA", "33"}, "2c3c8h6hKd"}};
+        for (auto& c : cases) {
+            uint64_t board = CardRange::getCardMask(c.second);
+            eq.start(c.first, board, 0, true);
+            eq.wait();
+            auto expected = eq.getResults();
+            eq.start(c.first, board, 0, false, 5e-4);
+            eq.wait();
+            auto r = eq.getResults();
+            for (unsigned i = 0; i < c.first.size(); ++i)
+                TTEST_EQUAL(std::abs(r.equity[i] - expected.equity[i]) < 3e-3, true);
+        }
+    }
+
+    TTEST_CASE("flop, turn and river engines match generic enumeration")
+    {
+        vector<pair<vector<CardRange>,string>> cases{{{"AK", "QQ", "random"}, "2c3c8h6h"},
+                {{"random", "AA", "33"}, "2c3c8h6hKd"}, {{"random", "random", "KQs"}, "2c3c8h6hKd"},
+                {{"AKs", "A2s", "random"}, "Ac3c8h6h"}, {{"AK", "QQ", "random"}, "2c3c8h"},
+                {{"AKs", "AK", "QQ+"}, "Ac3c8h"}, {{"AA", "KK", "QQ", "JJ", "TT"}, "2c3c8h"}};
+        for (auto& c : cases) {
+            uint64_t board = CardRange::getCardMask(c.second), dead = CardRange::getCardMask("Td");
+            // Hand categories aren't supported by the rank engines.
+            eq.setHandCategories(true);
+            eq.start(c.first, board, dead, true, 0, nullptr, 0.2, 1);
+            eq.wait();
+            auto expected = eq.getResults();
+            eq.setHandCategories(false);
+            // Slices that cut the river blocks in the middle.
+            EquityCalculator::Results merged;
+            for (uint64_t begin : {0ull, 1001ull, 123457ull}) {
+                eq.setEnumerationRange(begin, begin == 0 ? 1001 : begin == 1001 ? 123457 : ~0ull);
+                eq.start(c.first, board, dead, true, 0, nullptr, 0.2, 2);
+                eq.wait();
+                merged.merge(eq.getResults());
+            }
+            eq.setEnumerationRange();
+            TTEST_EQUAL(merged.hands, expected.hands);
+            TTEST_EQUAL(merged.skippedPreflopCombos, expected.skippedPreflopCombos);
+            TTEST_EQUAL(merged.winsByPlayerMask == expected.winsByPlayerMask, true);
+        }
+    }
+
     TTEST_CASE("test 1 - enumeration") { enumTest(TESTDATA[0]); }
     TTEST_CASE("test 1 - monte carlo") { monteCarloTest(TESTDATA[0]); }
     TTEST_CASE("test 2 - enumeration") { enumTest(TESTDATA[1]); }
@@ -380,6 +840,185 @@ class EquityCalculatorTest : public ttest::TestBase
     TTEST_CASE("test 6 - monte carlo") { monteCarloTest(TESTDATA[5]); }
 };
 
+class EquitySessionTest : public ttest::TestBase
+{
+    EquitySession session;
+
+    TTEST_CASE("next street is reused from previous enumeration")
+    {
+        vector<CardRange> ranges{"AK", "QQ", "JT"};
+        TTEST_EQUAL(session.calculate(ranges, CardRange::getCardMask("2c3c8h"), 0, true), true);
+        TTEST_EQUAL(session.reused(), false);
+        TTEST_EQUAL(session.calculate(ranges, CardRange::getCardMask("2c3c8hKd"), 0, true), true);
+        TTEST_EQUAL(session.reused(), true);
+        auto turn = session.results();
+
+        EquityCalculator eq;
+        eq.start(ranges, CardRange::getCardMask("2c3c8hKd"), 0, true);
+        eq.wait();
+        auto expected = eq.getResults();
+        for (unsigned i = 0; i < 8; ++i)
+            TTEST_EQUAL(turn.winsByPlayerMask[i], expected.winsByPlayerMask[i]);
+        TTEST_EQUAL(turn.equity[1], expected.equity[1]);
+
+        TTEST_EQUAL(session.calculate(ranges, CardRange::getCardMask("2c3c8hKd4s"), 0, true), true);
+        TTEST_EQUAL(session.reused(), false);
+    }
+
+    TTEST_CASE("changed ranges are recalculated")
+    {
+        session.calculate({"AK", "QQ"}, CardRange::getCardMask("2c3c8h"), 0, true);
+        session.calculate({"AK", "JJ"}, CardRange::getCardMask("2c3c8hKd"), 0, true);
+        TTEST_EQUAL(session.reused(), false);
+    }
+};
+
+class EquityCacheTest : public ttest::TestBase
+{
+    EquityCalculator eq;
+
+    TTEST_CASE("isomorphic situation is a hit with results in caller's player order")
+    {
+        EquityCache cache;
+        EquityCalculator::Results r1, r2;
+        TTEST_EQUAL(cache.calculate(eq, {"AhKh", "QsQc", "JT"}, CardRange::getCardMask("2h3d8c"), 0, true, 0, r1),
+                    true);
+        // Hearts and spades swapped and players reversed.
+        vector<CardRange> ranges{"JT", "QhQc", "AsKs"};
+        uint64_t board = CardRange::getCardMask("2s3d8c");
+        TTEST_EQUAL(cache.calculate(eq, ranges, board, 0, true, 0, r2), true);
+        TTEST_EQUAL(cache.stats().hits, 1u);
+        TTEST_EQUAL(cache.stats().misses, 1u);
+
+        eq.start(ranges, board, 0, true);
+        eq.wait();
+        auto expected = eq.getResults();
+        for (unsigned i = 0; i < 3; ++i)
+            TTEST_EQUAL(std::abs(r2.equity[i] - expected.equity[i]) < 1e-9, true);
+        for (unsigned i = 0; i < 8; ++i)
+            TTEST_EQUAL(r2.winsByPlayerMask[i], expected.winsByPlayerMask[i]);
+    }
+
+    TTEST_CASE("monte carlo results are refined and exact results answer everything")
+    {
+        EquityCache cache;
+        EquityCalculator::Results r;
+        cache.calculate(eq, {"AK", "QQ"}, 0, 0, false, 2e-3, r);
+        // Simulation usually overshoots the target.
+        uint64_t hands = r.hands;
+        double stdev = r.stdev;
+        cache.calculate(eq, {"QQ", "AK"}, 0, 0, false, 2 * stdev, r);
+        TTEST_EQUAL(cache.stats().hits, 1u);
+        cache.calculate(eq, {"AK", "QQ"}, 0, 0, false, stdev / 2, r);
+        TTEST_EQUAL(cache.stats().refinements, 1u);
+        TTEST_EQUAL(r.hands > hands && r.stdev < stdev / 2 * 1.1, true);
+        TTEST_EQUAL(std::abs(r.equity[0] - 0.4394) < 0.005, true);
+
+        cache.calculate(eq, {"AK", "QQ"}, 0, 0, true, 0, r);
+        TTEST_EQUAL(cache.stats().misses, 2u);
+        cache.calculate(eq, {"AK", "QQ"}, 0, 0, false, 1e-6, r);
+        TTEST_EQUAL(cache.stats().hits, 2u);
+        TTEST_EQUAL(r.enumerateAll, true);
+    }
+
+    TTEST_CASE("interrupted results are not cached and hand categories have their own entries")
+    {
+        EquityCache cache;
+        EquityCalculator::Results r;
+        eq.setHandLimit(100000);
+        cache.calculate(eq, {"random", "random"}, 0, 0, true, 0, r);
+        TTEST_EQUAL(r.interrupted, true);
+        cache.calculate(eq, {"random", "random"}, 0, 0, true, 0, r);
+        TTEST_EQUAL(cache.stats().misses, 2u);
+        TTEST_EQUAL(cache.stats().entries, 0u);
+        eq.setHandLimit(0);
+
+        cache.calculate(eq, {"AK", "QQ"}, CardRange::getCardMask("2c3c8h"), 0, true, 0, r);
+        eq.setHandCategories(true);
+        cache.calculate(eq, {"AK", "QQ"}, CardRange::getCardMask("2c3c8h"), 0, true, 0, r);
+        eq.setHandCategories(false);
+        TTEST_EQUAL(cache.stats().hits, 0u);
+        TTEST_EQUAL(r.handCategories[0].empty(), false);
+    }
+
+    TTEST_CASE("memory bound evicts least recently used")
+    {
+        EquityCache cache(1);
+        EquityCalculator::Results r;
+        cache.calculate(eq, {"AK", "QQ"}, CardRange::getCardMask("2c3c8h"), 0, true, 0, r);
+        cache.calculate(eq, {"AK", "JJ"}, CardRange::getCardMask("2c3c8h"), 0, true, 0, r);
+        TTEST_EQUAL(cache.stats().entries, 1u);
+        TTEST_EQUAL(cache.stats().evictions, 1u);
+        cache.calculate(eq, {"AK", "JJ"}, CardRange::getCardMask("2c3c8h"), 0, true, 0, r);
+        TTEST_EQUAL(cache.stats().hits, 1u);
+    }
+};
+
+class EquityPoolTest : public ttest::TestBase
+{
+    TTEST_CASE("sliced enumeration is exact")
+    {
+        vector<CardRange> ranges{"random", "AA", "KQs"};
+        uint64_t board = CardRange::getCardMask("2c3c8h");
+        EquityCalculator eq;
+        eq.start(ranges, board, 0, true);
+        eq.wait();
+        auto expected = eq.getResults();
+
+        EquityPool pool(2, 0.002);
+        EquityPool::Query query;
+        query.handRanges = ranges;
+        query.boardCards = board;
+        query.enumerateAll = true;
+        auto r = pool.submit(query).get();
+        TTEST_EQUAL(r.winsByPlayerMask == expected.winsByPlayerMask, true);
+        for (unsigned i = 0; i < 3; ++i)
+            TTEST_EQUAL(r.equity[i], expected.equity[i]);
+
+        // Monte carlo slices are combined until the accuracy is reached.
+        query.enumerateAll = false;
+        query.stdevTarget = 1e-3;
+        r = pool.submit(query).get();
+        TTEST_EQUAL(r.stdev <= 1e-3, true);
+        TTEST_EQUAL(std::abs(r.equity[0] - expected.equity[0]) < 0.01, true);
+
+        query.handRanges = {"AA", "AA", "AA"};
+        TTEST_EQUAL(pool.submit(query).get().players, 0u);
+    }
+
+    TTEST_CASE("slow query doesn't block fast ones")
+    {
+        EquityPool pool(1);
+        std::mutex mutex;
+        vector<int> completed;
+        EquityPool::Query slow;
+        slow.handRanges = {"random", "random", "random", "random", "random", "random"};
+        slow.stdevTarget = 2e-4;
+        pool.submit(slow, [&](const EquityCalculator::Results&){
+            std::lock_guard<std::mutex> lock(mutex);
+            completed.push_back(-1);
+        });
+        EquityPool::Query fast;
+        fast.handRanges = {"AhKh", "QsQc"};
+        fast.boardCards = CardRange::getCardMask("2c3c8h");
+        fast.enumerateAll = true;
+        vector<std::future<EquityCalculator::Results>> results;
+        for (int i = 0; i < 20; ++i)
+            results.push_back(pool.submit(fast));
+        // Low priority query waits for everything else.
+        fast.priority = -1;
+        pool.submit(fast, [&](const EquityCalculator::Results&){
+            std::lock_guard<std::mutex> lock(mutex);
+            completed.push_back(-2);
+        });
+        for (auto& r : results) {
+            TTEST_EQUAL(r.get().hands, 990ull);
+            std::lock_guard<std::mutex> lock(mutex);
+            TTEST_EQUAL(completed.empty(), true);
+        }
+    }
+};
+
 void printBuildInfo()
 {
     cout << "=== Build information ===" << endl;
@@ -410,6 +1049,12 @@ int main()
     HandEvaluatorTest().run();
     cout << "EquityCalculator:" << endl;
     EquityCalculatorTest().run();
+    cout << "EquitySession:" << endl;
+    EquitySessionTest().run();
+    cout << "EquityCache:" << endl;
+    EquityCacheTest().run();
+    cout << "EquityPool:" << endl;
+    EquityPoolTest().run();
 
     cout << endl << endl << "=== Benchmarks ===" << endl;
     void benchmark();
@@ -0,0 +1,176 @@
+// Tests for the C++20 coroutine interface. Built separately from test.cpp, because the rest of the tests are C++11.
+
+#include "omp/EquityCoroutine.h"
+#include "ttest/ttest.h"
+#include <iostream>
+#include <deque>
+#include <condition_variable>
+#include <cmath>
+
+#if __cplusplus < 202002L
+#error "test_coroutine.cpp must be compiled as C++20 or newer."
+#endif
+
+using namespace std;
+using namespace omp;
+
+// Executor that queues the handles for the test thread, like an event loop.
+class QueueExecutor
+{
+public:
+    void post(coroutine_handle<> handle)
+    {
+        lock_guard<mutex> lock(mMutex);
+        mQueue.push_back(handle);
+        mCv.notify_one();
+    }
+
+    // Waits until there's a handle in the queue.
+    void waitPending()
+    {
+        unique_lock<mutex> lock(mMutex);
+        mCv.wait(lock, [&]{ return !mQueue.empty(); });
+    }
+
+    // Resumes the next handle, waiting for one if necessary.
+    void runOne()
+    {
+        waitPending();
+        coroutine_handle<> handle;
+        {
+            lock_guard<mutex> lock(mMutex);
+            handle = mQueue.front();
+            mQueue.pop_front();
+        }
+        handle.resume();
+    }
+
+    size_t pending()
+    {
+        lock_guard<mutex> lock(mMutex);
+        return mQueue.size();
+    }
+
+private:
+    mutex mMutex;
+    condition_variable mCv;
+    deque<coroutine_handle<>> mQueue;
+};
+
+// Coroutine that starts right away on the calling thread and is destroyed with the Task object.
+struct Task
+{
+    struct promise_type
+    {
+        Task get_return_object() { return {coroutine_handle<promise_type>::from_promise(*this)}; }
+        suspend_never initial_suspend() noexcept { return {}; }
+        suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    Task(coroutine_handle<promise_type> handle) : handle(handle) {}
+    Task(const Task&) = delete;
+    ~Task() { if (handle) handle.destroy(); }
+
+    bool done() const { return handle.done(); }
+
+    coroutine_handle<promise_type> handle;
+};
+
+class EquityCoroutineTest : public ttest::TestBase
+{
+    QueueExecutor executor;
+
+    AsyncEquityCalculator calculator()
+    {
+        return AsyncEquityCalculator([this](coroutine_handle<> h){ executor.post(h); }, 1, 0.01);
+    }
+
+    static EquityPool::Query enumerationQuery()
+    {
+        EquityPool::Query query;
+        query.handRanges = {"AK", "QQ"};
+        query.boardCards = CardRange::getCardMask("2c3d8h");
+        query.enumerateAll = true;
+        return query;
+    }
+
+    TTEST_CASE("awaiting a run gives the final results")
+    {
+        AsyncEquityCalculator calc = calculator();
+        EquityCalculator::Results results;
+        auto coro = [&]() -> Task { results = co_await calc.run(enumerationQuery()); };
+        Task task = coro();
+        while (!task.done())
+            executor.runOne();
+
+        EquityCalculator eq;
+        EquityPool::Query query = enumerationQuery();
+        eq.start(query.handRanges, query.boardCards, 0, true);
+        eq.wait();
+        TTEST_EQUAL(results.finished, true);
+        TTEST_EQUAL(results.hands, eq.getResults().hands);
+        TTEST_EQUAL(std::abs(results.equity[0] - eq.getResults().equity[0]) < 1e-9, true);
+    }
+
+    TTEST_CASE("next() streams updates until the final results")
+    {
+        AsyncEquityCalculator calc = calculator();
+        EquityPool::Query query;
+        query.handRanges = {"AK", "QQ"};
+        query.stdevTarget = 5e-4;
+        unsigned updates = 0;
+        bool lastFinished = false;
+        auto coro = [&]() -> Task {
+            EquityRun run = calc.run(query);
+            while (co_await run.next()) {
+                ++updates;
+                lastFinished = run.results().finished;
+            }
+        };
+        Task task = coro();
+        while (!task.done())
+            executor.runOne();
+        TTEST_EQUAL(updates > 0, true);
+        TTEST_EQUAL(lastFinished, true);
+    }
+
+    TTEST_CASE("impossible query finishes without suspending")
+    {
+        AsyncEquityCalculator calc = calculator();
+        EquityPool::Query query;
+        query.handRanges = {"AsAh", "AsAh"};
+        EquityCalculator::Results results;
+        auto coro = [&]() -> Task { results = co_await calc.run(query); };
+        Task task = coro();
+        TTEST_EQUAL(task.done(), true);
+        TTEST_EQUAL(results.players, 0u);
+        TTEST_EQUAL(executor.pending(), 0u);
+    }
+
+    TTEST_CASE("coroutine destroyed while its resumption is scheduled is not resumed")
+    {
+        AsyncEquityCalculator calc = calculator();
+        bool resumed = false;
+        auto coro = [&]() -> Task {
+            co_await calc.run(enumerationQuery());
+            resumed = true;
+        };
+        {
+            Task task = coro();
+            // The calculation has finished and handed the resumption to the executor, but it hasn't run yet.
+            executor.waitPending();
+        }
+        executor.runOne();
+        TTEST_EQUAL(resumed, false);
+        TTEST_EQUAL(executor.pending(), 0u);
+    }
+};
+
+int main()
+{
+    cout << "EquityCoroutine:" << endl;
+    EquityCoroutineTest().run();
+    return 0;
+}